@@ -0,0 +1,564 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.Cirno.Extension.Tests.cpp
+ * PURPOSE:    Implementation for Mile.Cirno Extension Client Tests
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ *             per1cycle (pericycle.cc@gmail.com)
+ */
+
+#include "Mile.Cirno.Tests.h"
+
+#include "Mile.Cirno.LoopbackServer.h"
+
+#include "Mile.Cirno.Core.h"
+#include "Mile.Cirno.Protocol.Parser.h"
+
+#include <memory>
+#include <thread>
+
+#include "Aptx.Posix.Error.h"
+
+namespace
+{
+    // The test client, which is connected and attached to the root of the
+    // loopback server.
+    struct TestClient
+    {
+        std::unique_ptr<Mile::Cirno::Client> Instance;
+        std::uint32_t RootFileId = MILE_CIRNO_NOFID;
+        std::string ProtocolVersion;
+    };
+
+    TestClient Connect(
+        Mile::Cirno::LoopbackServer& Server,
+        std::string const& ProtocolVersion)
+    {
+        TestClient Result;
+        Result.Instance.reset(Mile::Cirno::Client::ConnectWithTcpSocket(
+            "127.0.0.1",
+            Server.GetPort()));
+
+        Mile::Cirno::VersionRequest VersionRequest;
+        VersionRequest.MaximumMessageSize =
+            Mile::Cirno::DefaultMaximumMessageSize;
+        VersionRequest.ProtocolVersion = ProtocolVersion;
+        Mile::Cirno::VersionResponse VersionResponse;
+        if (0 != Result.Instance->Version(VersionRequest, VersionResponse))
+        {
+            Mile::Cirno::ThrowException("Version", -1);
+        }
+        Result.ProtocolVersion = VersionResponse.ProtocolVersion;
+
+        Mile::Cirno::AttachRequest AttachRequest;
+        AttachRequest.FileId = Result.Instance->AllocateFileId();
+        AttachRequest.AuthenticationFileId = MILE_CIRNO_NOFID;
+        AttachRequest.UserName = "";
+        AttachRequest.AccessName = "";
+        AttachRequest.NumericUserName = MILE_CIRNO_NONUNAME;
+        Mile::Cirno::AttachResponse AttachResponse;
+        if (0 != Result.Instance->Attach(AttachRequest, AttachResponse))
+        {
+            Mile::Cirno::ThrowException("Attach", -1);
+        }
+        Result.RootFileId = AttachRequest.FileId;
+
+        return Result;
+    }
+
+    std::uint32_t OpenFile(
+        TestClient& Client,
+        std::string const& Name,
+        std::uint32_t const& Flags,
+        std::uint32_t& FileId)
+    {
+        Mile::Cirno::WalkRequest WalkRequest;
+        WalkRequest.FileId = Client.RootFileId;
+        WalkRequest.NewFileId = Client.Instance->AllocateFileId();
+        WalkRequest.Names.push_back(Name);
+        Mile::Cirno::WalkResponse WalkResponse;
+        std::uint32_t ErrorCode = Client.Instance->Walk(
+            WalkRequest,
+            WalkResponse);
+        if (0 != ErrorCode)
+        {
+            Client.Instance->FreeFileId(WalkRequest.NewFileId);
+            return ErrorCode;
+        }
+
+        Mile::Cirno::LinuxOpenRequest OpenRequest;
+        OpenRequest.FileId = WalkRequest.NewFileId;
+        OpenRequest.Flags = Flags;
+        Mile::Cirno::LinuxOpenResponse OpenResponse;
+        ErrorCode = Client.Instance->LinuxOpen(OpenRequest, OpenResponse);
+        if (0 != ErrorCode)
+        {
+            return ErrorCode;
+        }
+
+        FileId = WalkRequest.NewFileId;
+        return 0;
+    }
+
+    // Walk the file with the compound-local file ID, open it and read it
+    // from the beginning.
+    std::vector<Mile::Cirno::PipelinedRequest> MakeCompoundRead(
+        std::uint32_t const& RootFileId,
+        std::string const& Name)
+    {
+        std::vector<Mile::Cirno::PipelinedRequest> Operations(3);
+
+        Mile::Cirno::WalkRequest WalkRequest;
+        WalkRequest.FileId = RootFileId;
+        WalkRequest.NewFileId = MILE_CIRNO_COMPOUND_FID_BASE;
+        WalkRequest.Names.push_back(Name);
+        Operations[0].RequestType = MileCirnoWalkRequestMessage;
+        Operations[0].ResponseType = MileCirnoWalkResponseMessage;
+        Mile::Cirno::PushWalkRequest(
+            Operations[0].RequestContent,
+            WalkRequest);
+
+        Mile::Cirno::LinuxOpenRequest OpenRequest;
+        OpenRequest.FileId = MILE_CIRNO_COMPOUND_FID_BASE;
+        OpenRequest.Flags = MileCirnoLinuxOpenCreateFlagReadOnly;
+        Operations[1].RequestType = MileCirnoLinuxOpenRequestMessage;
+        Operations[1].ResponseType = MileCirnoLinuxOpenResponseMessage;
+        Mile::Cirno::PushLinuxOpenRequest(
+            Operations[1].RequestContent,
+            OpenRequest);
+
+        Mile::Cirno::ReadRequest ReadRequest;
+        ReadRequest.FileId = MILE_CIRNO_COMPOUND_FID_BASE;
+        ReadRequest.Offset = 0;
+        ReadRequest.Count = 4096;
+        Operations[2].RequestType = MileCirnoReadRequestMessage;
+        Operations[2].ResponseType = MileCirnoReadResponseMessage;
+        Mile::Cirno::PushReadRequest(
+            Operations[2].RequestContent,
+            ReadRequest);
+
+        return Operations;
+    }
+
+    bool IsCompoundReadOf(
+        std::vector<Mile::Cirno::PipelinedRequest>& Operations,
+        std::vector<std::uint8_t> const& Content)
+    {
+        for (Mile::Cirno::PipelinedRequest const& Operation : Operations)
+        {
+            if (0 != Operation.ErrorCode)
+            {
+                return false;
+            }
+        }
+        std::span<std::uint8_t> Buffer =
+            std::span<std::uint8_t>(Operations[2].ResponseContent);
+        return Mile::Cirno::PopReadResponse(Buffer).Data == Content;
+    }
+
+    bool IsCompoundReadNotFound(
+        std::vector<Mile::Cirno::PipelinedRequest> const& Operations)
+    {
+        return
+            APTX_ENOENT == Operations[0].ErrorCode &&
+            APTX_LINUX_ECANCELED == Operations[1].ErrorCode &&
+            APTX_LINUX_ECANCELED == Operations[2].ErrorCode;
+    }
+
+    // Every byte is repeated 64 times, so it is compressible.
+    std::vector<std::uint8_t> MakeCompressibleContent(
+        std::size_t const& Size)
+    {
+        std::vector<std::uint8_t> Result(Size);
+        for (std::size_t i = 0; i < Size; ++i)
+        {
+            Result[i] = static_cast<std::uint8_t>(i / 64);
+        }
+        return Result;
+    }
+}
+
+bool TestVersionNegotiation()
+{
+    Mile::Cirno::LoopbackServer Server(true);
+    TestClient Client = ::Connect(
+        Server,
+        Mile::Cirno::ExtendedProtocolVersion);
+    return Mile::Cirno::ExtendedProtocolVersion == Client.ProtocolVersion;
+}
+
+bool TestVersionFallback()
+{
+    Mile::Cirno::LoopbackServer Server(false);
+    TestClient Client = ::Connect(
+        Server,
+        Mile::Cirno::ExtendedProtocolVersion);
+    return Mile::Cirno::DefaultProtocolVersion == Client.ProtocolVersion;
+}
+
+bool TestExtensionRefused()
+{
+    Mile::Cirno::LoopbackServer Server(true);
+    Server.AddFile("a.txt", { 'a' });
+    TestClient Client = ::Connect(
+        Server,
+        Mile::Cirno::DefaultProtocolVersion);
+    std::uint32_t FileId = MILE_CIRNO_NOFID;
+    if (0 != ::OpenFile(
+        Client,
+        "a.txt",
+        MileCirnoLinuxOpenCreateFlagWriteOnly,
+        FileId))
+    {
+        return false;
+    }
+    Mile::Cirno::AppendRequest Request;
+    Request.FileId = FileId;
+    Request.Data = { 'b' };
+    Mile::Cirno::AppendResponse Response;
+    return
+        APTX_LINUX_ENOSYS == Client.Instance->Append(Request, Response) &&
+        Server.GetFileContent("a.txt") == std::vector<std::uint8_t>{ 'a' };
+}
+
+bool TestCompound()
+{
+    Mile::Cirno::LoopbackServer Server(true);
+    Server.AddFile("a.txt", { 'H', 'e', 'l', 'l', 'o' });
+    TestClient Client = ::Connect(
+        Server,
+        Mile::Cirno::ExtendedProtocolVersion);
+    std::vector<Mile::Cirno::PipelinedRequest> Operations =
+        ::MakeCompoundRead(Client.RootFileId, "a.txt");
+    if (0 != Client.Instance->Compound(Operations))
+    {
+        return false;
+    }
+    // Only the root file ID is left because the compound-local one is
+    // clunked by the server.
+    return
+        ::IsCompoundReadOf(Operations, { 'H', 'e', 'l', 'l', 'o' }) &&
+        1 == Server.GetMessageCount(MileCirnoCompoundRequestMessage) &&
+        0 == Server.GetMessageCount(MileCirnoClunkRequestMessage) &&
+        1 == Server.GetFileIdCount();
+}
+
+bool TestCompoundFailure()
+{
+    Mile::Cirno::LoopbackServer Server(true);
+    TestClient Client = ::Connect(
+        Server,
+        Mile::Cirno::ExtendedProtocolVersion);
+    std::vector<Mile::Cirno::PipelinedRequest> Operations =
+        ::MakeCompoundRead(Client.RootFileId, "missing.txt");
+    return
+        0 == Client.Instance->Compound(Operations) &&
+        ::IsCompoundReadNotFound(Operations) &&
+        1 == Server.GetFileIdCount();
+}
+
+bool TestPipelinedCompound()
+{
+    Mile::Cirno::LoopbackServer Server(true);
+    Server.AddFile("a.txt", { 'A' });
+    Server.AddFile("b.txt", { 'B', 'B' });
+    TestClient Client = ::Connect(
+        Server,
+        Mile::Cirno::ExtendedProtocolVersion);
+    std::vector<std::vector<Mile::Cirno::PipelinedRequest>> Compounds;
+    Compounds.push_back(::MakeCompoundRead(Client.RootFileId, "a.txt"));
+    Compounds.push_back(::MakeCompoundRead(Client.RootFileId, "c.txt"));
+    Compounds.push_back(::MakeCompoundRead(Client.RootFileId, "b.txt"));
+    Client.Instance->PipelinedCompound(Compounds);
+    return
+        ::IsCompoundReadOf(Compounds[0], { 'A' }) &&
+        ::IsCompoundReadNotFound(Compounds[1]) &&
+        ::IsCompoundReadOf(Compounds[2], { 'B', 'B' }) &&
+        3 == Server.GetMessageCount(MileCirnoCompoundRequestMessage) &&
+        1 == Server.GetFileIdCount();
+}
+
+bool TestPipelinedCompoundFallback()
+{
+    // The whole Tcompound is refused, so every operation of each group gets
+    // the error of Tcompound.
+    Mile::Cirno::LoopbackServer Server(false);
+    Server.AddFile("a.txt", { 'A' });
+    TestClient Client = ::Connect(
+        Server,
+        Mile::Cirno::ExtendedProtocolVersion);
+    std::vector<std::vector<Mile::Cirno::PipelinedRequest>> Compounds;
+    Compounds.push_back(::MakeCompoundRead(Client.RootFileId, "a.txt"));
+    Client.Instance->PipelinedCompound(Compounds);
+    for (Mile::Cirno::PipelinedRequest const& Operation : Compounds[0])
+    {
+        if (APTX_LINUX_ENOSYS != Operation.ErrorCode)
+        {
+            return false;
+        }
+    }
+    return 1 == Server.GetFileIdCount();
+}
+
+bool TestLeaseAndNotify()
+{
+    const std::uint64_t LeaseKey = 0x0102030405060708;
+
+    Mile::Cirno::LoopbackServer Server(true);
+    Server.AddFile("a.txt", { 'a' });
+    TestClient Client = ::Connect(
+        Server,
+        Mile::Cirno::ExtendedProtocolVersion);
+    TestClient NotificationClient = ::Connect(
+        Server,
+        Mile::Cirno::ExtendedProtocolVersion);
+
+    std::uint32_t FileId = MILE_CIRNO_NOFID;
+    if (0 != ::OpenFile(
+        Client,
+        "a.txt",
+        MileCirnoLinuxOpenCreateFlagReadWrite,
+        FileId))
+    {
+        return false;
+    }
+    Mile::Cirno::LeaseRequest LeaseRequest;
+    LeaseRequest.FileId = FileId;
+    LeaseRequest.Key = LeaseKey;
+    Mile::Cirno::LeaseResponse LeaseResponse;
+    if (0 != Client.Instance->Lease(LeaseRequest, LeaseResponse) ||
+        !LeaseResponse.Duration)
+    {
+        return false;
+    }
+
+    // Tnotify blocks its connection until the lease is broken.
+    std::uint32_t NotifyErrorCode = APTX_EIO;
+    Mile::Cirno::NotifyResponse NotifyResponse;
+    std::thread NotificationThread([&]()
+    {
+        Mile::Cirno::NotifyRequest NotifyRequest;
+        NotifyRequest.Key = LeaseKey;
+        NotifyErrorCode = NotificationClient.Instance->Notify(
+            NotifyRequest,
+            NotifyResponse);
+    });
+
+    std::uint8_t Data = 'b';
+    std::uint32_t NumberOfBytesWritten = 0;
+    std::uint32_t WriteErrorCode = Client.Instance->Write(
+        FileId,
+        0,
+        &Data,
+        sizeof(Data),
+        NumberOfBytesWritten);
+    NotificationThread.join();
+    return
+        0 == WriteErrorCode &&
+        0 == NotifyErrorCode &&
+        1 == NotifyResponse.UniqueIds.size() &&
+        LeaseResponse.UniqueId.Path == NotifyResponse.UniqueIds[0].Path;
+}
+
+bool TestCopyRange()
+{
+    Mile::Cirno::LoopbackServer Server(true);
+    std::vector<std::uint8_t> Content = ::MakeCompressibleContent(10000);
+    Server.AddFile("source.bin", Content);
+    Server.AddFile("target.bin", {});
+    TestClient Client = ::Connect(
+        Server,
+        Mile::Cirno::ExtendedProtocolVersion);
+
+    std::uint32_t SourceFileId = MILE_CIRNO_NOFID;
+    std::uint32_t TargetFileId = MILE_CIRNO_NOFID;
+    if (0 != ::OpenFile(
+        Client,
+        "source.bin",
+        MileCirnoLinuxOpenCreateFlagReadOnly,
+        SourceFileId) ||
+        0 != ::OpenFile(
+            Client,
+            "target.bin",
+            MileCirnoLinuxOpenCreateFlagWriteOnly,
+            TargetFileId))
+    {
+        return false;
+    }
+
+    Mile::Cirno::CopyRangeRequest Request;
+    Request.FileId = SourceFileId;
+    Request.Offset = 0;
+    Request.DestinationFileId = TargetFileId;
+    Request.DestinationOffset = 0;
+    Request.Count = Content.size();
+    Mile::Cirno::CopyRangeResponse Response;
+    return
+        0 == Client.Instance->CopyRange(Request, Response) &&
+        Content.size() == Response.Count &&
+        Server.GetFileContent("target.bin") == Content &&
+        0 == Server.GetMessageCount(MileCirnoReadRequestMessage) &&
+        0 == Server.GetMessageCount(MileCirnoWriteRequestMessage);
+}
+
+bool TestCompressedReadAndWrite()
+{
+    Mile::Cirno::LoopbackServer Server(true);
+    Server.AddFile("a.bin", {});
+    TestClient Client = ::Connect(
+        Server,
+        Mile::Cirno::ExtendedProtocolVersion);
+    if (!Client.Instance->EnableCompression())
+    {
+        return false;
+    }
+
+    std::uint32_t FileId = MILE_CIRNO_NOFID;
+    if (0 != ::OpenFile(
+        Client,
+        "a.bin",
+        MileCirnoLinuxOpenCreateFlagReadWrite,
+        FileId))
+    {
+        return false;
+    }
+
+    std::vector<std::uint8_t> Content = ::MakeCompressibleContent(65536);
+    std::uint32_t NumberOfBytesWritten = 0;
+    if (0 != Client.Instance->Write(
+        FileId,
+        0,
+        Content.data(),
+        static_cast<std::uint32_t>(Content.size()),
+        NumberOfBytesWritten) ||
+        Content.size() != NumberOfBytesWritten ||
+        Server.GetFileContent("a.bin") != Content)
+    {
+        return false;
+    }
+
+    std::vector<std::uint8_t> ReadContent(Content.size());
+    std::uint32_t NumberOfBytesRead = 0;
+    if (0 != Client.Instance->Read(
+        FileId,
+        0,
+        ReadContent.data(),
+        static_cast<std::uint32_t>(ReadContent.size()),
+        NumberOfBytesRead) ||
+        Content.size() != NumberOfBytesRead ||
+        ReadContent != Content)
+    {
+        return false;
+    }
+
+    return
+        1 == Server.GetMessageCount(MileCirnoCompressedWriteRequestMessage) &&
+        1 == Server.GetMessageCount(MileCirnoCompressedReadRequestMessage) &&
+        0 == Server.GetMessageCount(MileCirnoWriteRequestMessage) &&
+        0 == Server.GetMessageCount(MileCirnoReadRequestMessage);
+}
+
+bool TestCompressionFallback()
+{
+    // Tcwrite is refused once, and the plain messages are used since then.
+    Mile::Cirno::LoopbackServer Server(false);
+    Server.AddFile("a.bin", {});
+    TestClient Client = ::Connect(
+        Server,
+        Mile::Cirno::ExtendedProtocolVersion);
+    if (!Client.Instance->EnableCompression())
+    {
+        return false;
+    }
+
+    std::uint32_t FileId = MILE_CIRNO_NOFID;
+    if (0 != ::OpenFile(
+        Client,
+        "a.bin",
+        MileCirnoLinuxOpenCreateFlagReadWrite,
+        FileId))
+    {
+        return false;
+    }
+
+    std::vector<std::uint8_t> Content = ::MakeCompressibleContent(65536);
+    for (std::size_t i = 0; i < 2; ++i)
+    {
+        std::uint32_t NumberOfBytesWritten = 0;
+        if (0 != Client.Instance->Write(
+            FileId,
+            0,
+            Content.data(),
+            static_cast<std::uint32_t>(Content.size()),
+            NumberOfBytesWritten) ||
+            Content.size() != NumberOfBytesWritten)
+        {
+            return false;
+        }
+    }
+
+    std::vector<std::uint8_t> ReadContent(Content.size());
+    std::uint32_t NumberOfBytesRead = 0;
+    if (0 != Client.Instance->Read(
+        FileId,
+        0,
+        ReadContent.data(),
+        static_cast<std::uint32_t>(ReadContent.size()),
+        NumberOfBytesRead) ||
+        Content.size() != NumberOfBytesRead ||
+        ReadContent != Content)
+    {
+        return false;
+    }
+
+    return
+        Server.GetFileContent("a.bin") == Content &&
+        1 == Server.GetMessageCount(MileCirnoCompressedWriteRequestMessage) &&
+        0 == Server.GetMessageCount(MileCirnoCompressedReadRequestMessage) &&
+        2 == Server.GetMessageCount(MileCirnoWriteRequestMessage) &&
+        1 == Server.GetMessageCount(MileCirnoReadRequestMessage);
+}
+
+bool TestAppend()
+{
+    Mile::Cirno::LoopbackServer Server(true);
+    Server.AddFile("a.log", { 'a', 'b' });
+    TestClient Client = ::Connect(
+        Server,
+        Mile::Cirno::ExtendedProtocolVersion);
+    std::uint32_t FileId = MILE_CIRNO_NOFID;
+    if (0 != ::OpenFile(
+        Client,
+        "a.log",
+        MileCirnoLinuxOpenCreateFlagWriteOnly,
+        FileId))
+    {
+        return false;
+    }
+
+    Mile::Cirno::AppendRequest Request;
+    Request.FileId = FileId;
+    Request.Data = { 'c', 'd' };
+    Mile::Cirno::AppendResponse FirstResponse;
+    if (0 != Client.Instance->Append(Request, FirstResponse))
+    {
+        return false;
+    }
+    Request.Data = { 'e' };
+    Mile::Cirno::AppendResponse SecondResponse;
+    if (0 != Client.Instance->Append(Request, SecondResponse))
+    {
+        return false;
+    }
+    return
+        2 == FirstResponse.Offset &&
+        2 == FirstResponse.Count &&
+        4 == SecondResponse.Offset &&
+        1 == SecondResponse.Count &&
+        Server.GetFileContent("a.log") == std::vector<std::uint8_t>
+        {
+            'a', 'b', 'c', 'd', 'e',
+        };
+}
@@ -0,0 +1,807 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.Cirno.LoopbackServer.cpp
+ * PURPOSE:    Implementation for Mile.Cirno Loopback Reference Server
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ *             per1cycle (pericycle.cc@gmail.com)
+ */
+
+#include "Mile.Cirno.LoopbackServer.h"
+
+#include "Mile.Cirno.Core.h"
+#include "Mile.Cirno.Protocol.Parser.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "Aptx.Posix.Error.h"
+
+namespace
+{
+    bool ReceiveAll(
+        SOCKET const& Socket,
+        std::uint8_t* Buffer,
+        std::size_t Size)
+    {
+        while (Size)
+        {
+            int Received = ::recv(
+                Socket,
+                reinterpret_cast<char*>(Buffer),
+                static_cast<int>(Size),
+                0);
+            if (Received <= 0)
+            {
+                return false;
+            }
+            Buffer += Received;
+            Size -= Received;
+        }
+        return true;
+    }
+
+    bool SendAll(
+        SOCKET const& Socket,
+        std::uint8_t const* Buffer,
+        std::size_t Size)
+    {
+        while (Size)
+        {
+            int Sent = ::send(
+                Socket,
+                reinterpret_cast<char const*>(Buffer),
+                static_cast<int>(Size),
+                0);
+            if (Sent <= 0)
+            {
+                return false;
+            }
+            Buffer += Sent;
+            Size -= Sent;
+        }
+        return true;
+    }
+
+    bool IsExtensionMessage(
+        std::uint8_t const& Type)
+    {
+        return
+            Type >= MileCirnoCompoundRequestMessage &&
+            Type <= MileCirnoAppendResponseMessage;
+    }
+}
+
+Mile::Cirno::LoopbackServer::LoopbackServer(
+    bool const& ExtensionSupported)
+{
+    this->m_ExtensionSupported = ExtensionSupported;
+
+    this->m_Root = std::make_shared<Node>();
+    this->m_Root->UniqueId.Type = MileCirnoQidTypeDirectory;
+    this->m_Root->UniqueId.Version = 0;
+    this->m_Root->UniqueId.Path = this->m_NextPath++;
+
+    const DWORD Algorithm = COMPRESS_ALGORITHM_XPRESS | COMPRESS_RAW;
+    if (!::CreateCompressor(Algorithm, nullptr, &this->m_Compressor))
+    {
+        Mile::Cirno::ThrowException("CreateCompressor", ::GetLastError());
+    }
+    if (!::CreateDecompressor(Algorithm, nullptr, &this->m_Decompressor))
+    {
+        Mile::Cirno::ThrowException("CreateDecompressor", ::GetLastError());
+    }
+
+    this->m_ListenSocket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (INVALID_SOCKET == this->m_ListenSocket)
+    {
+        Mile::Cirno::ThrowException("socket", ::WSAGetLastError());
+    }
+
+    sockaddr_in Address = {};
+    Address.sin_family = AF_INET;
+    Address.sin_addr.s_addr = ::htonl(INADDR_LOOPBACK);
+    Address.sin_port = 0;
+    if (SOCKET_ERROR == ::bind(
+        this->m_ListenSocket,
+        reinterpret_cast<sockaddr*>(&Address),
+        sizeof(Address)))
+    {
+        Mile::Cirno::ThrowException("bind", ::WSAGetLastError());
+    }
+    int AddressLength = sizeof(Address);
+    if (SOCKET_ERROR == ::getsockname(
+        this->m_ListenSocket,
+        reinterpret_cast<sockaddr*>(&Address),
+        &AddressLength))
+    {
+        Mile::Cirno::ThrowException("getsockname", ::WSAGetLastError());
+    }
+    if (SOCKET_ERROR == ::listen(this->m_ListenSocket, SOMAXCONN))
+    {
+        Mile::Cirno::ThrowException("listen", ::WSAGetLastError());
+    }
+    this->m_Port = std::to_string(::ntohs(Address.sin_port));
+
+    this->m_AcceptThread = std::thread([this]()
+    {
+        this->AcceptConnections();
+    });
+}
+
+Mile::Cirno::LoopbackServer::~LoopbackServer()
+{
+    {
+        std::lock_guard<std::mutex> Guard(this->m_Mutex);
+        this->m_Stopping = true;
+        for (Connection* Current : this->m_Connections)
+        {
+            ::shutdown(Current->Socket, SD_BOTH);
+        }
+    }
+    this->m_LeaseCondition.notify_all();
+
+    // Closing the listening socket fails the pending accept.
+    ::shutdown(this->m_ListenSocket, SD_BOTH);
+    ::closesocket(this->m_ListenSocket);
+    this->m_AcceptThread.join();
+    for (std::thread& ConnectionThread : this->m_ConnectionThreads)
+    {
+        ConnectionThread.join();
+    }
+
+    ::CloseCompressor(this->m_Compressor);
+    ::CloseDecompressor(this->m_Decompressor);
+}
+
+std::string const& Mile::Cirno::LoopbackServer::GetPort() const
+{
+    return this->m_Port;
+}
+
+void Mile::Cirno::LoopbackServer::AddFile(
+    std::string const& Name,
+    std::vector<std::uint8_t> const& Content)
+{
+    std::lock_guard<std::mutex> Guard(this->m_Mutex);
+    std::shared_ptr<Node> Target = std::make_shared<Node>();
+    Target->UniqueId.Type = MileCirnoQidTypeFile;
+    Target->UniqueId.Version = 0;
+    Target->UniqueId.Path = this->m_NextPath++;
+    Target->Content = Content;
+    this->m_Files[Name] = Target;
+    this->MarkChanged(this->m_Root);
+}
+
+std::vector<std::uint8_t> Mile::Cirno::LoopbackServer::GetFileContent(
+    std::string const& Name)
+{
+    std::lock_guard<std::mutex> Guard(this->m_Mutex);
+    auto Iterator = this->m_Files.find(Name);
+    if (this->m_Files.end() == Iterator)
+    {
+        return {};
+    }
+    return Iterator->second->Content;
+}
+
+std::size_t Mile::Cirno::LoopbackServer::GetMessageCount(
+    MILE_CIRNO_MESSAGE_TYPE const& Type)
+{
+    std::lock_guard<std::mutex> Guard(this->m_Mutex);
+    auto Iterator = this->m_MessageCounts.find(Type);
+    return this->m_MessageCounts.end() == Iterator ? 0 : Iterator->second;
+}
+
+std::size_t Mile::Cirno::LoopbackServer::GetFileIdCount()
+{
+    std::lock_guard<std::mutex> Guard(this->m_Mutex);
+    std::size_t Result = 0;
+    for (Connection* Current : this->m_Connections)
+    {
+        Result += Current->FileIds.size();
+    }
+    return Result;
+}
+
+void Mile::Cirno::LoopbackServer::AcceptConnections()
+{
+    for (;;)
+    {
+        SOCKET Socket = ::accept(this->m_ListenSocket, nullptr, nullptr);
+        if (INVALID_SOCKET == Socket)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> Guard(this->m_Mutex);
+        if (this->m_Stopping)
+        {
+            ::closesocket(Socket);
+            return;
+        }
+        Connection* Current = new Connection();
+        Current->Socket = Socket;
+        this->m_Connections.push_back(Current);
+        this->m_ConnectionThreads.emplace_back([this, Current]()
+        {
+            this->ServeConnection(Current);
+        });
+    }
+}
+
+void Mile::Cirno::LoopbackServer::ServeConnection(
+    Connection* Current)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    std::vector<std::uint8_t> Response;
+    for (;;)
+    {
+        RequestBuffer.resize(Mile::Cirno::HeaderSize);
+        if (!::ReceiveAll(
+            Current->Socket,
+            RequestBuffer.data(),
+            RequestBuffer.size()))
+        {
+            break;
+        }
+        std::span<std::uint8_t> HeaderSpan =
+            std::span<std::uint8_t>(RequestBuffer);
+        Mile::Cirno::Header RequestHeader = Mile::Cirno::PopHeader(HeaderSpan);
+        RequestBuffer.resize(RequestHeader.Size);
+        if (RequestHeader.Size && !::ReceiveAll(
+            Current->Socket,
+            RequestBuffer.data(),
+            RequestBuffer.size()))
+        {
+            break;
+        }
+
+        Response.clear();
+        std::uint32_t ErrorCode = 0;
+        {
+            std::unique_lock<std::mutex> Lock(this->m_Mutex);
+            ++this->m_MessageCounts[static_cast<MILE_CIRNO_MESSAGE_TYPE>(
+                RequestHeader.Type)];
+            ErrorCode = this->HandleMessage(
+                Current,
+                Lock,
+                RequestHeader.Type,
+                std::span<std::uint8_t>(RequestBuffer),
+                Response);
+        }
+        Mile::Cirno::Header ResponseHeader;
+        ResponseHeader.Tag = RequestHeader.Tag;
+        if (ErrorCode)
+        {
+            Response.clear();
+            Mile::Cirno::PushUInt32(Response, ErrorCode);
+            ResponseHeader.Type = MileCirnoLinuxErrorResponseMessage;
+        }
+        else
+        {
+            ResponseHeader.Type = RequestHeader.Type + 1;
+        }
+        ResponseHeader.Size = static_cast<std::uint32_t>(Response.size());
+        std::vector<std::uint8_t> ResponseBuffer;
+        Mile::Cirno::PushHeader(ResponseBuffer, ResponseHeader);
+        ResponseBuffer.insert(
+            ResponseBuffer.end(),
+            Response.begin(),
+            Response.end());
+        if (!::SendAll(
+            Current->Socket,
+            ResponseBuffer.data(),
+            ResponseBuffer.size()))
+        {
+            break;
+        }
+    }
+
+    std::lock_guard<std::mutex> Guard(this->m_Mutex);
+    this->m_Connections.erase(std::remove(
+        this->m_Connections.begin(),
+        this->m_Connections.end(),
+        Current), this->m_Connections.end());
+    ::closesocket(Current->Socket);
+    delete Current;
+}
+
+Mile::Cirno::LoopbackServer::FileIdEntry*
+Mile::Cirno::LoopbackServer::LookupFileId(
+    Connection* Current,
+    std::uint32_t const& FileId)
+{
+    auto Iterator = Current->FileIds.find(FileId);
+    if (Current->FileIds.end() == Iterator)
+    {
+        return nullptr;
+    }
+    return &Iterator->second;
+}
+
+void Mile::Cirno::LoopbackServer::MarkChanged(
+    std::shared_ptr<Node> const& Target)
+{
+    ++Target->UniqueId.Version;
+    bool Broken = false;
+    for (auto& [Key, LeasedFiles] : this->m_Leases)
+    {
+        auto Iterator = LeasedFiles.find(Target->UniqueId.Path);
+        if (LeasedFiles.end() != Iterator)
+        {
+            this->m_BrokenLeases[Key].push_back(Target->UniqueId);
+            LeasedFiles.erase(Iterator);
+            Broken = true;
+        }
+    }
+    if (Broken)
+    {
+        this->m_LeaseCondition.notify_all();
+    }
+}
+
+std::uint32_t Mile::Cirno::LoopbackServer::WriteContent(
+    std::shared_ptr<Node> const& Target,
+    std::uint64_t const& Offset,
+    std::span<std::uint8_t> Data)
+{
+    if (Target->Content.size() < Offset + Data.size())
+    {
+        Target->Content.resize(Offset + Data.size());
+    }
+    std::copy(
+        Data.begin(),
+        Data.end(),
+        Target->Content.begin() + Offset);
+    this->MarkChanged(Target);
+    return static_cast<std::uint32_t>(Data.size());
+}
+
+std::uint32_t Mile::Cirno::LoopbackServer::HandleMessage(
+    Connection* Current,
+    std::unique_lock<std::mutex>& Lock,
+    std::uint8_t const& Type,
+    std::span<std::uint8_t> Request,
+    std::vector<std::uint8_t>& Response)
+{
+    if (::IsExtensionMessage(Type) && !Current->ExtensionNegotiated)
+    {
+        return APTX_LINUX_ENOSYS;
+    }
+
+    switch (Type)
+    {
+    case MileCirnoVersionRequestMessage:
+    {
+        std::uint32_t MaximumMessageSize = Mile::Cirno::PopUInt32(Request);
+        std::string ProtocolVersion = Mile::Cirno::PopString(Request);
+        Current->FileIds.clear();
+        Current->ExtensionNegotiated =
+            this->m_ExtensionSupported &&
+            Mile::Cirno::ExtendedProtocolVersion == ProtocolVersion;
+        if (!Current->ExtensionNegotiated)
+        {
+            ProtocolVersion =
+                0 == ProtocolVersion.rfind(
+                    Mile::Cirno::DefaultProtocolVersion,
+                    0)
+                ? Mile::Cirno::DefaultProtocolVersion
+                : "unknown";
+        }
+        Mile::Cirno::PushUInt32(Response, MaximumMessageSize);
+        Mile::Cirno::PushString(Response, ProtocolVersion);
+        return 0;
+    }
+    case MileCirnoAttachRequestMessage:
+    {
+        std::uint32_t FileId = Mile::Cirno::PopUInt32(Request);
+        if (this->LookupFileId(Current, FileId))
+        {
+            return APTX_EBADF;
+        }
+        Current->FileIds[FileId].Target = this->m_Root;
+        Mile::Cirno::PushQid(Response, this->m_Root->UniqueId);
+        return 0;
+    }
+    case MileCirnoWalkRequestMessage:
+    {
+        std::uint32_t FileId = Mile::Cirno::PopUInt32(Request);
+        std::uint32_t NewFileId = Mile::Cirno::PopUInt32(Request);
+        std::uint16_t Count = Mile::Cirno::PopUInt16(Request);
+        FileIdEntry* Source = this->LookupFileId(Current, FileId);
+        if (!Source || Source->Opened)
+        {
+            return APTX_EBADF;
+        }
+        if (NewFileId != FileId && this->LookupFileId(Current, NewFileId))
+        {
+            return APTX_EBADF;
+        }
+        // The tree is flat, so only the root has children.
+        std::shared_ptr<Node> Target = Source->Target;
+        std::vector<Mile::Cirno::Qid> UniqueIds;
+        for (std::uint16_t i = 0; i < Count; ++i)
+        {
+            std::string Name = Mile::Cirno::PopString(Request);
+            auto Iterator = this->m_Files.find(Name);
+            if (Target != this->m_Root || this->m_Files.end() == Iterator)
+            {
+                if (0 == i)
+                {
+                    return APTX_ENOENT;
+                }
+                Target = nullptr;
+                break;
+            }
+            Target = Iterator->second;
+            UniqueIds.push_back(Target->UniqueId);
+        }
+        if (Target)
+        {
+            Current->FileIds[NewFileId] = FileIdEntry{ Target, false };
+        }
+        Mile::Cirno::PushUInt16(
+            Response,
+            static_cast<std::uint16_t>(UniqueIds.size()));
+        for (Mile::Cirno::Qid const& UniqueId : UniqueIds)
+        {
+            Mile::Cirno::PushQid(Response, UniqueId);
+        }
+        return 0;
+    }
+    case MileCirnoClunkRequestMessage:
+    {
+        std::uint32_t FileId = Mile::Cirno::PopUInt32(Request);
+        if (!Current->FileIds.erase(FileId))
+        {
+            return APTX_EBADF;
+        }
+        return 0;
+    }
+    case MileCirnoLinuxOpenRequestMessage:
+    {
+        FileIdEntry* Entry = this->LookupFileId(
+            Current,
+            Mile::Cirno::PopUInt32(Request));
+        std::uint32_t Flags = Mile::Cirno::PopUInt32(Request);
+        if (!Entry || Entry->Opened)
+        {
+            return APTX_EBADF;
+        }
+        if (MileCirnoLinuxOpenCreateFlagTruncate & Flags)
+        {
+            Entry->Target->Content.clear();
+            this->MarkChanged(Entry->Target);
+        }
+        Entry->Opened = true;
+        Mile::Cirno::PushQid(Response, Entry->Target->UniqueId);
+        Mile::Cirno::PushUInt32(Response, 0);
+        return 0;
+    }
+    case MileCirnoGetAttributesRequestMessage:
+    {
+        FileIdEntry* Entry = this->LookupFileId(
+            Current,
+            Mile::Cirno::PopUInt32(Request));
+        if (!Entry)
+        {
+            return APTX_EBADF;
+        }
+        Mile::Cirno::Qid const& UniqueId = Entry->Target->UniqueId;
+        bool Directory = MileCirnoQidTypeDirectory == UniqueId.Type;
+        Mile::Cirno::PushUInt64(Response, MileCirnoLinuxGetAttributesFlagBasic);
+        Mile::Cirno::PushQid(Response, UniqueId);
+        Mile::Cirno::PushUInt32(Response, Directory ? 0040755 : 0100644);
+        Mile::Cirno::PushUInt32(Response, 0); // uid
+        Mile::Cirno::PushUInt32(Response, 0); // gid
+        Mile::Cirno::PushUInt64(Response, 1); // nlink
+        Mile::Cirno::PushUInt64(Response, 0); // rdev
+        Mile::Cirno::PushUInt64(Response, Entry->Target->Content.size());
+        Mile::Cirno::PushUInt64(Response, 4096); // blksize
+        Mile::Cirno::PushUInt64(
+            Response,
+            (Entry->Target->Content.size() + 511) / 512);
+        // The times, the generation and the data version.
+        for (std::size_t i = 0; i < 8; ++i)
+        {
+            Mile::Cirno::PushUInt64(Response, 0);
+        }
+        Mile::Cirno::PushUInt64(Response, 0);
+        Mile::Cirno::PushUInt64(Response, UniqueId.Version);
+        return 0;
+    }
+    case MileCirnoReadRequestMessage:
+    {
+        FileIdEntry* Entry = this->LookupFileId(
+            Current,
+            Mile::Cirno::PopUInt32(Request));
+        std::uint64_t Offset = Mile::Cirno::PopUInt64(Request);
+        std::uint32_t Count = Mile::Cirno::PopUInt32(Request);
+        if (!Entry || !Entry->Opened)
+        {
+            return APTX_EBADF;
+        }
+        std::vector<std::uint8_t> const& Content = Entry->Target->Content;
+        std::size_t Start = std::min<std::uint64_t>(Offset, Content.size());
+        std::size_t End = std::min<std::uint64_t>(
+            Start + Count,
+            Content.size());
+        Mile::Cirno::PushUInt32(
+            Response,
+            static_cast<std::uint32_t>(End - Start));
+        Response.insert(
+            Response.end(),
+            Content.begin() + Start,
+            Content.begin() + End);
+        return 0;
+    }
+    case MileCirnoWriteRequestMessage:
+    {
+        FileIdEntry* Entry = this->LookupFileId(
+            Current,
+            Mile::Cirno::PopUInt32(Request));
+        std::uint64_t Offset = Mile::Cirno::PopUInt64(Request);
+        std::uint32_t Count = Mile::Cirno::PopUInt32(Request);
+        if (!Entry || !Entry->Opened)
+        {
+            return APTX_EBADF;
+        }
+        Mile::Cirno::PushUInt32(
+            Response,
+            this->WriteContent(
+                Entry->Target,
+                Offset,
+                Mile::Cirno::PopBytes(Request, Count)));
+        return 0;
+    }
+    case MileCirnoFlushFileRequestMessage:
+    {
+        if (!this->LookupFileId(Current, Mile::Cirno::PopUInt32(Request)))
+        {
+            return APTX_EBADF;
+        }
+        return 0;
+    }
+    case MileCirnoCompoundRequestMessage:
+    {
+        return this->HandleCompound(Current, Lock, Request, Response);
+    }
+    case MileCirnoLeaseRequestMessage:
+    {
+        FileIdEntry* Entry = this->LookupFileId(
+            Current,
+            Mile::Cirno::PopUInt32(Request));
+        std::uint64_t Key = Mile::Cirno::PopUInt64(Request);
+        if (!Entry)
+        {
+            return APTX_EBADF;
+        }
+        Mile::Cirno::Qid const& UniqueId = Entry->Target->UniqueId;
+        this->m_Leases[Key][UniqueId.Path] = UniqueId;
+        Mile::Cirno::PushQid(Response, UniqueId);
+        Mile::Cirno::PushUInt32(Response, 60 * 1000);
+        return 0;
+    }
+    case MileCirnoNotifyRequestMessage:
+    {
+        std::uint64_t Key = Mile::Cirno::PopUInt64(Request);
+        this->m_LeaseCondition.wait(Lock, [&]()
+        {
+            return this->m_Stopping || !this->m_BrokenLeases[Key].empty();
+        });
+        if (this->m_Stopping)
+        {
+            return APTX_LINUX_ECANCELED;
+        }
+        std::vector<Mile::Cirno::Qid> UniqueIds;
+        UniqueIds.swap(this->m_BrokenLeases[Key]);
+        Mile::Cirno::PushUInt16(
+            Response,
+            static_cast<std::uint16_t>(UniqueIds.size()));
+        for (Mile::Cirno::Qid const& UniqueId : UniqueIds)
+        {
+            Mile::Cirno::PushQid(Response, UniqueId);
+        }
+        return 0;
+    }
+    case MileCirnoCopyRangeRequestMessage:
+    {
+        FileIdEntry* Source = this->LookupFileId(
+            Current,
+            Mile::Cirno::PopUInt32(Request));
+        std::uint64_t Offset = Mile::Cirno::PopUInt64(Request);
+        FileIdEntry* Destination = this->LookupFileId(
+            Current,
+            Mile::Cirno::PopUInt32(Request));
+        std::uint64_t DestinationOffset = Mile::Cirno::PopUInt64(Request);
+        std::uint64_t Count = Mile::Cirno::PopUInt64(Request);
+        if (!Source || !Source->Opened ||
+            !Destination || !Destination->Opened)
+        {
+            return APTX_EBADF;
+        }
+        // Copy from a snapshot in case both are the same file.
+        std::vector<std::uint8_t> Content = Source->Target->Content;
+        std::size_t Start = std::min<std::uint64_t>(Offset, Content.size());
+        std::size_t End = std::min<std::uint64_t>(
+            Start + Count,
+            Content.size());
+        this->WriteContent(
+            Destination->Target,
+            DestinationOffset,
+            std::span<std::uint8_t>(Content).subspan(Start, End - Start));
+        Mile::Cirno::PushUInt64(Response, End - Start);
+        return 0;
+    }
+    case MileCirnoCompressedReadRequestMessage:
+    {
+        FileIdEntry* Entry = this->LookupFileId(
+            Current,
+            Mile::Cirno::PopUInt32(Request));
+        std::uint64_t Offset = Mile::Cirno::PopUInt64(Request);
+        std::uint32_t Count = Mile::Cirno::PopUInt32(Request);
+        if (!Entry || !Entry->Opened)
+        {
+            return APTX_EBADF;
+        }
+        std::vector<std::uint8_t> const& Content = Entry->Target->Content;
+        std::size_t Start = std::min<std::uint64_t>(Offset, Content.size());
+        std::size_t End = std::min<std::uint64_t>(
+            Start + Count,
+            Content.size());
+        std::size_t Size = End - Start;
+        std::vector<std::uint8_t> Compressed(Size);
+        SIZE_T CompressedSize = 0;
+        if (!Size || !::Compress(
+            this->m_Compressor,
+            Content.data() + Start,
+            Size,
+            Compressed.data(),
+            Compressed.size(),
+            &CompressedSize) || CompressedSize >= Size)
+        {
+            // Stored as is if it is not compressible.
+            Compressed.assign(
+                Content.begin() + Start,
+                Content.begin() + End);
+        }
+        else
+        {
+            Compressed.resize(CompressedSize);
+        }
+        Mile::Cirno::PushUInt32(Response, static_cast<std::uint32_t>(Size));
+        Mile::Cirno::PushUInt32(
+            Response,
+            static_cast<std::uint32_t>(Compressed.size()));
+        Response.insert(Response.end(), Compressed.begin(), Compressed.end());
+        return 0;
+    }
+    case MileCirnoCompressedWriteRequestMessage:
+    {
+        FileIdEntry* Entry = this->LookupFileId(
+            Current,
+            Mile::Cirno::PopUInt32(Request));
+        std::uint64_t Offset = Mile::Cirno::PopUInt64(Request);
+        std::uint32_t Count = Mile::Cirno::PopUInt32(Request);
+        std::uint32_t CompressedCount = Mile::Cirno::PopUInt32(Request);
+        std::span<std::uint8_t> Data =
+            Mile::Cirno::PopBytes(Request, CompressedCount);
+        if (!Entry || !Entry->Opened)
+        {
+            return APTX_EBADF;
+        }
+        std::vector<std::uint8_t> Decompressed(Data.begin(), Data.end());
+        if (CompressedCount > Count)
+        {
+            return APTX_EINVAL;
+        }
+        else if (CompressedCount < Count)
+        {
+            Decompressed.resize(Count);
+            SIZE_T DecompressedSize = 0;
+            if (!::Decompress(
+                this->m_Decompressor,
+                Data.data(),
+                Data.size(),
+                Decompressed.data(),
+                Decompressed.size(),
+                &DecompressedSize) || Count != DecompressedSize)
+            {
+                return APTX_EIO;
+            }
+        }
+        Mile::Cirno::PushUInt32(
+            Response,
+            this->WriteContent(
+                Entry->Target,
+                Offset,
+                std::span<std::uint8_t>(Decompressed)));
+        return 0;
+    }
+    case MileCirnoAppendRequestMessage:
+    {
+        FileIdEntry* Entry = this->LookupFileId(
+            Current,
+            Mile::Cirno::PopUInt32(Request));
+        std::uint32_t Count = Mile::Cirno::PopUInt32(Request);
+        if (!Entry || !Entry->Opened)
+        {
+            return APTX_EBADF;
+        }
+        std::uint64_t Offset = Entry->Target->Content.size();
+        Mile::Cirno::PushUInt64(Response, Offset);
+        Mile::Cirno::PushUInt32(
+            Response,
+            this->WriteContent(
+                Entry->Target,
+                Offset,
+                Mile::Cirno::PopBytes(Request, Count)));
+        return 0;
+    }
+    default:
+        return APTX_LINUX_EOPNOTSUPP;
+    }
+}
+
+std::uint32_t Mile::Cirno::LoopbackServer::HandleCompound(
+    Connection* Current,
+    std::unique_lock<std::mutex>& Lock,
+    std::span<std::uint8_t> Request,
+    std::vector<std::uint8_t>& Response)
+{
+    std::uint16_t Count = Mile::Cirno::PopUInt16(Request);
+    std::vector<Mile::Cirno::CompoundOperation> Results;
+    for (std::uint16_t i = 0; i < Count; ++i)
+    {
+        Mile::Cirno::CompoundOperation Operation =
+            Mile::Cirno::PopCompoundOperation(Request);
+        Mile::Cirno::CompoundOperation& Result = Results.emplace_back();
+        std::uint32_t ErrorCode = APTX_EINVAL;
+        // Nested compounds and notifications which may block are refused.
+        if (MileCirnoCompoundRequestMessage != Operation.Type &&
+            MileCirnoNotifyRequestMessage != Operation.Type &&
+            MileCirnoVersionRequestMessage != Operation.Type)
+        {
+            ErrorCode = this->HandleMessage(
+                Current,
+                Lock,
+                Operation.Type,
+                std::span<std::uint8_t>(Operation.Body),
+                Result.Body);
+        }
+        if (ErrorCode)
+        {
+            Result.Type = MileCirnoLinuxErrorResponseMessage;
+            Result.Body.clear();
+            Mile::Cirno::PushUInt32(Result.Body, ErrorCode);
+            break;
+        }
+        Result.Type = Operation.Type + 1;
+    }
+
+    for (auto Iterator = Current->FileIds.begin();
+        Current->FileIds.end() != Iterator;)
+    {
+        if (Iterator->first >= MILE_CIRNO_COMPOUND_FID_BASE &&
+            Iterator->first != MILE_CIRNO_NOFID)
+        {
+            Iterator = Current->FileIds.erase(Iterator);
+        }
+        else
+        {
+            ++Iterator;
+        }
+    }
+
+    Mile::Cirno::PushUInt16(
+        Response,
+        static_cast<std::uint16_t>(Results.size()));
+    for (Mile::Cirno::CompoundOperation const& Result : Results)
+    {
+        Mile::Cirno::PushCompoundOperation(Response, Result);
+    }
+    return 0;
+}
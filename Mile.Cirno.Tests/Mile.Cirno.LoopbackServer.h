@@ -0,0 +1,143 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.Cirno.LoopbackServer.h
+ * PURPOSE:    Definition for Mile.Cirno Loopback Reference Server
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ *             per1cycle (pericycle.cc@gmail.com)
+ */
+
+#ifndef MILE_CIRNO_LOOPBACK_SERVER
+#define MILE_CIRNO_LOOPBACK_SERVER
+
+#define _WINSOCKAPI_
+#define WIN32_NO_STATUS
+#include <Windows.h>
+#include <WinSock2.h>
+
+#include <compressapi.h>
+
+#include "Mile.Cirno.Protocol.h"
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Mile::Cirno
+{
+    // The reference server of the 9P2000.L.Cirno extension, which serves a
+    // flat in-memory file tree over a loopback TCP connection. It implements
+    // the 9P2000.L messages needed to reach the files and all extension
+    // messages. The extension messages fail with ENOSYS unless the extended
+    // version string is negotiated, which is only accepted if the server is
+    // created with the extension supported.
+    class LoopbackServer
+    {
+    private:
+
+        struct Node
+        {
+            Qid UniqueId;
+            std::vector<std::uint8_t> Content;
+        };
+
+        struct FileIdEntry
+        {
+            std::shared_ptr<Node> Target;
+            bool Opened = false;
+        };
+
+        struct Connection
+        {
+            SOCKET Socket = INVALID_SOCKET;
+            bool ExtensionNegotiated = false;
+            std::map<std::uint32_t, FileIdEntry> FileIds;
+        };
+
+        bool m_ExtensionSupported = false;
+        SOCKET m_ListenSocket = INVALID_SOCKET;
+        std::string m_Port;
+        std::thread m_AcceptThread;
+        std::vector<std::thread> m_ConnectionThreads;
+        COMPRESSOR_HANDLE m_Compressor = nullptr;
+        DECOMPRESSOR_HANDLE m_Decompressor = nullptr;
+
+        // Protects all members below, and is held while handling a message.
+        std::mutex m_Mutex;
+        std::condition_variable m_LeaseCondition;
+        bool m_Stopping = false;
+        std::vector<Connection*> m_Connections;
+        std::shared_ptr<Node> m_Root;
+        std::map<std::string, std::shared_ptr<Node>> m_Files;
+        std::uint64_t m_NextPath = 1;
+        std::map<MILE_CIRNO_MESSAGE_TYPE, std::size_t> m_MessageCounts;
+        // The qid paths of the leased files and the qids of the broken
+        // leases, which are keyed by the lease key.
+        std::map<std::uint64_t, std::map<std::uint64_t, Qid>> m_Leases;
+        std::map<std::uint64_t, std::vector<Qid>> m_BrokenLeases;
+
+        void AcceptConnections();
+
+        void ServeConnection(
+            Connection* Current);
+
+        FileIdEntry* LookupFileId(
+            Connection* Current,
+            std::uint32_t const& FileId);
+
+        // Update the qid version of the file and break its leases.
+        void MarkChanged(
+            std::shared_ptr<Node> const& Target);
+
+        std::uint32_t WriteContent(
+            std::shared_ptr<Node> const& Target,
+            std::uint64_t const& Offset,
+            std::span<std::uint8_t> Data);
+
+        // Returns the error code, or 0 and fills the response which has the
+        // type of the request plus one.
+        std::uint32_t HandleMessage(
+            Connection* Current,
+            std::unique_lock<std::mutex>& Lock,
+            std::uint8_t const& Type,
+            std::span<std::uint8_t> Request,
+            std::vector<std::uint8_t>& Response);
+
+        std::uint32_t HandleCompound(
+            Connection* Current,
+            std::unique_lock<std::mutex>& Lock,
+            std::span<std::uint8_t> Request,
+            std::vector<std::uint8_t>& Response);
+
+    public:
+
+        LoopbackServer(
+            bool const& ExtensionSupported);
+
+        ~LoopbackServer();
+
+        std::string const& GetPort() const;
+
+        void AddFile(
+            std::string const& Name,
+            std::vector<std::uint8_t> const& Content);
+
+        std::vector<std::uint8_t> GetFileContent(
+            std::string const& Name);
+
+        std::size_t GetMessageCount(
+            MILE_CIRNO_MESSAGE_TYPE const& Type);
+
+        // The number of the file IDs held by all connections.
+        std::size_t GetFileIdCount();
+    };
+}
+
+#endif // !MILE_CIRNO_LOOPBACK_SERVER
@@ -0,0 +1,273 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.Cirno.Protocol.Tests.cpp
+ * PURPOSE:    Implementation for Plan 9 File System Protocol Parser Tests
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ *             per1cycle (pericycle.cc@gmail.com)
+ */
+
+#include "Mile.Cirno.Tests.h"
+
+#include "Mile.Cirno.Protocol.Parser.h"
+
+namespace
+{
+    // The qid used by the responses, whose path is 0x0102030405060708.
+    const std::vector<std::uint8_t> TestQidBytes =
+    {
+        0x80,
+        0x01, 0x00, 0x00, 0x00,
+        0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01,
+    };
+
+    bool IsTestQid(
+        Mile::Cirno::Qid const& Value)
+    {
+        return
+            MileCirnoQidTypeDirectory == Value.Type &&
+            1 == Value.Version &&
+            0x0102030405060708 == Value.Path;
+    }
+}
+
+bool TestFlushFileCodec()
+{
+    Mile::Cirno::FlushFileRequest Request = {};
+    Request.FileId = 0x11223344;
+    Request.DataSync = 1;
+    std::vector<std::uint8_t> Content;
+    Mile::Cirno::PushFlushFileRequest(Content, Request);
+    return Content == std::vector<std::uint8_t>
+    {
+        0x44, 0x33, 0x22, 0x11,
+        0x01, 0x00, 0x00, 0x00,
+    };
+}
+
+bool TestCompoundCodec()
+{
+    Mile::Cirno::CompoundRequest Request;
+    Mile::Cirno::CompoundOperation& Operation =
+        Request.Operations.emplace_back();
+    Operation.Type = MileCirnoWalkRequestMessage;
+    Operation.Body = { 0x01, 0x02, 0x03 };
+    std::vector<std::uint8_t> Content;
+    Mile::Cirno::PushCompoundRequest(Content, Request);
+    if (Content != std::vector<std::uint8_t>
+    {
+        0x01, 0x00,
+        0x03, 0x00, 0x00, 0x00,
+        MileCirnoWalkRequestMessage,
+        0x01, 0x02, 0x03,
+    })
+    {
+        return false;
+    }
+
+    // The second operation failed, so the result is Rlerror with EIO.
+    Content =
+    {
+        0x02, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        MileCirnoWalkResponseMessage,
+        0x04, 0x00, 0x00, 0x00,
+        MileCirnoLinuxErrorResponseMessage,
+        0x05, 0x00, 0x00, 0x00,
+    };
+    std::span<std::uint8_t> Buffer = std::span<std::uint8_t>(Content);
+    Mile::Cirno::CompoundResponse Response =
+        Mile::Cirno::PopCompoundResponse(Buffer);
+    return
+        Buffer.empty() &&
+        2 == Response.Results.size() &&
+        MileCirnoWalkResponseMessage == Response.Results[0].Type &&
+        Response.Results[0].Body.empty() &&
+        MileCirnoLinuxErrorResponseMessage == Response.Results[1].Type &&
+        Response.Results[1].Body == std::vector<std::uint8_t>
+        {
+            0x05, 0x00, 0x00, 0x00,
+        };
+}
+
+bool TestLeaseCodec()
+{
+    Mile::Cirno::LeaseRequest Request = {};
+    Request.FileId = 0x11223344;
+    Request.Key = 0x0102030405060708;
+    std::vector<std::uint8_t> Content;
+    Mile::Cirno::PushLeaseRequest(Content, Request);
+    if (Content != std::vector<std::uint8_t>
+    {
+        0x44, 0x33, 0x22, 0x11,
+        0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01,
+    })
+    {
+        return false;
+    }
+
+    Content = TestQidBytes;
+    Content.insert(Content.end(), { 0xE8, 0x03, 0x00, 0x00 });
+    std::span<std::uint8_t> Buffer = std::span<std::uint8_t>(Content);
+    Mile::Cirno::LeaseResponse Response =
+        Mile::Cirno::PopLeaseResponse(Buffer);
+    return
+        Buffer.empty() &&
+        ::IsTestQid(Response.UniqueId) &&
+        1000 == Response.Duration;
+}
+
+bool TestNotifyCodec()
+{
+    Mile::Cirno::NotifyRequest Request = {};
+    Request.Key = 0x0102030405060708;
+    std::vector<std::uint8_t> Content;
+    Mile::Cirno::PushNotifyRequest(Content, Request);
+    if (Content != std::vector<std::uint8_t>
+    {
+        0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01,
+    })
+    {
+        return false;
+    }
+
+    Content = { 0x02, 0x00 };
+    Content.insert(Content.end(), TestQidBytes.begin(), TestQidBytes.end());
+    Content.insert(Content.end(), TestQidBytes.begin(), TestQidBytes.end());
+    std::span<std::uint8_t> Buffer = std::span<std::uint8_t>(Content);
+    Mile::Cirno::NotifyResponse Response =
+        Mile::Cirno::PopNotifyResponse(Buffer);
+    return
+        Buffer.empty() &&
+        2 == Response.UniqueIds.size() &&
+        ::IsTestQid(Response.UniqueIds[0]) &&
+        ::IsTestQid(Response.UniqueIds[1]);
+}
+
+bool TestCopyRangeCodec()
+{
+    Mile::Cirno::CopyRangeRequest Request = {};
+    Request.FileId = 1;
+    Request.Offset = 0x0000000200000000;
+    Request.DestinationFileId = 3;
+    Request.DestinationOffset = 4;
+    Request.Count = 0x10000;
+    std::vector<std::uint8_t> Content;
+    Mile::Cirno::PushCopyRangeRequest(Content, Request);
+    if (Content != std::vector<std::uint8_t>
+    {
+        0x01, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00,
+        0x03, 0x00, 0x00, 0x00,
+        0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+    })
+    {
+        return false;
+    }
+
+    Content = { 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    std::span<std::uint8_t> Buffer = std::span<std::uint8_t>(Content);
+    Mile::Cirno::CopyRangeResponse Response =
+        Mile::Cirno::PopCopyRangeResponse(Buffer);
+    return Buffer.empty() && 0x8000 == Response.Count;
+}
+
+bool TestCompressedReadCodec()
+{
+    Mile::Cirno::CompressedReadRequest Request = {};
+    Request.FileId = 1;
+    Request.Offset = 0x1000;
+    Request.Count = 0x10000;
+    std::vector<std::uint8_t> Content;
+    Mile::Cirno::PushCompressedReadRequest(Content, Request);
+    if (Content != std::vector<std::uint8_t>
+    {
+        0x01, 0x00, 0x00, 0x00,
+        0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x01, 0x00,
+    })
+    {
+        return false;
+    }
+
+    Content =
+    {
+        0x00, 0x10, 0x00, 0x00,
+        0x03, 0x00, 0x00, 0x00,
+        0xAA, 0xBB, 0xCC,
+    };
+    std::span<std::uint8_t> Buffer = std::span<std::uint8_t>(Content);
+    Mile::Cirno::CompressedReadResponse Response =
+        Mile::Cirno::PopCompressedReadResponse(Buffer);
+    return
+        Buffer.empty() &&
+        0x1000 == Response.Count &&
+        Response.Data == std::vector<std::uint8_t>{ 0xAA, 0xBB, 0xCC };
+}
+
+bool TestCompressedWriteCodec()
+{
+    Mile::Cirno::CompressedWriteRequest Request = {};
+    Request.FileId = 1;
+    Request.Offset = 0x1000;
+    Request.Count = 0x2000;
+    Request.Data = { 0xAA, 0xBB, 0xCC };
+    std::vector<std::uint8_t> Content;
+    Mile::Cirno::PushCompressedWriteRequest(Content, Request);
+    if (Content != std::vector<std::uint8_t>
+    {
+        0x01, 0x00, 0x00, 0x00,
+        0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x20, 0x00, 0x00,
+        0x03, 0x00, 0x00, 0x00,
+        0xAA, 0xBB, 0xCC,
+    })
+    {
+        return false;
+    }
+
+    Content = { 0x00, 0x20, 0x00, 0x00 };
+    std::span<std::uint8_t> Buffer = std::span<std::uint8_t>(Content);
+    Mile::Cirno::CompressedWriteResponse Response =
+        Mile::Cirno::PopCompressedWriteResponse(Buffer);
+    return Buffer.empty() && 0x2000 == Response.Count;
+}
+
+bool TestAppendCodec()
+{
+    Mile::Cirno::AppendRequest Request = {};
+    Request.FileId = 1;
+    Request.Data = { 0xAA, 0xBB, 0xCC };
+    std::vector<std::uint8_t> Content;
+    Mile::Cirno::PushAppendRequest(Content, Request);
+    if (Content != std::vector<std::uint8_t>
+    {
+        0x01, 0x00, 0x00, 0x00,
+        0x03, 0x00, 0x00, 0x00,
+        0xAA, 0xBB, 0xCC,
+    })
+    {
+        return false;
+    }
+    if (Mile::Cirno::AppendRequestHeaderSize !=
+        Mile::Cirno::HeaderSize + Content.size() - Request.Data.size())
+    {
+        return false;
+    }
+
+    Content =
+    {
+        0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+        0x03, 0x00, 0x00, 0x00,
+    };
+    std::span<std::uint8_t> Buffer = std::span<std::uint8_t>(Content);
+    Mile::Cirno::AppendResponse Response =
+        Mile::Cirno::PopAppendResponse(Buffer);
+    return
+        Buffer.empty() &&
+        0x0000000100000000 == Response.Offset &&
+        3 == Response.Count;
+}
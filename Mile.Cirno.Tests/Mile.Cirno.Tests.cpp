@@ -0,0 +1,89 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.Cirno.Tests.cpp
+ * PURPOSE:    Implementation for Mile.Cirno Tests
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ *             per1cycle (pericycle.cc@gmail.com)
+ */
+
+#define _WINSOCKAPI_
+#define WIN32_NO_STATUS
+#include <Windows.h>
+#include <WinSock2.h>
+
+#include "Mile.Cirno.Tests.h"
+
+#include <cstdio>
+#include <exception>
+
+int main()
+{
+    struct TestCase
+    {
+        char const* Name;
+        bool (*Function)();
+    };
+    const TestCase TestCases[] =
+    {
+        { "FlushFileCodec", ::TestFlushFileCodec },
+        { "CompoundCodec", ::TestCompoundCodec },
+        { "LeaseCodec", ::TestLeaseCodec },
+        { "NotifyCodec", ::TestNotifyCodec },
+        { "CopyRangeCodec", ::TestCopyRangeCodec },
+        { "CompressedReadCodec", ::TestCompressedReadCodec },
+        { "CompressedWriteCodec", ::TestCompressedWriteCodec },
+        { "AppendCodec", ::TestAppendCodec },
+        { "VersionNegotiation", ::TestVersionNegotiation },
+        { "VersionFallback", ::TestVersionFallback },
+        { "ExtensionRefused", ::TestExtensionRefused },
+        { "Compound", ::TestCompound },
+        { "CompoundFailure", ::TestCompoundFailure },
+        { "PipelinedCompound", ::TestPipelinedCompound },
+        { "PipelinedCompoundFallback", ::TestPipelinedCompoundFallback },
+        { "LeaseAndNotify", ::TestLeaseAndNotify },
+        { "CopyRange", ::TestCopyRange },
+        { "CompressedReadAndWrite", ::TestCompressedReadAndWrite },
+        { "CompressionFallback", ::TestCompressionFallback },
+        { "Append", ::TestAppend },
+    };
+
+    WSADATA WSAData = {};
+    {
+        int WSAError = ::WSAStartup(MAKEWORD(2, 2), &WSAData);
+        if (NO_ERROR != WSAError)
+        {
+            std::printf("[ERROR] WSAStartup failed (%d).\n", WSAError);
+            return -1;
+        }
+    }
+
+    int FailedTests = 0;
+    for (TestCase const& Current : TestCases)
+    {
+        bool Passed = false;
+        try
+        {
+            Passed = Current.Function();
+        }
+        catch (std::exception const& ex)
+        {
+            std::printf("[ERROR] %s\n", ex.what());
+        }
+        std::printf("[%s] %s\n", Passed ? "PASS" : "FAIL", Current.Name);
+        if (!Passed)
+        {
+            ++FailedTests;
+        }
+    }
+
+    ::WSACleanup();
+
+    std::printf(
+        "[INFO] %d of %d tests failed.\n",
+        FailedTests,
+        static_cast<int>(sizeof(TestCases) / sizeof(*TestCases)));
+    return FailedTests ? -1 : 0;
+}
@@ -0,0 +1,43 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.Cirno.Tests.h
+ * PURPOSE:    Definition for Mile.Cirno Tests
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ *             per1cycle (pericycle.cc@gmail.com)
+ */
+
+#ifndef MILE_CIRNO_TESTS
+#define MILE_CIRNO_TESTS
+
+// Each test returns true if it is passed. The tests in
+// Mile.Cirno.Protocol.Tests.cpp compare the encoders and the decoders with
+// the wire layouts documented in Mile.Cirno.Protocol.h, and the tests in
+// Mile.Cirno.Extension.Tests.cpp run Mile::Cirno::Client against
+// Mile::Cirno::LoopbackServer.
+
+bool TestFlushFileCodec();
+bool TestCompoundCodec();
+bool TestLeaseCodec();
+bool TestNotifyCodec();
+bool TestCopyRangeCodec();
+bool TestCompressedReadCodec();
+bool TestCompressedWriteCodec();
+bool TestAppendCodec();
+
+bool TestVersionNegotiation();
+bool TestVersionFallback();
+bool TestExtensionRefused();
+bool TestCompound();
+bool TestCompoundFailure();
+bool TestPipelinedCompound();
+bool TestPipelinedCompoundFallback();
+bool TestLeaseAndNotify();
+bool TestCopyRange();
+bool TestCompressedReadAndWrite();
+bool TestCompressionFallback();
+bool TestAppend();
+
+#endif // !MILE_CIRNO_TESTS
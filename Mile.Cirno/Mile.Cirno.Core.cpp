@@ -22,6 +22,7 @@
 
 #include <Mile.Helpers.CppBase.h>
 
+#include <algorithm>
 #include <stdexcept>
 
 #include "Aptx.Posix.Error.h"
@@ -81,6 +82,51 @@ Mile::Cirno::Client::~Client()
         ::closesocket(this->m_Socket);
         this->m_Socket = INVALID_SOCKET;
     }
+    if (this->m_Compressor)
+    {
+        ::CloseCompressor(this->m_Compressor);
+        this->m_Compressor = nullptr;
+    }
+    if (this->m_Decompressor)
+    {
+        ::CloseDecompressor(this->m_Decompressor);
+        this->m_Decompressor = nullptr;
+    }
+}
+
+void Mile::Cirno::Client::Disconnect()
+{
+    if (INVALID_SOCKET != this->m_Socket)
+    {
+        ::shutdown(this->m_Socket, SD_BOTH);
+    }
+}
+
+bool Mile::Cirno::Client::EnableCompression()
+{
+    std::lock_guard<std::mutex> Guard(this->m_CompressionMutex);
+
+    if (this->m_Compressor && this->m_Decompressor)
+    {
+        return true;
+    }
+
+    // XPRESS is used because it is the fastest one, and the raw format is
+    // used because the sizes are carried by the messages.
+    const DWORD Algorithm = COMPRESS_ALGORITHM_XPRESS | COMPRESS_RAW;
+    if (!this->m_Compressor &&
+        !::CreateCompressor(Algorithm, nullptr, &this->m_Compressor))
+    {
+        this->m_Compressor = nullptr;
+        return false;
+    }
+    if (!this->m_Decompressor &&
+        !::CreateDecompressor(Algorithm, nullptr, &this->m_Decompressor))
+    {
+        this->m_Decompressor = nullptr;
+        return false;
+    }
+    return true;
 }
 
 std::uint32_t Mile::Cirno::Client::AllocateFileId()
@@ -162,8 +208,407 @@ std::uint32_t Mile::Cirno::Client::RequestResponse(
     }
 
     std::vector<std::uint8_t> ResponseBuffer;
-
     Mile::Cirno::Header ResponseHeader = {};
+    if (!this->ReceiveMessage(ResponseHeader, ResponseBuffer))
+    {
+        return APTX_EIO;
+    }
+    if (Tag != ResponseHeader.Tag)
+    {
+        return APTX_EIO;
+    }
+
+    return this->ParseResponse(
+        ResponseType,
+        ResponseHeader,
+        ResponseBuffer,
+        ResponseContent);
+}
+
+void Mile::Cirno::Client::PipelinedRequestResponse(
+    std::vector<Mile::Cirno::PipelinedRequest>& Requests)
+{
+    for (Mile::Cirno::PipelinedRequest& Request : Requests)
+    {
+        Request.ErrorCode = APTX_EIO;
+    }
+    if (Requests.empty() || Requests.size() >= MILE_CIRNO_NOTAG)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> Guard(this->m_RequestResponseMutex);
+
+    // The tag of each request is its index plus one.
+    std::vector<std::uint8_t> RequestBuffer;
+    for (std::size_t i = 0; i < Requests.size(); ++i)
+    {
+        Mile::Cirno::Header RequestHeader = {};
+        RequestHeader.Size = static_cast<std::uint32_t>(
+            Requests[i].RequestContent.size());
+        RequestHeader.Type = static_cast<std::uint8_t>(
+            Requests[i].RequestType);
+        RequestHeader.Tag = static_cast<std::uint16_t>(i + 1);
+        Mile::Cirno::PushHeader(RequestBuffer, RequestHeader);
+        RequestBuffer.insert(
+            RequestBuffer.end(),
+            Requests[i].RequestContent.begin(),
+            Requests[i].RequestContent.end());
+    }
+    {
+        DWORD NumberOfBytesSent = 0;
+        if (!this->SocketSend(
+            &RequestBuffer[0],
+            static_cast<DWORD>(RequestBuffer.size()),
+            &NumberOfBytesSent,
+            0))
+        {
+            return;
+        }
+    }
+
+    // The server may reply out of order, so stop receiving only when all
+    // requests are answered or the connection is broken.
+    std::vector<bool> Answered(Requests.size(), false);
+    for (std::size_t i = 0; i < Requests.size(); ++i)
+    {
+        std::vector<std::uint8_t> ResponseBuffer;
+        Mile::Cirno::Header ResponseHeader = {};
+        if (!this->ReceiveMessage(ResponseHeader, ResponseBuffer))
+        {
+            return;
+        }
+        std::size_t Index = static_cast<std::size_t>(ResponseHeader.Tag) - 1;
+        if (Index >= Requests.size() || Answered[Index])
+        {
+            return;
+        }
+        Answered[Index] = true;
+        Requests[Index].ErrorCode = this->ParseResponse(
+            Requests[Index].ResponseType,
+            ResponseHeader,
+            ResponseBuffer,
+            Requests[Index].ResponseContent);
+    }
+}
+
+std::uint32_t Mile::Cirno::Client::MakeCompoundRequest(
+    std::vector<Mile::Cirno::PipelinedRequest>& Operations,
+    std::vector<std::uint8_t>& RequestContent)
+{
+    for (Mile::Cirno::PipelinedRequest& Operation : Operations)
+    {
+        Operation.ErrorCode = APTX_LINUX_ECANCELED;
+    }
+    if (Operations.empty() || Operations.size() > 0xFFFF)
+    {
+        return APTX_EINVAL;
+    }
+
+    Mile::Cirno::CompoundRequest Request;
+    for (Mile::Cirno::PipelinedRequest const& Operation : Operations)
+    {
+        Mile::Cirno::CompoundOperation& Current =
+            Request.Operations.emplace_back();
+        Current.Type = static_cast<std::uint8_t>(Operation.RequestType);
+        Current.Body = Operation.RequestContent;
+    }
+    Mile::Cirno::PushCompoundRequest(RequestContent, Request);
+    return 0;
+}
+
+std::uint32_t Mile::Cirno::Client::ParseCompoundResponse(
+    std::vector<Mile::Cirno::PipelinedRequest>& Operations,
+    std::vector<std::uint8_t>& ResponseContent)
+{
+    std::span<std::uint8_t> ResponseSpan =
+        std::span<std::uint8_t>(ResponseContent);
+    Mile::Cirno::CompoundResponse Response =
+        Mile::Cirno::PopCompoundResponse(ResponseSpan);
+    if (Response.Results.size() > Operations.size())
+    {
+        return APTX_EIO;
+    }
+    for (std::size_t i = 0; i < Response.Results.size(); ++i)
+    {
+        // Each result is parsed as if it is a standalone response.
+        Mile::Cirno::Header ResultHeader = {};
+        ResultHeader.Size = static_cast<std::uint32_t>(
+            Response.Results[i].Body.size());
+        ResultHeader.Type = Response.Results[i].Type;
+        Operations[i].ErrorCode = this->ParseResponse(
+            Operations[i].ResponseType,
+            ResultHeader,
+            Response.Results[i].Body,
+            Operations[i].ResponseContent);
+    }
+    return 0;
+}
+
+std::uint32_t Mile::Cirno::Client::Compound(
+    std::vector<Mile::Cirno::PipelinedRequest>& Operations)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    std::uint32_t ErrorCode = this->MakeCompoundRequest(
+        Operations,
+        RequestBuffer);
+    if (0 != ErrorCode)
+    {
+        return ErrorCode;
+    }
+    std::vector<std::uint8_t> ResponseBuffer;
+    ErrorCode = this->RequestResponse(
+        MileCirnoCompoundRequestMessage,
+        RequestBuffer,
+        MileCirnoCompoundResponseMessage,
+        ResponseBuffer);
+    if (0 != ErrorCode)
+    {
+        return ErrorCode;
+    }
+    return this->ParseCompoundResponse(Operations, ResponseBuffer);
+}
+
+void Mile::Cirno::Client::PipelinedCompound(
+    std::vector<std::vector<Mile::Cirno::PipelinedRequest>>& Compounds)
+{
+    std::vector<Mile::Cirno::PipelinedRequest> Requests(Compounds.size());
+    for (std::size_t i = 0; i < Compounds.size(); ++i)
+    {
+        Requests[i].RequestType = MileCirnoCompoundRequestMessage;
+        Requests[i].ResponseType = MileCirnoCompoundResponseMessage;
+        Requests[i].ErrorCode = this->MakeCompoundRequest(
+            Compounds[i],
+            Requests[i].RequestContent);
+    }
+    if (Compounds.empty())
+    {
+        return;
+    }
+    this->PipelinedRequestResponse(Requests);
+    for (std::size_t i = 0; i < Compounds.size(); ++i)
+    {
+        std::uint32_t ErrorCode = Requests[i].ErrorCode;
+        if (0 == ErrorCode)
+        {
+            ErrorCode = this->ParseCompoundResponse(
+                Compounds[i],
+                Requests[i].ResponseContent);
+        }
+        if (0 != ErrorCode)
+        {
+            for (Mile::Cirno::PipelinedRequest& Operation : Compounds[i])
+            {
+                Operation.ErrorCode = ErrorCode;
+            }
+        }
+    }
+}
+
+bool Mile::Cirno::Client::CheckCompressionRefused(
+    std::uint32_t const& ErrorCode)
+{
+    if (APTX_LINUX_ENOSYS != ErrorCode && APTX_LINUX_EOPNOTSUPP != ErrorCode)
+    {
+        return false;
+    }
+    this->m_CompressionSupported = false;
+    return true;
+}
+
+bool Mile::Cirno::Client::ShouldCompress(
+    CompressionState& State,
+    std::uint32_t const& Size)
+{
+    // Small payloads are dominated by the latency instead of the size.
+    const std::uint32_t MinimumCompressedSize = 4096;
+
+    if (!this->m_CompressionSupported ||
+        !this->m_Compressor ||
+        !this->m_Decompressor ||
+        Size < MinimumCompressedSize)
+    {
+        return false;
+    }
+
+    std::uint32_t SkippedMessages = State.SkippedMessages;
+    while (SkippedMessages && !State.SkippedMessages.compare_exchange_weak(
+        SkippedMessages,
+        SkippedMessages - 1))
+    {
+    }
+    return !SkippedMessages;
+}
+
+void Mile::Cirno::Client::UpdateCompressionState(
+    CompressionState& State,
+    std::uint64_t const& UncompressedSize,
+    std::uint64_t const& CompressedSize,
+    std::chrono::steady_clock::duration const& CodecTime)
+{
+    const std::uint32_t MaximumBackoff = 256;
+
+    // At least one ninth of the payload should be saved, and the time saved
+    // on the link should exceed the time spent on the codec if the link
+    // throughput is known.
+    bool PaidOff = CompressedSize + CompressedSize / 8 <= UncompressedSize;
+    std::uint64_t LinkThroughput = this->m_LinkThroughput;
+    if (PaidOff && LinkThroughput)
+    {
+        std::uint64_t SavedNanoseconds =
+            (UncompressedSize - CompressedSize) * 1000000000 / LinkThroughput;
+        PaidOff = SavedNanoseconds > static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                CodecTime).count());
+    }
+
+    if (PaidOff)
+    {
+        State.Backoff = 0;
+    }
+    else
+    {
+        std::uint32_t Backoff = std::min<std::uint32_t>(
+            std::max<std::uint32_t>(1, 2 * State.Backoff),
+            MaximumBackoff);
+        State.Backoff = Backoff;
+        State.SkippedMessages = Backoff;
+    }
+}
+
+void Mile::Cirno::Client::UpdateLinkThroughput(
+    std::uint64_t const& Size,
+    std::chrono::steady_clock::duration const& Elapsed)
+{
+    // Only the large transfers are measured to reduce the bias from the
+    // latency.
+    const std::uint64_t MinimumMeasuredSize = 64 * 1024;
+
+    std::uint64_t Nanoseconds = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Elapsed).count());
+    if (Size < MinimumMeasuredSize || !Nanoseconds)
+    {
+        return;
+    }
+
+    std::uint64_t Sample = Size * 1000000000 / Nanoseconds;
+    std::uint64_t Previous = this->m_LinkThroughput;
+    this->m_LinkThroughput = Previous ? (Previous * 7 + Sample) / 8 : Sample;
+}
+
+bool Mile::Cirno::Client::CompressPayload(
+    const void* Buffer,
+    std::uint32_t const& Size,
+    std::vector<std::uint8_t>& Output)
+{
+    std::chrono::steady_clock::time_point StartTime =
+        std::chrono::steady_clock::now();
+    Output.resize(Size);
+    SIZE_T CompressedSize = 0;
+    BOOL Compressed = FALSE;
+    {
+        std::lock_guard<std::mutex> Guard(this->m_CompressionMutex);
+        Compressed = ::Compress(
+            this->m_Compressor,
+            Buffer,
+            Size,
+            Output.data(),
+            Output.size(),
+            &CompressedSize);
+    }
+    if (!Compressed || CompressedSize >= Size)
+    {
+        // The payload is not compressible if the output buffer which has the
+        // same size as the input is insufficient.
+        CompressedSize = Size;
+    }
+    this->UpdateCompressionState(
+        this->m_WriteCompression,
+        Size,
+        CompressedSize,
+        std::chrono::steady_clock::now() - StartTime);
+    if (CompressedSize >= Size)
+    {
+        return false;
+    }
+    // Send it compressed anyway because it is already done, and the backoff
+    // only affects the following messages.
+    Output.resize(CompressedSize);
+    return true;
+}
+
+std::uint32_t Mile::Cirno::Client::ReadCompressedPayload(
+    std::uint32_t const& FileId,
+    std::uint64_t const& Offset,
+    void* Buffer,
+    std::uint32_t const& NumberOfBytesToRead,
+    std::uint32_t& NumberOfBytesRead)
+{
+    Mile::Cirno::CompressedReadRequest Request = {};
+    Request.FileId = FileId;
+    Request.Offset = Offset;
+    Request.Count = NumberOfBytesToRead;
+    Mile::Cirno::CompressedReadResponse Response = {};
+    std::uint32_t ErrorCode = this->CompressedRead(Request, Response);
+    if (0 != ErrorCode)
+    {
+        return ErrorCode;
+    }
+    if (Response.Count > NumberOfBytesToRead ||
+        Response.Data.size() > Response.Count)
+    {
+        return APTX_EIO;
+    }
+
+    if (Response.Data.size() == Response.Count)
+    {
+        // Stored as is because the server failed to compress it.
+        if (Response.Count)
+        {
+            std::memcpy(Buffer, Response.Data.data(), Response.Count);
+        }
+        this->UpdateCompressionState(
+            this->m_ReadCompression,
+            Response.Count,
+            Response.Count,
+            std::chrono::steady_clock::duration::zero());
+    }
+    else
+    {
+        std::chrono::steady_clock::time_point StartTime =
+            std::chrono::steady_clock::now();
+        SIZE_T DecompressedSize = 0;
+        BOOL Decompressed = FALSE;
+        {
+            std::lock_guard<std::mutex> Guard(this->m_CompressionMutex);
+            Decompressed = ::Decompress(
+                this->m_Decompressor,
+                Response.Data.data(),
+                Response.Data.size(),
+                Buffer,
+                Response.Count,
+                &DecompressedSize);
+        }
+        if (!Decompressed || Response.Count != DecompressedSize)
+        {
+            return APTX_EIO;
+        }
+        this->UpdateCompressionState(
+            this->m_ReadCompression,
+            Response.Count,
+            Response.Data.size(),
+            std::chrono::steady_clock::now() - StartTime);
+    }
+
+    NumberOfBytesRead = Response.Count;
+    return 0;
+}
+
+bool Mile::Cirno::Client::ReceiveMessage(
+    Mile::Cirno::Header& ResponseHeader,
+    std::vector<std::uint8_t>& ResponseBuffer)
+{
     {
         ResponseBuffer.resize(Mile::Cirno::HeaderSize);
         DWORD NumberOfBytesRecvd = 0;
@@ -174,23 +619,19 @@ std::uint32_t Mile::Cirno::Client::RequestResponse(
             &NumberOfBytesRecvd,
             &Flags))
         {
-            return APTX_EIO;
+            return false;
         }
         if (Mile::Cirno::HeaderSize != NumberOfBytesRecvd)
         {
-            return APTX_EIO;
+            return false;
         }
         std::span<std::uint8_t> Span = std::span<std::uint8_t>(ResponseBuffer);
         ResponseHeader = Mile::Cirno::PopHeader(Span);
-        if (Tag != ResponseHeader.Tag)
-        {
-            return APTX_EIO;
-        }
     }
 
+    ResponseBuffer.resize(ResponseHeader.Size);
     if (ResponseHeader.Size)
     {
-        ResponseBuffer.resize(ResponseHeader.Size);
         DWORD NumberOfBytesRecvd = 0;
         DWORD Flags = MSG_WAITALL;
         if (!this->SocketRecv(
@@ -199,21 +640,28 @@ std::uint32_t Mile::Cirno::Client::RequestResponse(
             &NumberOfBytesRecvd,
             &Flags))
         {
-            return APTX_EIO;
+            return false;
         }
         if (ResponseHeader.Size != NumberOfBytesRecvd)
         {
-            return APTX_EIO;
+            return false;
         }
     }
 
+    return true;
+}
+
+std::uint32_t Mile::Cirno::Client::ParseResponse(
+    MILE_CIRNO_MESSAGE_TYPE const& ResponseType,
+    Mile::Cirno::Header const& ResponseHeader,
+    std::vector<std::uint8_t>& ResponseBuffer,
+    std::vector<std::uint8_t>& ResponseContent)
+{
     std::span<std::uint8_t> ResponseContentSpan =
         std::span<std::uint8_t>(ResponseBuffer);
     if (ResponseType == ResponseHeader.Type)
     {
-        ResponseContent.assign(
-            ResponseContentSpan.begin(),
-            ResponseContentSpan.end());
+        ResponseContent = std::move(ResponseBuffer);
     }
     else if (MileCirnoErrorResponseMessage == ResponseHeader.Type)
     {
@@ -310,6 +758,29 @@ std::uint32_t Mile::Cirno::Client::Walk(
     return ErrorCode;
 }
 
+std::uint32_t Mile::Cirno::Client::Walk(
+    Mile::Cirno::EncodedWalkRequest const& Request,
+    Mile::Cirno::WalkResponse& Response)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    Mile::Cirno::PushEncodedWalkRequest(
+        RequestBuffer,
+        Request);
+    std::vector<std::uint8_t> ResponseBuffer;
+    std::uint32_t ErrorCode = this->RequestResponse(
+        MileCirnoWalkRequestMessage,
+        RequestBuffer,
+        MileCirnoWalkResponseMessage,
+        ResponseBuffer);
+    if (0 == ErrorCode)
+    {
+        std::span<std::uint8_t> ResponseSpan =
+            std::span<std::uint8_t>(ResponseBuffer);
+        Response = Mile::Cirno::PopWalkResponse(ResponseSpan);
+    }
+    return ErrorCode;
+}
+
 std::uint32_t Mile::Cirno::Client::Clunk(
     Mile::Cirno::ClunkRequest const& Request)
 {
@@ -500,6 +971,21 @@ std::uint32_t Mile::Cirno::Client::RenameAt(
         ResponseBuffer);
 }
 
+std::uint32_t Mile::Cirno::Client::UnlinkAt(
+    Mile::Cirno::UnlinkAtRequest const& Request)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    Mile::Cirno::PushUnlinkAtRequest(
+        RequestBuffer,
+        Request);
+    std::vector<std::uint8_t> ResponseBuffer;
+    return this->RequestResponse(
+        MileCirnoUnlinkAtRequestMessage,
+        RequestBuffer,
+        MileCirnoUnlinkAtResponseMessage,
+        ResponseBuffer);
+}
+
 std::uint32_t Mile::Cirno::Client::Write(
     Mile::Cirno::WriteRequest const& Request,
     Mile::Cirno::WriteResponse& Response)
@@ -569,6 +1055,205 @@ std::uint32_t Mile::Cirno::Client::LinuxCreate(
     return ErrorCode;
 }
 
+std::uint32_t Mile::Cirno::Client::Access(
+    Mile::Cirno::AccessRequest const& Request)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    Mile::Cirno::PushAccessRequest(
+        RequestBuffer,
+        Request);
+    std::vector<std::uint8_t> ResponseBuffer;
+    return this->RequestResponse(
+        MileCirnoAccessRequestMessage,
+        RequestBuffer,
+        MileCirnoAccessResponseMessage,
+        ResponseBuffer);
+}
+
+std::uint32_t Mile::Cirno::Client::WindowsOpen(
+    Mile::Cirno::WindowsOpenRequest const& Request,
+    Mile::Cirno::WindowsOpenResponse& Response)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    Mile::Cirno::PushWindowsOpenRequest(
+        RequestBuffer,
+        Request);
+    std::vector<std::uint8_t> ResponseBuffer;
+    std::uint32_t ErrorCode = this->RequestResponse(
+        MileCirnoWindowsOpenRequestMessage,
+        RequestBuffer,
+        MileCirnoWindowsOpenResponseMessage,
+        ResponseBuffer);
+    if (0 == ErrorCode)
+    {
+        std::span<std::uint8_t> ResponseSpan =
+            std::span<std::uint8_t>(ResponseBuffer);
+        Response = Mile::Cirno::PopWindowsOpenResponse(ResponseSpan);
+    }
+    return ErrorCode;
+}
+
+std::uint32_t Mile::Cirno::Client::WindowsReadDirectory(
+    Mile::Cirno::WindowsReadDirectoryRequest const& Request,
+    Mile::Cirno::WindowsReadDirectoryResponse& Response)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    Mile::Cirno::PushWindowsReadDirectoryRequest(
+        RequestBuffer,
+        Request);
+    std::vector<std::uint8_t> ResponseBuffer;
+    std::uint32_t ErrorCode = this->RequestResponse(
+        MileCirnoWindowsReadDirectoryRequestMessage,
+        RequestBuffer,
+        MileCirnoWindowsReadDirectoryResponseMessage,
+        ResponseBuffer);
+    if (0 == ErrorCode)
+    {
+        std::span<std::uint8_t> ResponseSpan =
+            std::span<std::uint8_t>(ResponseBuffer);
+        Response = Mile::Cirno::PopWindowsReadDirectoryResponse(ResponseSpan);
+    }
+    return ErrorCode;
+}
+
+std::uint32_t Mile::Cirno::Client::Lease(
+    Mile::Cirno::LeaseRequest const& Request,
+    Mile::Cirno::LeaseResponse& Response)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    Mile::Cirno::PushLeaseRequest(
+        RequestBuffer,
+        Request);
+    std::vector<std::uint8_t> ResponseBuffer;
+    std::uint32_t ErrorCode = this->RequestResponse(
+        MileCirnoLeaseRequestMessage,
+        RequestBuffer,
+        MileCirnoLeaseResponseMessage,
+        ResponseBuffer);
+    if (0 == ErrorCode)
+    {
+        std::span<std::uint8_t> ResponseSpan =
+            std::span<std::uint8_t>(ResponseBuffer);
+        Response = Mile::Cirno::PopLeaseResponse(ResponseSpan);
+    }
+    return ErrorCode;
+}
+
+std::uint32_t Mile::Cirno::Client::Notify(
+    Mile::Cirno::NotifyRequest const& Request,
+    Mile::Cirno::NotifyResponse& Response)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    Mile::Cirno::PushNotifyRequest(
+        RequestBuffer,
+        Request);
+    std::vector<std::uint8_t> ResponseBuffer;
+    std::uint32_t ErrorCode = this->RequestResponse(
+        MileCirnoNotifyRequestMessage,
+        RequestBuffer,
+        MileCirnoNotifyResponseMessage,
+        ResponseBuffer);
+    if (0 == ErrorCode)
+    {
+        std::span<std::uint8_t> ResponseSpan =
+            std::span<std::uint8_t>(ResponseBuffer);
+        Response = Mile::Cirno::PopNotifyResponse(ResponseSpan);
+    }
+    return ErrorCode;
+}
+
+std::uint32_t Mile::Cirno::Client::CopyRange(
+    Mile::Cirno::CopyRangeRequest const& Request,
+    Mile::Cirno::CopyRangeResponse& Response)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    Mile::Cirno::PushCopyRangeRequest(
+        RequestBuffer,
+        Request);
+    std::vector<std::uint8_t> ResponseBuffer;
+    std::uint32_t ErrorCode = this->RequestResponse(
+        MileCirnoCopyRangeRequestMessage,
+        RequestBuffer,
+        MileCirnoCopyRangeResponseMessage,
+        ResponseBuffer);
+    if (0 == ErrorCode)
+    {
+        std::span<std::uint8_t> ResponseSpan =
+            std::span<std::uint8_t>(ResponseBuffer);
+        Response = Mile::Cirno::PopCopyRangeResponse(ResponseSpan);
+    }
+    return ErrorCode;
+}
+
+std::uint32_t Mile::Cirno::Client::CompressedRead(
+    Mile::Cirno::CompressedReadRequest const& Request,
+    Mile::Cirno::CompressedReadResponse& Response)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    Mile::Cirno::PushCompressedReadRequest(
+        RequestBuffer,
+        Request);
+    std::vector<std::uint8_t> ResponseBuffer;
+    std::uint32_t ErrorCode = this->RequestResponse(
+        MileCirnoCompressedReadRequestMessage,
+        RequestBuffer,
+        MileCirnoCompressedReadResponseMessage,
+        ResponseBuffer);
+    if (0 == ErrorCode)
+    {
+        std::span<std::uint8_t> ResponseSpan =
+            std::span<std::uint8_t>(ResponseBuffer);
+        Response = Mile::Cirno::PopCompressedReadResponse(ResponseSpan);
+    }
+    return ErrorCode;
+}
+
+std::uint32_t Mile::Cirno::Client::CompressedWrite(
+    Mile::Cirno::CompressedWriteRequest const& Request,
+    Mile::Cirno::CompressedWriteResponse& Response)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    Mile::Cirno::PushCompressedWriteRequest(
+        RequestBuffer,
+        Request);
+    std::vector<std::uint8_t> ResponseBuffer;
+    std::uint32_t ErrorCode = this->RequestResponse(
+        MileCirnoCompressedWriteRequestMessage,
+        RequestBuffer,
+        MileCirnoCompressedWriteResponseMessage,
+        ResponseBuffer);
+    if (0 == ErrorCode)
+    {
+        std::span<std::uint8_t> ResponseSpan =
+            std::span<std::uint8_t>(ResponseBuffer);
+        Response = Mile::Cirno::PopCompressedWriteResponse(ResponseSpan);
+    }
+    return ErrorCode;
+}
+
+std::uint32_t Mile::Cirno::Client::Append(
+    Mile::Cirno::AppendRequest const& Request,
+    Mile::Cirno::AppendResponse& Response)
+{
+    std::vector<std::uint8_t> RequestBuffer;
+    Mile::Cirno::PushAppendRequest(
+        RequestBuffer,
+        Request);
+    std::vector<std::uint8_t> ResponseBuffer;
+    std::uint32_t ErrorCode = this->RequestResponse(
+        MileCirnoAppendRequestMessage,
+        RequestBuffer,
+        MileCirnoAppendResponseMessage,
+        ResponseBuffer);
+    if (0 == ErrorCode)
+    {
+        std::span<std::uint8_t> ResponseSpan =
+            std::span<std::uint8_t>(ResponseBuffer);
+        Response = Mile::Cirno::PopAppendResponse(ResponseSpan);
+    }
+    return ErrorCode;
+}
+
 std::uint32_t Mile::Cirno::Client::Read(
     std::uint32_t const& FileId,
     std::uint64_t const& Offset,
@@ -576,8 +1261,25 @@ std::uint32_t Mile::Cirno::Client::Read(
     std::uint32_t const& NumberOfBytesToRead,
     std::uint32_t& NumberOfBytesRead)
 {
+    if (this->ShouldCompress(this->m_ReadCompression, NumberOfBytesToRead))
+    {
+        std::uint32_t ErrorCode = this->ReadCompressedPayload(
+            FileId,
+            Offset,
+            Buffer,
+            NumberOfBytesToRead,
+            NumberOfBytesRead);
+        if (!this->CheckCompressionRefused(ErrorCode))
+        {
+            return ErrorCode;
+        }
+    }
+
     std::lock_guard<std::mutex> Guard(this->m_RequestResponseMutex);
 
+    std::chrono::steady_clock::time_point StartTime =
+        std::chrono::steady_clock::now();
+
     Mile::Cirno::ReadRequest Request = {};
     Request.FileId = FileId;
     Request.Offset = Offset;
@@ -675,6 +1377,9 @@ std::uint32_t Mile::Cirno::Client::Read(
                 return APTX_EIO;
             }
         }
+        this->UpdateLinkThroughput(
+            NumberOfBytesRead,
+            std::chrono::steady_clock::now() - StartTime);
         return 0;
     }
 
@@ -728,8 +1433,32 @@ std::uint32_t Mile::Cirno::Client::Write(
     std::uint32_t const& NumberOfBytesToWrite,
     std::uint32_t& NumberOfBytesWritten)
 {
+    if (this->ShouldCompress(this->m_WriteCompression, NumberOfBytesToWrite))
+    {
+        Mile::Cirno::CompressedWriteRequest Request = {};
+        if (this->CompressPayload(Buffer, NumberOfBytesToWrite, Request.Data))
+        {
+            Request.FileId = FileId;
+            Request.Offset = Offset;
+            Request.Count = NumberOfBytesToWrite;
+            Mile::Cirno::CompressedWriteResponse Response = {};
+            std::uint32_t ErrorCode = this->CompressedWrite(Request, Response);
+            if (0 == ErrorCode)
+            {
+                NumberOfBytesWritten = Response.Count;
+            }
+            if (!this->CheckCompressionRefused(ErrorCode))
+            {
+                return ErrorCode;
+            }
+        }
+    }
+
     std::lock_guard<std::mutex> Guard(this->m_RequestResponseMutex);
 
+    std::chrono::steady_clock::time_point StartTime =
+        std::chrono::steady_clock::now();
+
     std::uint16_t Tag = 1;
 
     Mile::Cirno::Header RequestHeader = {};
@@ -815,6 +1544,9 @@ std::uint32_t Mile::Cirno::Client::Write(
     {
         NumberOfBytesWritten = 
             Mile::Cirno::PopWriteResponse(ResponseContentSpan).Count;
+        this->UpdateLinkThroughput(
+            NumberOfBytesToWrite,
+            std::chrono::steady_clock::now() - StartTime);
     }
     else if (MileCirnoErrorResponseMessage == ResponseHeader.Type)
     {
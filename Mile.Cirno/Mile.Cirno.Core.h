@@ -13,6 +13,10 @@
 
 #include "Mile.Cirno.Protocol.h"
 
+#include <compressapi.h>
+
+#include <atomic>
+#include <chrono>
 #include <map>
 #include <mutex>
 #include <set>
@@ -23,6 +27,15 @@ namespace Mile::Cirno
         std::string_view Checkpoint,
         std::int32_t const& Code);
 
+    struct PipelinedRequest
+    {
+        MILE_CIRNO_MESSAGE_TYPE RequestType;
+        std::vector<std::uint8_t> RequestContent;
+        MILE_CIRNO_MESSAGE_TYPE ResponseType;
+        std::vector<std::uint8_t> ResponseContent;
+        std::uint32_t ErrorCode;
+    };
+
     class Client
     {
     private:
@@ -32,6 +45,28 @@ namespace Mile::Cirno
         std::set<std::uint32_t> m_ReusableFileIds;
         SOCKET m_Socket = INVALID_SOCKET;
         std::mutex m_RequestResponseMutex;
+
+        // The state of the adaptive payload compression of one direction.
+        // The compression is skipped for the next messages after it does not
+        // pay off, and the number of skipped messages is doubled each time
+        // until it pays off again.
+        struct CompressionState
+        {
+            std::atomic<std::uint32_t> SkippedMessages = 0;
+            std::atomic<std::uint32_t> Backoff = 0;
+        };
+
+        std::mutex m_CompressionMutex;
+        COMPRESSOR_HANDLE m_Compressor = nullptr;
+        DECOMPRESSOR_HANDLE m_Decompressor = nullptr;
+        CompressionState m_ReadCompression;
+        CompressionState m_WriteCompression;
+        // Cleared if the server refuses Tcread or Tcwrite, and the plain
+        // Tread and Twrite are used since then.
+        std::atomic<bool> m_CompressionSupported = true;
+        // In bytes per second, which is measured from the large reads and
+        // writes.
+        std::atomic<std::uint64_t> m_LinkThroughput = 0;
         
         Client() = default;
 
@@ -47,10 +82,70 @@ namespace Mile::Cirno
             _Out_opt_ LPDWORD NumberOfBytesSent,
             _In_ DWORD Flags);
 
+        bool ReceiveMessage(
+            Header& ResponseHeader,
+            std::vector<std::uint8_t>& ResponseBuffer);
+
+        std::uint32_t ParseResponse(
+            MILE_CIRNO_MESSAGE_TYPE const& ResponseType,
+            Header const& ResponseHeader,
+            std::vector<std::uint8_t>& ResponseBuffer,
+            std::vector<std::uint8_t>& ResponseContent);
+
+        // Returns true if the error means Tcread or Tcwrite is not supported,
+        // and disables the compression for the following messages.
+        bool CheckCompressionRefused(
+            std::uint32_t const& ErrorCode);
+
+        bool ShouldCompress(
+            CompressionState& State,
+            std::uint32_t const& Size);
+
+        void UpdateCompressionState(
+            CompressionState& State,
+            std::uint64_t const& UncompressedSize,
+            std::uint64_t const& CompressedSize,
+            std::chrono::steady_clock::duration const& CodecTime);
+
+        void UpdateLinkThroughput(
+            std::uint64_t const& Size,
+            std::chrono::steady_clock::duration const& Elapsed);
+
+        // Returns false if the payload is not compressible, and it should be
+        // sent uncompressed.
+        bool CompressPayload(
+            const void* Buffer,
+            std::uint32_t const& Size,
+            std::vector<std::uint8_t>& Output);
+
+        std::uint32_t MakeCompoundRequest(
+            std::vector<PipelinedRequest>& Operations,
+            std::vector<std::uint8_t>& RequestContent);
+
+        std::uint32_t ParseCompoundResponse(
+            std::vector<PipelinedRequest>& Operations,
+            std::vector<std::uint8_t>& ResponseContent);
+
+        std::uint32_t ReadCompressedPayload(
+            std::uint32_t const& FileId,
+            std::uint64_t const& Offset,
+            void* Buffer,
+            std::uint32_t const& NumberOfBytesToRead,
+            std::uint32_t& NumberOfBytesRead);
+
     public:
 
         ~Client();
 
+        // Shut down the connection, so the requests blocked in other threads
+        // fail with APTX_EIO.
+        void Disconnect();
+
+        // Compress the payloads of the large reads and writes with
+        // Tcread and Tcwrite adaptively, which needs the 9P2000.L.Cirno
+        // extension.
+        bool EnableCompression();
+
         std::uint32_t AllocateFileId();
 
         void FreeFileId(
@@ -62,6 +157,26 @@ namespace Mile::Cirno
             MILE_CIRNO_MESSAGE_TYPE const& ResponseType,
             std::vector<std::uint8_t>& ResponseContent);
 
+        // Send all requests back to back before receiving any response, and
+        // match the responses by tag. The result of each request is stored
+        // in PipelinedRequest::ErrorCode and PipelinedRequest::ResponseContent.
+        void PipelinedRequestResponse(
+            std::vector<PipelinedRequest>& Requests);
+
+        // Send all operations in a single Tcompound, and store the result of
+        // each operation in the same way as PipelinedRequestResponse. The
+        // operations after the first failed one are not executed and fail
+        // with APTX_LINUX_ECANCELED. Returns the error of Tcompound itself.
+        std::uint32_t Compound(
+            std::vector<PipelinedRequest>& Operations);
+
+        // Send each group of operations in its own Tcompound, and pipeline
+        // the Tcompound requests like PipelinedRequestResponse. If the whole
+        // Tcompound of a group fails, all operations of the group fail with
+        // the error of Tcompound.
+        void PipelinedCompound(
+            std::vector<std::vector<PipelinedRequest>>& Compounds);
+
         std::uint32_t Version(
             VersionRequest const& Request,
             VersionResponse& Response);
@@ -74,6 +189,10 @@ namespace Mile::Cirno
             WalkRequest const& Request,
             WalkResponse& Response);
 
+        std::uint32_t Walk(
+            EncodedWalkRequest const& Request,
+            WalkResponse& Response);
+
         std::uint32_t Clunk(
             ClunkRequest const& Request);
 
@@ -109,6 +228,9 @@ namespace Mile::Cirno
         std::uint32_t RenameAt(
             RenameAtRequest const& Request);
 
+        std::uint32_t UnlinkAt(
+            UnlinkAtRequest const& Request);
+
         std::uint32_t Write(
             WriteRequest const& Request,
             WriteResponse& Response);
@@ -121,6 +243,41 @@ namespace Mile::Cirno
             LinuxCreateRequest const& Request,
             LinuxCreateResponse& Response);
 
+        std::uint32_t Access(
+            AccessRequest const& Request);
+
+        std::uint32_t WindowsOpen(
+            WindowsOpenRequest const& Request,
+            WindowsOpenResponse& Response);
+
+        std::uint32_t WindowsReadDirectory(
+            WindowsReadDirectoryRequest const& Request,
+            WindowsReadDirectoryResponse& Response);
+
+        std::uint32_t Lease(
+            LeaseRequest const& Request,
+            LeaseResponse& Response);
+
+        std::uint32_t Notify(
+            NotifyRequest const& Request,
+            NotifyResponse& Response);
+
+        std::uint32_t CopyRange(
+            CopyRangeRequest const& Request,
+            CopyRangeResponse& Response);
+
+        std::uint32_t CompressedRead(
+            CompressedReadRequest const& Request,
+            CompressedReadResponse& Response);
+
+        std::uint32_t CompressedWrite(
+            CompressedWriteRequest const& Request,
+            CompressedWriteResponse& Response);
+
+        std::uint32_t Append(
+            AppendRequest const& Request,
+            AppendResponse& Response);
+
         std::uint32_t Read(
             std::uint32_t const& FileId,
             std::uint64_t const& Offset,
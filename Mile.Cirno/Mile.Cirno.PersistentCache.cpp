@@ -0,0 +1,396 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.Cirno.PersistentCache.cpp
+ * PURPOSE:    Implementation for Mile.Cirno Persistent Content Cache
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ *             per1cycle (pericycle.cc@gmail.com)
+ */
+
+#include "Mile.Cirno.PersistentCache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+namespace
+{
+    const std::uint32_t PersistentCacheSignature = 0x4350434D; // 'MCPC'
+    const std::uint32_t PersistentCacheFormatVersion = 1;
+    const std::uint64_t PersistentCacheBlockValid = 1ULL << 63;
+
+    // The signature is written after all other fields, so the segment is
+    // reset on the next open if the header is torn.
+    struct PersistentCacheHeader
+    {
+        std::uint32_t Signature;
+        std::uint32_t FormatVersion;
+        Mile::Cirno::PersistentCacheIdentity Identity;
+        std::uint64_t BlockSize;
+    };
+
+    bool IsSameIdentity(
+        Mile::Cirno::PersistentCacheIdentity const& Left,
+        Mile::Cirno::PersistentCacheIdentity const& Right)
+    {
+        return
+            Left.VolumeSerialNumber == Right.VolumeSerialNumber &&
+            Left.Version == Right.Version &&
+            Left.Path == Right.Path &&
+            Left.FileSize == Right.FileSize &&
+            Left.LastWriteTimeSeconds == Right.LastWriteTimeSeconds &&
+            Left.LastWriteTimeNanoseconds == Right.LastWriteTimeNanoseconds;
+    }
+
+    std::uint64_t GetBlockCount(
+        std::uint64_t const& FileSize)
+    {
+        return (FileSize + Mile::Cirno::PersistentCacheBlockSize - 1)
+            / Mile::Cirno::PersistentCacheBlockSize;
+    }
+
+    std::uint64_t GetDataOffset(
+        std::uint64_t const& FileSize)
+    {
+        std::uint64_t Size = sizeof(PersistentCacheHeader);
+        Size += ::GetBlockCount(FileSize) * sizeof(std::uint64_t);
+        return ((Size + Mile::Cirno::PersistentCacheBlockSize - 1)
+            / Mile::Cirno::PersistentCacheBlockSize)
+            * Mile::Cirno::PersistentCacheBlockSize;
+    }
+
+    std::uint64_t GetViewSize(
+        std::uint64_t const& FileSize)
+    {
+        return ::GetDataOffset(FileSize)
+            + ::GetBlockCount(FileSize) * Mile::Cirno::PersistentCacheBlockSize;
+    }
+
+    // The checksum is seeded with the identity and the block index, so the
+    // block table entries left from the previous identity are never valid.
+    std::uint32_t CalculateBlockChecksum(
+        Mile::Cirno::PersistentCacheIdentity const& Identity,
+        std::uint64_t const& BlockIndex,
+        std::uint8_t const* Buffer,
+        std::size_t const& Size)
+    {
+        const std::uint32_t FnvPrime = 16777619U;
+        std::uint32_t Hash = 2166136261U;
+        auto Update = [&](
+            std::uint8_t const* Data,
+            std::size_t const& Length)
+        {
+            for (std::size_t i = 0; i < Length; ++i)
+            {
+                Hash ^= Data[i];
+                Hash *= FnvPrime;
+            }
+        };
+        Update(
+            reinterpret_cast<std::uint8_t const*>(&Identity),
+            sizeof(Identity));
+        Update(
+            reinterpret_cast<std::uint8_t const*>(&BlockIndex),
+            sizeof(BlockIndex));
+        Update(Buffer, Size);
+        return Hash;
+    }
+}
+
+void Mile::Cirno::PersistentCacheSegment::Unmap()
+{
+    if (this->m_View)
+    {
+        ::UnmapViewOfFile(this->m_View);
+        this->m_View = nullptr;
+    }
+    if (this->m_MappingHandle)
+    {
+        ::CloseHandle(this->m_MappingHandle);
+        this->m_MappingHandle = nullptr;
+    }
+    this->m_ViewSize = 0;
+}
+
+bool Mile::Cirno::PersistentCacheSegment::Map(
+    std::uint64_t const& FileSize)
+{
+    this->Unmap();
+
+    std::uint64_t SegmentSize = ::GetViewSize(FileSize);
+    std::uint64_t ViewSize = ::GetDataOffset(FileSize);
+    this->m_MappingHandle = ::CreateFileMappingW(
+        this->m_FileHandle,
+        nullptr,
+        PAGE_READWRITE,
+        static_cast<DWORD>(SegmentSize >> 32),
+        static_cast<DWORD>(SegmentSize),
+        nullptr);
+    if (!this->m_MappingHandle)
+    {
+        return false;
+    }
+
+    this->m_View = reinterpret_cast<std::uint8_t*>(::MapViewOfFile(
+        this->m_MappingHandle,
+        FILE_MAP_READ | FILE_MAP_WRITE,
+        0,
+        0,
+        static_cast<SIZE_T>(ViewSize)));
+    if (!this->m_View)
+    {
+        this->Unmap();
+        return false;
+    }
+
+    this->m_ViewSize = ViewSize;
+    return true;
+}
+
+bool Mile::Cirno::PersistentCacheSegment::Reset(
+    PersistentCacheIdentity const& Identity)
+{
+    this->Unmap();
+    this->m_Identity = Identity;
+    this->m_Invalidated = true;
+
+    // Truncate the file first to discard all content of the previous
+    // identity.
+    LARGE_INTEGER FileSize = {};
+    if (!::SetFilePointerEx(
+        this->m_FileHandle,
+        FileSize,
+        nullptr,
+        FILE_BEGIN) ||
+        !::SetEndOfFile(this->m_FileHandle))
+    {
+        return false;
+    }
+    if (!this->Map(Identity.FileSize))
+    {
+        return false;
+    }
+
+    PersistentCacheHeader* Header =
+        reinterpret_cast<PersistentCacheHeader*>(this->m_View);
+    Header->FormatVersion = PersistentCacheFormatVersion;
+    Header->Identity = Identity;
+    Header->BlockSize = PersistentCacheBlockSize;
+    ::FlushViewOfFile(this->m_View, sizeof(PersistentCacheHeader));
+    Header->Signature = PersistentCacheSignature;
+
+    this->m_Invalidated = false;
+    return true;
+}
+
+std::uint64_t Mile::Cirno::PersistentCacheSegment::GetBlockCount()
+{
+    return ::GetBlockCount(this->m_Identity.FileSize);
+}
+
+std::uint64_t* Mile::Cirno::PersistentCacheSegment::GetBlockTable()
+{
+    return reinterpret_cast<std::uint64_t*>(
+        this->m_View + sizeof(PersistentCacheHeader));
+}
+
+std::uint8_t* Mile::Cirno::PersistentCacheSegment::MapBlock(
+    std::uint64_t const& BlockIndex,
+    std::size_t const& BlockSize)
+{
+    // The block offset is aligned to the allocation granularity because the
+    // block size is 64 KiB.
+    std::uint64_t Offset = ::GetDataOffset(this->m_Identity.FileSize);
+    Offset += BlockIndex * PersistentCacheBlockSize;
+    return reinterpret_cast<std::uint8_t*>(::MapViewOfFile(
+        this->m_MappingHandle,
+        FILE_MAP_READ | FILE_MAP_WRITE,
+        static_cast<DWORD>(Offset >> 32),
+        static_cast<DWORD>(Offset),
+        BlockSize));
+}
+
+Mile::Cirno::PersistentCacheSegment::~PersistentCacheSegment()
+{
+    this->Unmap();
+    if (INVALID_HANDLE_VALUE != this->m_FileHandle)
+    {
+        ::CloseHandle(this->m_FileHandle);
+        this->m_FileHandle = INVALID_HANDLE_VALUE;
+    }
+}
+
+bool Mile::Cirno::PersistentCacheSegment::Prepare(
+    PersistentCacheIdentity const& Identity)
+{
+    std::lock_guard<std::mutex> Guard(this->m_Mutex);
+
+    if (this->m_View &&
+        !this->m_Invalidated &&
+        ::IsSameIdentity(this->m_Identity, Identity))
+    {
+        return true;
+    }
+
+    return this->Reset(Identity);
+}
+
+bool Mile::Cirno::PersistentCacheSegment::ReadBlock(
+    std::uint64_t const& BlockIndex,
+    void* Buffer,
+    std::size_t& BlockSize)
+{
+    std::lock_guard<std::mutex> Guard(this->m_Mutex);
+
+    if (!this->m_View ||
+        this->m_Invalidated ||
+        BlockIndex >= this->GetBlockCount())
+    {
+        return false;
+    }
+
+    std::uint64_t Entry = this->GetBlockTable()[BlockIndex];
+    if (!(PersistentCacheBlockValid & Entry))
+    {
+        return false;
+    }
+
+    BlockSize = static_cast<std::size_t>(std::min<std::uint64_t>(
+        PersistentCacheBlockSize,
+        this->m_Identity.FileSize - BlockIndex * PersistentCacheBlockSize));
+    std::uint8_t* Block = this->MapBlock(BlockIndex, BlockSize);
+    if (!Block)
+    {
+        return false;
+    }
+    bool Result = static_cast<std::uint32_t>(Entry) ==
+        ::CalculateBlockChecksum(
+            this->m_Identity,
+            BlockIndex,
+            Block,
+            BlockSize);
+    if (Result)
+    {
+        std::memcpy(Buffer, Block, BlockSize);
+    }
+    ::UnmapViewOfFile(Block);
+    return Result;
+}
+
+void Mile::Cirno::PersistentCacheSegment::WriteBlock(
+    std::uint64_t const& BlockIndex,
+    void const* Buffer,
+    std::size_t const& BlockSize)
+{
+    std::lock_guard<std::mutex> Guard(this->m_Mutex);
+
+    if (!this->m_View ||
+        this->m_Invalidated ||
+        BlockIndex >= this->GetBlockCount())
+    {
+        return;
+    }
+
+    // The file is changed by others if the block size is unexpected.
+    if (BlockSize != std::min<std::uint64_t>(
+        PersistentCacheBlockSize,
+        this->m_Identity.FileSize - BlockIndex * PersistentCacheBlockSize))
+    {
+        return;
+    }
+
+    std::uint8_t* Block = this->MapBlock(BlockIndex, BlockSize);
+    if (!Block)
+    {
+        return;
+    }
+    std::memcpy(Block, Buffer, BlockSize);
+    std::uint32_t Checksum = ::CalculateBlockChecksum(
+        this->m_Identity,
+        BlockIndex,
+        Block,
+        BlockSize);
+    // The block is only marked valid after its data is written to the disk.
+    bool Flushed = ::FlushViewOfFile(Block, BlockSize);
+    ::UnmapViewOfFile(Block);
+    if (!Flushed)
+    {
+        return;
+    }
+    std::uint64_t* Entry = &this->GetBlockTable()[BlockIndex];
+    *Entry = PersistentCacheBlockValid | Checksum;
+    ::FlushViewOfFile(Entry, sizeof(*Entry));
+}
+
+void Mile::Cirno::PersistentCacheSegment::Invalidate()
+{
+    std::lock_guard<std::mutex> Guard(this->m_Mutex);
+
+    this->m_Invalidated = true;
+    if (this->m_View)
+    {
+        reinterpret_cast<PersistentCacheHeader*>(this->m_View)->Signature = 0;
+    }
+}
+
+std::uint64_t Mile::Cirno::PersistentCacheSegment::GetSegmentSize(
+    std::uint64_t const& FileSize)
+{
+    return ::GetViewSize(FileSize);
+}
+
+Mile::Cirno::PersistentCacheSegment* Mile::Cirno::PersistentCacheSegment::Open(
+    std::filesystem::path const& FilePath,
+    PersistentCacheIdentity const& Identity)
+{
+    PersistentCacheSegment* Object =
+        new (std::nothrow) PersistentCacheSegment();
+    if (!Object)
+    {
+        return nullptr;
+    }
+
+    Object->m_FileHandle = ::CreateFileW(
+        FilePath.wstring().c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (INVALID_HANDLE_VALUE == Object->m_FileHandle)
+    {
+        delete Object;
+        return nullptr;
+    }
+
+    // Reuse the existing content only if the header is complete and the
+    // identity is matched.
+    LARGE_INTEGER FileSize = {};
+    if (::GetFileSizeEx(Object->m_FileHandle, &FileSize) &&
+        static_cast<std::uint64_t>(FileSize.QuadPart) ==
+        ::GetViewSize(Identity.FileSize) &&
+        Object->Map(Identity.FileSize))
+    {
+        PersistentCacheHeader* Header =
+            reinterpret_cast<PersistentCacheHeader*>(Object->m_View);
+        if (PersistentCacheSignature == Header->Signature &&
+            PersistentCacheFormatVersion == Header->FormatVersion &&
+            PersistentCacheBlockSize == Header->BlockSize &&
+            ::IsSameIdentity(Header->Identity, Identity))
+        {
+            Object->m_Identity = Identity;
+            return Object;
+        }
+    }
+
+    if (!Object->Reset(Identity))
+    {
+        delete Object;
+        return nullptr;
+    }
+
+    return Object;
+}
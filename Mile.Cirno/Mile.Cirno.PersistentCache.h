@@ -0,0 +1,110 @@
+﻿/*
+ * PROJECT:    Mouri Internal Library Essentials
+ * FILE:       Mile.Cirno.PersistentCache.h
+ * PURPOSE:    Definition for Mile.Cirno Persistent Content Cache
+ *
+ * LICENSE:    The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ *             per1cycle (pericycle.cc@gmail.com)
+ */
+
+#ifndef MILE_CIRNO_PERSISTENT_CACHE
+#define MILE_CIRNO_PERSISTENT_CACHE
+
+#include <Windows.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+
+namespace Mile::Cirno
+{
+    const std::size_t PersistentCacheBlockSize = 64 * 1024;
+
+    // The content of the segment is only valid if all fields are matched.
+    struct PersistentCacheIdentity
+    {
+        std::uint32_t VolumeSerialNumber;
+        std::uint32_t Version; // qid.version
+        std::uint64_t Path; // qid.path
+        std::uint64_t FileSize;
+        std::uint64_t LastWriteTimeSeconds;
+        std::uint64_t LastWriteTimeNanoseconds;
+    };
+
+    // The on-disk cache of the content of a single file, which is a
+    // memory-mapped file that contains the header, the block table and the
+    // block data. Only the header and the block table are mapped while the
+    // segment is open, and each block is mapped only while it is accessed.
+    // Each block table entry holds the checksum of the block, so the torn
+    // blocks written before a crash are treated as missing.
+    class PersistentCacheSegment
+    {
+    private:
+
+        std::mutex m_Mutex;
+        HANDLE m_FileHandle = INVALID_HANDLE_VALUE;
+        HANDLE m_MappingHandle = nullptr;
+        std::uint8_t* m_View = nullptr;
+        std::uint64_t m_ViewSize = 0;
+        PersistentCacheIdentity m_Identity = {};
+        bool m_Invalidated = false;
+
+        PersistentCacheSegment() = default;
+
+        void Unmap();
+
+        // Map the header and the block table of the segment for the file
+        // which has the specific size.
+        bool Map(
+            std::uint64_t const& FileSize);
+
+        bool Reset(
+            PersistentCacheIdentity const& Identity);
+
+        std::uint64_t GetBlockCount();
+
+        std::uint64_t* GetBlockTable();
+
+        // The view should be unmapped by UnmapViewOfFile.
+        std::uint8_t* MapBlock(
+            std::uint64_t const& BlockIndex,
+            std::size_t const& BlockSize);
+
+    public:
+
+        ~PersistentCacheSegment();
+
+        // Reset the segment if the identity is changed.
+        bool Prepare(
+            PersistentCacheIdentity const& Identity);
+
+        // Returns false if the block is missing or corrupted.
+        bool ReadBlock(
+            std::uint64_t const& BlockIndex,
+            void* Buffer,
+            std::size_t& BlockSize);
+
+        void WriteBlock(
+            std::uint64_t const& BlockIndex,
+            void const* Buffer,
+            std::size_t const& BlockSize);
+
+        // Discard all cached content because the file is modified by us.
+        void Invalidate();
+
+    public:
+
+        // The size of the segment file for the file which has the specific
+        // size.
+        static std::uint64_t GetSegmentSize(
+            std::uint64_t const& FileSize);
+
+        static PersistentCacheSegment* Open(
+            std::filesystem::path const& FilePath,
+            PersistentCacheIdentity const& Identity);
+    };
+}
+
+#endif // !MILE_CIRNO_PERSISTENT_CACHE
@@ -300,6 +300,28 @@ void Mile::Cirno::PushWindowsDirectoryEntry(
     Mile::Cirno::PushUInt64(Buffer, Value.ChangeTimeNanoseconds);
 }
 
+Mile::Cirno::CompoundOperation Mile::Cirno::PopCompoundOperation(
+    std::span<std::uint8_t>& Buffer)
+{
+    Mile::Cirno::CompoundOperation Result;
+    std::uint32_t Size = Mile::Cirno::PopUInt32(Buffer);
+    Result.Type = Mile::Cirno::PopUInt8(Buffer);
+    std::span<std::uint8_t> Body = Mile::Cirno::PopBytes(Buffer, Size);
+    Result.Body.assign(Body.begin(), Body.end());
+    return Result;
+}
+
+void Mile::Cirno::PushCompoundOperation(
+    std::vector<std::uint8_t>& Buffer,
+    Mile::Cirno::CompoundOperation const& Value)
+{
+    Mile::Cirno::PushUInt32(
+        Buffer,
+        static_cast<std::uint32_t>(Value.Body.size()));
+    Mile::Cirno::PushUInt8(Buffer, Value.Type);
+    Buffer.insert(Buffer.end(), Value.Body.begin(), Value.Body.end());
+}
+
 Mile::Cirno::LinuxErrorResponse Mile::Cirno::PopLinuxErrorResponse(
     std::span<std::uint8_t>& Buffer)
 {
@@ -535,6 +557,7 @@ void Mile::Cirno::PushFlushFileRequest(
     Mile::Cirno::FlushFileRequest const& Value)
 {
     Mile::Cirno::PushUInt32(Buffer, Value.FileId);
+    Mile::Cirno::PushUInt32(Buffer, Value.DataSync);
 }
 
 void Mile::Cirno::PushLockRequest(
@@ -736,6 +759,21 @@ Mile::Cirno::WalkResponse Mile::Cirno::PopWalkResponse(
     return Result;
 }
 
+void Mile::Cirno::PushEncodedWalkRequest(
+    std::vector<std::uint8_t>& Buffer,
+    Mile::Cirno::EncodedWalkRequest const& Value)
+{
+    Mile::Cirno::PushUInt32(Buffer, Value.FileId);
+    Mile::Cirno::PushUInt32(Buffer, Value.NewFileId);
+    Mile::Cirno::PushUInt16(
+        Buffer,
+        static_cast<std::uint16_t>(Value.Names.size()));
+    for (auto const& Name : Value.Names)
+    {
+        Buffer.insert(Buffer.end(), Name->begin(), Name->end());
+    }
+}
+
 void Mile::Cirno::PushOpenRequest(
     std::vector<std::uint8_t>& Buffer,
     Mile::Cirno::OpenRequest const& Value)
@@ -936,3 +974,144 @@ Mile::Cirno::WindowsOpenResponse Mile::Cirno::PopWindowsOpenResponse(
     Result.DataVersion = Mile::Cirno::PopUInt64(Buffer);
     return Result;
 }
+
+void Mile::Cirno::PushCompoundRequest(
+    std::vector<std::uint8_t>& Buffer,
+    Mile::Cirno::CompoundRequest const& Value)
+{
+    Mile::Cirno::PushUInt16(
+        Buffer,
+        static_cast<std::uint16_t>(Value.Operations.size()));
+    for (auto const& Operation : Value.Operations)
+    {
+        Mile::Cirno::PushCompoundOperation(Buffer, Operation);
+    }
+}
+
+Mile::Cirno::CompoundResponse Mile::Cirno::PopCompoundResponse(
+    std::span<std::uint8_t>& Buffer)
+{
+    Mile::Cirno::CompoundResponse Result;
+    std::uint16_t Count = Mile::Cirno::PopUInt16(Buffer);
+    for (std::uint16_t i = 0; i < Count; ++i)
+    {
+        Result.Results.push_back(Mile::Cirno::PopCompoundOperation(Buffer));
+    }
+    return Result;
+}
+
+void Mile::Cirno::PushLeaseRequest(
+    std::vector<std::uint8_t>& Buffer,
+    Mile::Cirno::LeaseRequest const& Value)
+{
+    Mile::Cirno::PushUInt32(Buffer, Value.FileId);
+    Mile::Cirno::PushUInt64(Buffer, Value.Key);
+}
+
+Mile::Cirno::LeaseResponse Mile::Cirno::PopLeaseResponse(
+    std::span<std::uint8_t>& Buffer)
+{
+    Mile::Cirno::LeaseResponse Result;
+    Result.UniqueId = Mile::Cirno::PopQid(Buffer);
+    Result.Duration = Mile::Cirno::PopUInt32(Buffer);
+    return Result;
+}
+
+void Mile::Cirno::PushNotifyRequest(
+    std::vector<std::uint8_t>& Buffer,
+    Mile::Cirno::NotifyRequest const& Value)
+{
+    Mile::Cirno::PushUInt64(Buffer, Value.Key);
+}
+
+Mile::Cirno::NotifyResponse Mile::Cirno::PopNotifyResponse(
+    std::span<std::uint8_t>& Buffer)
+{
+    Mile::Cirno::NotifyResponse Result;
+    std::uint16_t Count = Mile::Cirno::PopUInt16(Buffer);
+    for (std::uint16_t i = 0; i < Count; ++i)
+    {
+        Result.UniqueIds.push_back(Mile::Cirno::PopQid(Buffer));
+    }
+    return Result;
+}
+
+void Mile::Cirno::PushCopyRangeRequest(
+    std::vector<std::uint8_t>& Buffer,
+    Mile::Cirno::CopyRangeRequest const& Value)
+{
+    Mile::Cirno::PushUInt32(Buffer, Value.FileId);
+    Mile::Cirno::PushUInt64(Buffer, Value.Offset);
+    Mile::Cirno::PushUInt32(Buffer, Value.DestinationFileId);
+    Mile::Cirno::PushUInt64(Buffer, Value.DestinationOffset);
+    Mile::Cirno::PushUInt64(Buffer, Value.Count);
+}
+
+Mile::Cirno::CopyRangeResponse Mile::Cirno::PopCopyRangeResponse(
+    std::span<std::uint8_t>& Buffer)
+{
+    Mile::Cirno::CopyRangeResponse Result;
+    Result.Count = Mile::Cirno::PopUInt64(Buffer);
+    return Result;
+}
+
+void Mile::Cirno::PushCompressedReadRequest(
+    std::vector<std::uint8_t>& Buffer,
+    Mile::Cirno::CompressedReadRequest const& Value)
+{
+    Mile::Cirno::PushUInt32(Buffer, Value.FileId);
+    Mile::Cirno::PushUInt64(Buffer, Value.Offset);
+    Mile::Cirno::PushUInt32(Buffer, Value.Count);
+}
+
+Mile::Cirno::CompressedReadResponse Mile::Cirno::PopCompressedReadResponse(
+    std::span<std::uint8_t>& Buffer)
+{
+    Mile::Cirno::CompressedReadResponse Result;
+    Result.Count = Mile::Cirno::PopUInt32(Buffer);
+    std::uint32_t Length = Mile::Cirno::PopUInt32(Buffer);
+    auto Swap = Mile::Cirno::PopBytes(Buffer, Length);
+    Result.Data.assign(Swap.begin(), Swap.end());
+    return Result;
+}
+
+void Mile::Cirno::PushCompressedWriteRequest(
+    std::vector<std::uint8_t>& Buffer,
+    Mile::Cirno::CompressedWriteRequest const& Value)
+{
+    Mile::Cirno::PushUInt32(Buffer, Value.FileId);
+    Mile::Cirno::PushUInt64(Buffer, Value.Offset);
+    Mile::Cirno::PushUInt32(Buffer, Value.Count);
+    Mile::Cirno::PushUInt32(
+        Buffer,
+        static_cast<std::uint32_t>(Value.Data.size()));
+    Buffer.insert(Buffer.end(), Value.Data.begin(), Value.Data.end());
+}
+
+Mile::Cirno::CompressedWriteResponse Mile::Cirno::PopCompressedWriteResponse(
+    std::span<std::uint8_t>& Buffer)
+{
+    Mile::Cirno::CompressedWriteResponse Result;
+    Result.Count = Mile::Cirno::PopUInt32(Buffer);
+    return Result;
+}
+
+void Mile::Cirno::PushAppendRequest(
+    std::vector<std::uint8_t>& Buffer,
+    Mile::Cirno::AppendRequest const& Value)
+{
+    Mile::Cirno::PushUInt32(Buffer, Value.FileId);
+    Mile::Cirno::PushUInt32(
+        Buffer,
+        static_cast<std::uint32_t>(Value.Data.size()));
+    Buffer.insert(Buffer.end(), Value.Data.begin(), Value.Data.end());
+}
+
+Mile::Cirno::AppendResponse Mile::Cirno::PopAppendResponse(
+    std::span<std::uint8_t>& Buffer)
+{
+    Mile::Cirno::AppendResponse Result;
+    Result.Offset = Mile::Cirno::PopUInt64(Buffer);
+    Result.Count = Mile::Cirno::PopUInt32(Buffer);
+    return Result;
+}
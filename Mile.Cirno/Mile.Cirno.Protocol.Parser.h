@@ -96,6 +96,13 @@ namespace Mile::Cirno
         std::vector<std::uint8_t>& Buffer,
         WindowsDirectoryEntry const& Value);
 
+    CompoundOperation PopCompoundOperation(
+        std::span<std::uint8_t>& Buffer);
+
+    void PushCompoundOperation(
+        std::vector<std::uint8_t>& Buffer,
+        CompoundOperation const& Value);
+
     LinuxErrorResponse PopLinuxErrorResponse(
         std::span<std::uint8_t>& Buffer);
 
@@ -246,6 +253,10 @@ namespace Mile::Cirno
     WalkResponse PopWalkResponse(
         std::span<std::uint8_t>& Buffer);
 
+    void PushEncodedWalkRequest(
+        std::vector<std::uint8_t>& Buffer,
+        EncodedWalkRequest const& Value);
+
     void PushOpenRequest(
         std::vector<std::uint8_t>& Buffer,
         OpenRequest const& Value);
@@ -310,6 +321,55 @@ namespace Mile::Cirno
 
     WindowsOpenResponse PopWindowsOpenResponse(
         std::span<std::uint8_t>& Buffer);
+
+    void PushCompoundRequest(
+        std::vector<std::uint8_t>& Buffer,
+        CompoundRequest const& Value);
+
+    CompoundResponse PopCompoundResponse(
+        std::span<std::uint8_t>& Buffer);
+
+    void PushLeaseRequest(
+        std::vector<std::uint8_t>& Buffer,
+        LeaseRequest const& Value);
+
+    LeaseResponse PopLeaseResponse(
+        std::span<std::uint8_t>& Buffer);
+
+    void PushNotifyRequest(
+        std::vector<std::uint8_t>& Buffer,
+        NotifyRequest const& Value);
+
+    NotifyResponse PopNotifyResponse(
+        std::span<std::uint8_t>& Buffer);
+
+    void PushCopyRangeRequest(
+        std::vector<std::uint8_t>& Buffer,
+        CopyRangeRequest const& Value);
+
+    CopyRangeResponse PopCopyRangeResponse(
+        std::span<std::uint8_t>& Buffer);
+
+    void PushCompressedReadRequest(
+        std::vector<std::uint8_t>& Buffer,
+        CompressedReadRequest const& Value);
+
+    CompressedReadResponse PopCompressedReadResponse(
+        std::span<std::uint8_t>& Buffer);
+
+    void PushCompressedWriteRequest(
+        std::vector<std::uint8_t>& Buffer,
+        CompressedWriteRequest const& Value);
+
+    CompressedWriteResponse PopCompressedWriteResponse(
+        std::span<std::uint8_t>& Buffer);
+
+    void PushAppendRequest(
+        std::vector<std::uint8_t>& Buffer,
+        AppendRequest const& Value);
+
+    AppendResponse PopAppendResponse(
+        std::span<std::uint8_t>& Buffer);
 }
 
 #endif // !MILE_CIRNO_PROTOCOL_PARSER
@@ -62,6 +62,8 @@ typedef enum _MILE_CIRNO_MESSAGE_TYPE
     //   entry<DirectoryEntry>[1] mode[4] uid[4] gid[4] nlink[8] rdev[8] size[8]
     //   blksize[8] blocks[8] atime_sec[8] atime_nsec[8] mtime_sec[8]
     //   mtime_nsec[8] ctime_sec[8] ctime_nsec[8]
+    // %Name%<CompoundOperation>[%Length%]
+    //   size[4] type[1] body[size]
 
     /* 9P2000.L */
 
@@ -123,7 +125,7 @@ typedef enum _MILE_CIRNO_MESSAGE_TYPE
     MileCirnoReadDirectoryRequestMessage = 40,
     // header<Header>[1] count[4] data<DirectoryEntry>[count]
     MileCirnoReadDirectoryResponseMessage,
-    // header<Header>[1] fid[4]
+    // header<Header>[1] fid[4] datasync[4]
     MileCirnoFlushFileRequestMessage = 50,
     // header<Header>[1]
     MileCirnoFlushFileResponseMessage,
@@ -276,16 +278,49 @@ typedef enum _MILE_CIRNO_MESSAGE_TYPE
     // mtime_sec[8] mtime_nsec[8] ctime_sec[8] ctime_nsec[8] btime_sec[8]
     // btime_nsec[8] gen[8] data_version[8]
     MileCirnoWindowsOpenResponseMessage,
+
+    /* Mile.Cirno Extensions (9P2000.L.Cirno) */
+
+    // header<Header>[1] count[2] operation<CompoundOperation>[count]
+    MileCirnoCompoundRequestMessage = 140,
+    // header<Header>[1] count[2] result<CompoundOperation>[count]
+    MileCirnoCompoundResponseMessage,
+    // header<Header>[1] fid[4] key[8]
+    MileCirnoLeaseRequestMessage = 142,
+    // header<Header>[1] qid<Qid>[1] duration[4]
+    MileCirnoLeaseResponseMessage,
+    // header<Header>[1] key[8]
+    MileCirnoNotifyRequestMessage = 144,
+    // header<Header>[1] count[2] qid<Qid>[count]
+    MileCirnoNotifyResponseMessage,
+    // header<Header>[1] fid[4] offset[8] dfid[4] doffset[8] count[8]
+    MileCirnoCopyRangeRequestMessage = 146,
+    // header<Header>[1] count[8]
+    MileCirnoCopyRangeResponseMessage,
+    // header<Header>[1] fid[4] offset[8] count[4]
+    MileCirnoCompressedReadRequestMessage = 148,
+    // header<Header>[1] count[4] ccount[4] data[ccount]
+    MileCirnoCompressedReadResponseMessage,
+    // header<Header>[1] fid[4] offset[8] count[4] ccount[4] data[ccount]
+    MileCirnoCompressedWriteRequestMessage = 150,
+    // header<Header>[1] count[4]
+    MileCirnoCompressedWriteResponseMessage,
+    // header<Header>[1] fid[4] count[4] data[count]
+    MileCirnoAppendRequestMessage = 152,
+    // header<Header>[1] offset[8] count[4]
+    MileCirnoAppendResponseMessage,
 } MILE_CIRNO_MESSAGE_TYPE, *PMILE_CIRNO_MESSAGE_TYPE;
 
 #ifdef __cplusplus
 #define MILE_CIRNO_NOTAG ((std::uint16_t)~0)
 #define MILE_CIRNO_NOFID ((std::uint32_t)~0)
 #define MILE_CIRNO_NONUNAME ((std::uint32_t)~0)
+#define MILE_CIRNO_COMPOUND_FID_BASE ((std::uint32_t)0xFFFFFF00)
 #else
 #define MILE_CIRNO_NOTAG ((uint16_t)~0)
 #define MILE_CIRNO_NOFID ((uint32_t)~0)
 #define MILE_CIRNO_NONUNAME ((uint32_t)~0)
+#define MILE_CIRNO_COMPOUND_FID_BASE ((uint32_t)0xFFFFFF00)
 #endif
 #define MILE_CIRNO_FSTYPE 0x01021997
 #define MILE_CIRNO_MAXWELEM 16
@@ -762,6 +797,9 @@ namespace Mile
         struct FlushFileRequest
         {
             std::uint32_t FileId; // fid
+            // Nonzero to flush the data and only the metadata needed for
+            // retrieving it, which is the same as fdatasync.
+            std::uint32_t DataSync; // datasync
         };
 
         // FlushFileResponse
@@ -853,6 +891,14 @@ namespace Mile
 
         const std::string DefaultProtocolVersion = "9P2000.L";
 
+        // The 9P2000.L dialect with the Windows-oriented messages, which is
+        // offered before DefaultProtocolVersion.
+        const std::string WindowsProtocolVersion = "9P2000.W";
+
+        // The 9P2000.L dialect with the Mile.Cirno extension messages, which
+        // is offered first and falls back to DefaultProtocolVersion.
+        const std::string ExtendedProtocolVersion = "9P2000.L.Cirno";
+
         struct VersionResponse
         {
             std::uint32_t MaximumMessageSize; // msize
@@ -911,6 +957,16 @@ namespace Mile
             std::vector<Qid> UniqueIds; // nwqid, wqid
         };
 
+        // The same as WalkRequest, but the names are already encoded in the
+        // wire format (the 16-bit length prefix with the UTF-8 string) for
+        // reusing the encoded names among requests.
+        struct EncodedWalkRequest
+        {
+            std::uint32_t FileId; // fid
+            std::uint32_t NewFileId; // newfid
+            std::vector<std::vector<std::uint8_t> const*> Names; // wname, nwname
+        };
+
         struct OpenRequest
         {
             std::uint32_t FileId; // fid
@@ -1062,6 +1118,122 @@ namespace Mile
             std::uint64_t Generation; // gen
             std::uint64_t DataVersion; // data_version
         };
+
+        // The body is the content of the message without the header.
+        struct CompoundOperation
+        {
+            std::uint8_t Type;
+            std::vector<std::uint8_t> Body; // size, body
+        };
+
+        // The server executes the operations in order and stops at the first
+        // failed one, whose result is Rlerror. The file IDs from
+        // MILE_CIRNO_COMPOUND_FID_BASE to MILE_CIRNO_NOFID - 1 are local to
+        // the request and clunked by the server after the last operation, so
+        // the intermediate file IDs need no allocation and no Tclunk.
+        struct CompoundRequest
+        {
+            std::vector<CompoundOperation> Operations; // count, operation
+        };
+
+        struct CompoundResponse
+        {
+            std::vector<CompoundOperation> Results; // count, result
+        };
+
+        // Request the read lease on the file, which is broken when the file
+        // or the entries of the directory are changed by anyone. The leases
+        // are owned by the key instead of the connection.
+        struct LeaseRequest
+        {
+            std::uint32_t FileId; // fid
+            std::uint64_t Key;
+        };
+
+        struct LeaseResponse
+        {
+            Qid UniqueId; // qid
+            // In milliseconds, and the lease is not granted if it is zero.
+            std::uint32_t Duration;
+        };
+
+        // Wait until at least one lease owned by the key is broken, which
+        // blocks the connection, so it should be sent on a dedicated one.
+        struct NotifyRequest
+        {
+            std::uint64_t Key;
+        };
+
+        struct NotifyResponse
+        {
+            std::vector<Qid> UniqueIds; // count, qid
+        };
+
+        // Copy the byte range between two opened files on the server, which
+        // may use copy_file_range or reflink. The server may copy less than
+        // requested.
+        struct CopyRangeRequest
+        {
+            std::uint32_t FileId; // fid
+            std::uint64_t Offset;
+            std::uint32_t DestinationFileId; // dfid
+            std::uint64_t DestinationOffset; // doffset
+            std::uint64_t Count;
+        };
+
+        struct CopyRangeResponse
+        {
+            std::uint64_t Count;
+        };
+
+        // The payload is compressed in the raw XPRESS format of the Windows
+        // Compression API, or stored as is if the compressed size is not less
+        // than the uncompressed size, which is the count field.
+        struct CompressedReadRequest
+        {
+            std::uint32_t FileId; // fid
+            std::uint64_t Offset;
+            std::uint32_t Count;
+        };
+
+        struct CompressedReadResponse
+        {
+            std::uint32_t Count;
+            std::vector<std::uint8_t> Data; // ccount, data
+        };
+
+        struct CompressedWriteRequest
+        {
+            std::uint32_t FileId; // fid
+            std::uint64_t Offset;
+            std::uint32_t Count;
+            std::vector<std::uint8_t> Data; // ccount, data
+        };
+
+        struct CompressedWriteResponse
+        {
+            std::uint32_t Count;
+        };
+
+        // Write at the current end of file on the server atomically, which
+        // is the same as the write to the file opened with O_APPEND. The
+        // offset where the data is written is returned.
+        struct AppendRequest
+        {
+            std::uint32_t FileId; // fid
+            std::vector<std::uint8_t> Data; // count, data
+        };
+
+        const std::uint32_t AppendRequestHeaderSize =
+            HeaderSize
+            + sizeof(std::uint32_t) // fid
+            + sizeof(std::uint32_t); // count
+
+        struct AppendResponse
+        {
+            std::uint64_t Offset;
+            std::uint32_t Count;
+        };
     }
 }
 #endif // __cplusplus
@@ -26,14 +26,32 @@
 #include <cstdio>
 #include <cwchar>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
+#include <forward_list>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <random>
+#include <set>
+#include <shared_mutex>
 #include <span>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <string>
 
 #include "Mile.Cirno.Core.h"
+#include "Mile.Cirno.PersistentCache.h"
 #include "Mile.Cirno.Protocol.Parser.h"
-
 #include "Aptx.Posix.Error.h"
 #include "Aptx.Posix.FileMode.h"
 
@@ -184,7 +202,311 @@ namespace
     std::string g_AccessName;
     std::uint32_t g_VolumeSerialNumber = 0;
     std::uint32_t g_RootDirectoryFileId = MILE_CIRNO_NOFID;
+    Mile::Cirno::Qid g_RootDirectoryUniqueId = {};
     std::uint32_t g_MaximumMessageSize = Mile::Cirno::DefaultMaximumMessageSize;
+
+    // The capabilities of the server, which are probed once after attaching.
+    std::size_t g_MaximumWalkElements = MILE_CIRNO_MAXWELEM;
+    bool g_ReadOnlyShare = false;
+    bool g_WindowsOpenSupported = false;
+    bool g_WindowsReadDirectorySupported = false;
+    std::uint32_t g_RootDirectoryGroupId = 0;
+    // The files are created by Twopen with the group of the root directory
+    // until the server refuses it, and the group of the parent directory is
+    // queried after that.
+    std::atomic<bool> g_WindowsOpenRootGroupIdAccepted = true;
+
+    // The extended version string is only offered if requested, because it
+    // costs one more Tversion round trip for the servers which do not
+    // support it, and the strict servers may refuse the session.
+    bool g_Extensions = false;
+
+    // Tcompound is available if the server accepts the extended version
+    // string.
+    bool g_CompoundSupported = false;
+
+    // The 9P2000.W messages are only probed and used if the server accepts
+    // the 9P2000.W version string.
+    bool g_WindowsProtocolSupported = false;
+
+    // Each result of Rcompound adds the type[1] and size[4] to the standalone
+    // response, and Rcompound itself adds the count[2].
+    const std::uint32_t CompoundResultOverhead =
+        sizeof(std::uint16_t) + sizeof(std::uint8_t) + sizeof(std::uint32_t);
+
+    // All modifications are refused if the share is declared immutable. The
+    // share probed as read-only is not write-protected, and the opens for
+    // writing fall back to the read-only opens on it instead.
+    bool g_WriteProtected = false;
+
+    // The per-handle context stored in DOKAN_FILE_INFO::Context. The file ID
+    // is only walked when the handle is created, and Tlopen is deferred until
+    // the first operation which needs an opened file ID, because Windows opens
+    // files constantly just for querying attributes or security information.
+    struct FileContext
+    {
+        std::mutex Mutex;
+        std::uint32_t FileId = MILE_CIRNO_NOFID;
+        Mile::Cirno::Qid UniqueId = {};
+        std::uint32_t OpenFlags = 0;
+        bool Opened = false;
+        // The file ID used for data access, which is the same as FileId
+        // unless the opened file ID is borrowed from the shared opened files.
+        std::uint32_t OpenedFileId = MILE_CIRNO_NOFID;
+        bool Shared = false;
+        // The relative path of the file, which is resolved only once when the
+        // file is opened in the case-insensitive mode. It is also used for
+        // walking the file ID on demand if the walk is skipped because the
+        // qid is cached. Protected by the mutex because it is updated when
+        // the file is renamed.
+        std::filesystem::path RelativeFilePath;
+        bool CacheSegmentAcquired = false;
+        std::shared_ptr<Mile::Cirno::PersistentCacheSegment> CacheSegment;
+        // The beginning of the file read together with Tlopen, which covers
+        // the whole file if InitialContentComplete is true. It is only read
+        // in the immutable mode because other handles cannot invalidate it.
+        std::vector<std::uint8_t> InitialContent;
+        bool InitialContentComplete = false;
+        bool InitialContentValid = false;
+        bool ImagePrefetchChecked = false;
+        // The attributes returned by Twopen, which are only used once for the
+        // query which follows the open.
+        Mile::Cirno::GetAttributesResponse InitialAttributes = {};
+        bool InitialAttributesValid = false;
+        // Set if the metadata is changed through the handle since the last
+        // flush, which needs Tfsync without the datasync flag.
+        std::atomic<bool> MetadataChanged = false;
+        // The process which has created or truncated the file for writing
+        // through the handle, which may be copying another file into it.
+        std::optional<ULONG> CopyDestinationProcessId;
+        // The process which has opened the file only for reading through the
+        // handle, which may be copying it into another file.
+        std::optional<ULONG> CopySourceProcessId;
+    };
+
+    // The opened file IDs shared by the compatible opens of the same regular
+    // file, which are keyed by the qid path and the open flags. The shared
+    // file ID is clunked when the last handle which references it is closed.
+    struct SharedOpenedFile
+    {
+        std::uint32_t FileId = MILE_CIRNO_NOFID;
+        std::size_t ReferenceCount = 0;
+    };
+    using SharedOpenedFileKey = std::pair<std::uint64_t, std::uint32_t>;
+    std::mutex g_SharedOpenedFilesMutex;
+    std::map<SharedOpenedFileKey, SharedOpenedFile> g_SharedOpenedFiles;
+
+    // The last large read of each process which has created an empty file or
+    // truncated a file for writing, which is used for offloading the write of
+    // the same content to Tcopyrange, because CopyFile reads the source and
+    // writes the destination chunk by chunk at the same offsets. Only the
+    // reads through the handles opened only for reading by the same process
+    // are recorded, and the written bytes are compared with the recorded ones
+    // before sending Tcopyrange. The buffer of the last read is reused for
+    // the next one of the same process. The source is forgotten when its
+    // handle is closed.
+    struct CopySource
+    {
+        FileContext* Context = nullptr;
+        std::uint64_t Offset = 0;
+        std::vector<std::uint8_t> Content;
+        // Set while Tcopyrange is sent without holding the lock, and the
+        // source handle waits for it to be cleared before being closed.
+        bool Busy = false;
+    };
+    const std::size_t MinimumCopySourceSize = 64 * 1024;
+    const std::size_t MaximumCopySourceSize = 8 * 1024 * 1024;
+    const std::size_t MaximumCopySources = 16;
+    std::atomic<bool> g_CopyRangeSupported = false;
+    std::mutex g_CopySourcesMutex;
+    std::condition_variable g_CopySourcesCondition;
+    std::unordered_map<ULONG, CopySource> g_CopySources;
+    // The number of the handles created or truncated for writing by each
+    // process, and the reads of other processes are never recorded.
+    std::unordered_map<ULONG, std::size_t> g_CopyDestinations;
+
+    // Compress the large read and write payloads with Tcread and Tcwrite.
+    bool g_Compression = false;
+
+    // Write to the end of file with Tappend, which is atomic on the server
+    // and saves the Tgetattr for the file size.
+    std::atomic<bool> g_AppendSupported = false;
+
+    // The group commit of the flushes of the same file, which are keyed by
+    // the qid path, so the flushes through different file IDs are also
+    // merged. The first caller becomes the leader which sends a single
+    // Tfsync for all callers arrived before it is sent, and the callers
+    // arrived while it is outstanding wait on the condition variable and
+    // are merged into the next one, which is sent by the first of them to
+    // wake up, so no caller is delayed by a timer.
+    struct FlushGroup
+    {
+        std::mutex Mutex;
+        std::condition_variable Condition;
+        // Protected by g_FlushGroupsMutex instead.
+        std::size_t ReferenceCount = 0;
+        std::uint64_t RequestedGeneration = 0;
+        std::uint64_t CompletedGeneration = 0;
+        std::uint32_t CompletedErrorCode = 0;
+        bool Flushing = false;
+        bool MetadataChanged = false;
+    };
+    std::mutex g_FlushGroupsMutex;
+    std::unordered_map<std::uint64_t, std::shared_ptr<FlushGroup>>
+        g_FlushGroups;
+
+    // Delete the files with Tunlinkat on their parent directories, so the
+    // deleted files do not need to be walked.
+    std::atomic<bool> g_UnlinkAtSupported = true;
+
+    // The per-directory indexes for the case-insensitive mode, which map the
+    // case-folded names to the real names. They are only consulted if the
+    // exact path is not found. The indexes are keyed by the case-folded
+    // relative path of the directory, built from Treaddir on the first lookup
+    // and kept current by the mutations made by ourselves. The changes made
+    // by others are picked up when the index expires after the attribute
+    // timeout, or the default timeout if the attributes are not cached.
+    bool g_CaseInsensitive = false;
+    using CaseInsensitiveIndex =
+        std::unordered_map<std::wstring, std::vector<std::wstring>>;
+    struct CaseInsensitiveDirectory
+    {
+        CaseInsensitiveIndex Index;
+        std::chrono::steady_clock::time_point UpdateTime;
+    };
+    const std::size_t MaximumCaseInsensitiveIndexes = 4096;
+    const std::chrono::milliseconds DefaultCaseInsensitiveIndexTimeout(1000);
+    std::mutex g_CaseInsensitiveIndexesMutex;
+    std::unordered_map<std::wstring, CaseInsensitiveDirectory>
+        g_CaseInsensitiveIndexes;
+
+    // The caches for the immutable mode, which never expire because the share
+    // is declared not to change while mounted. Each cache is cleared when it
+    // reaches the limit instead.
+    bool g_Immutable = false;
+    const std::size_t MaximumImmutableCacheEntries = 65536;
+    const std::size_t CachedFileBlockSize =
+        Mile::Cirno::PersistentCacheBlockSize;
+    const std::size_t MaximumImmutableFileBlocksSize = 256 * 1024 * 1024;
+    std::mutex g_ImmutableCachesMutex;
+    // The nonexistent relative paths are cached as std::nullopt.
+    std::unordered_map<std::wstring, std::optional<Mile::Cirno::Qid>>
+        g_ImmutableUniqueIds;
+    // Keyed by the qid path.
+    std::unordered_map<std::uint64_t, Mile::Cirno::GetAttributesResponse>
+        g_ImmutableAttributes;
+    // Keyed by the qid path of the directory.
+    std::unordered_map<
+        std::uint64_t,
+        std::shared_ptr<std::vector<WIN32_FIND_DATAW> const>>
+        g_ImmutableDirectories;
+    // Keyed by the qid path and the index of the block.
+    std::map<std::pair<std::uint64_t, std::uint64_t>, std::vector<std::uint8_t>>
+        g_ImmutableFileBlocks;
+    std::size_t g_ImmutableFileBlocksSize = 0;
+
+    // The files not larger than the threshold are read together with Tlopen
+    // when opened for reading.
+    const std::uint32_t SmallFileThreshold = 16 * 1024;
+
+    // The persistent content cache, which stores the file blocks in the cache
+    // directory across mounts and is validated by the qid and the attributes
+    // of the file. The live segments are shared by the handles of the same
+    // file and keyed by the qid path.
+    std::filesystem::path g_CacheDirectory;
+    const std::size_t MaximumPersistentCacheSegments = 1024;
+    std::mutex g_PersistentCacheSegmentsMutex;
+    std::unordered_map<
+        std::uint64_t,
+        std::weak_ptr<Mile::Cirno::PersistentCacheSegment>>
+        g_PersistentCacheSegments;
+
+    // The segment files in the cache directory, which are evicted in the
+    // least recently used order when the total size exceeds the limit. The
+    // files of the live segments cannot be deleted and are skipped. They are
+    // protected by g_PersistentCacheSegmentsMutex.
+    struct PersistentCacheFile
+    {
+        std::uint64_t Size = 0;
+        std::uint64_t LastUsed = 0;
+    };
+    const std::uint64_t DefaultPersistentCacheSize = 4096ull << 20;
+    std::uint64_t g_PersistentCacheSize = DefaultPersistentCacheSize;
+    std::map<std::wstring, PersistentCacheFile> g_PersistentCacheFiles;
+    std::uint64_t g_PersistentCacheUsage = 0;
+    std::uint64_t g_PersistentCacheSequence = 0;
+
+    // The attribute cache for the shares which accept slightly stale
+    // metadata, which is keyed by the qid path. The expired entries are still
+    // served for one more timeout while a single background Tgetattr, queued
+    // by the first caller which finds the entry expired, refreshes them.
+    struct CachedAttributes
+    {
+        Mile::Cirno::GetAttributesResponse Response = {};
+        std::chrono::steady_clock::time_point UpdateTime;
+        std::wstring RelativeFilePath;
+        bool Refreshing = false;
+        // The attributes are valid regardless of the age before the read
+        // lease expires.
+        std::chrono::steady_clock::time_point LeaseExpireTime;
+    };
+    std::chrono::milliseconds g_AttributeTimeout(0);
+    const std::size_t MaximumCachedAttributes = 65536;
+    std::mutex g_CachedAttributesMutex;
+    std::unordered_map<std::uint64_t, CachedAttributes> g_CachedAttributes;
+    std::condition_variable g_AttributeRefreshCondition;
+    std::deque<std::uint64_t> g_AttributeRefreshQueue;
+    bool g_AttributeRefreshStopping = false;
+
+    // The read leases on the cached attributes, which are owned by the random
+    // key and reported broken over the dedicated notification connection.
+    std::atomic<bool> g_LeaseSupported = false;
+    std::uint64_t g_LeaseKey = 0;
+    Mile::Cirno::Client* g_NotificationInstance = nullptr;
+
+    // The prefetch manifest, which records the blocks read in the specific
+    // duration after mounting and is saved in the cache directory. The
+    // manifest is replayed in the background on the next mount for warming
+    // up the caches before the files are needed.
+    const std::chrono::seconds PrefetchRecordingDuration(120);
+    const std::size_t MaximumPrefetchRecordedBlocks = 65536;
+    const std::size_t PrefetchWorkerCount = 4;
+    std::atomic<bool> g_PrefetchRecording = false;
+    std::atomic<bool> g_PrefetchStopping = false;
+    std::mutex g_PrefetchMutex;
+    std::condition_variable g_PrefetchCondition;
+    using PrefetchBlock = std::pair<std::wstring, std::uint64_t>;
+    std::set<PrefetchBlock> g_PrefetchRecordedBlockSet;
+    // In the order of the first access.
+    std::vector<PrefetchBlock> g_PrefetchRecordedBlocks;
+
+    // The PE images whose sections are prefetched, which are keyed by the qid
+    // path, and the image prefetch jobs, which are run in order by a single
+    // worker owned by the mount. They are protected by g_PrefetchMutex.
+    struct ImagePrefetchJob
+    {
+        FileContext Context;
+        std::shared_ptr<Mile::Cirno::PersistentCacheSegment> Segment;
+        std::set<std::uint64_t> Blocks;
+    };
+    const std::size_t MaximumPrefetchedImages = 4096;
+    const std::size_t MaximumQueuedImagePrefetches = 64;
+    const std::size_t ImagePrefetchBatchSize = 32;
+    std::set<std::uint64_t> g_PrefetchedImages;
+    std::deque<ImagePrefetchJob*> g_ImagePrefetchJobs;
+
+    struct PrefetchFileEntry
+    {
+        std::wstring RelativeFilePath;
+        // The offset and the length of each range.
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> Ranges;
+    };
+}
+
+FileContext* GetFileContext(
+    PDOKAN_FILE_INFO DokanFileInfo)
+{
+    return reinterpret_cast<FileContext*>(DokanFileInfo->Context);
 }
 
 std::uint32_t SimpleClunk(
@@ -202,6 +524,7 @@ std::uint32_t SimpleClunk(
 
 std::uint32_t SimpleAttach(
     std::uint32_t& OutputFileId,
+    Mile::Cirno::Qid& OutputUniqueId,
     std::uint32_t const& AuthenticationFileId,
     std::string const& UserName,
     std::string const& AccessName,
@@ -219,6 +542,7 @@ std::uint32_t SimpleAttach(
     if (0 == ErrorCode)
     {
         OutputFileId = Request.FileId;
+        OutputUniqueId = Response.UniqueId;
     }
     else
     {
@@ -230,402 +554,4476 @@ std::uint32_t SimpleAttach(
     return ErrorCode;
 }
 
-std::uint32_t SimpleWalk(
-    std::uint32_t& OutputFileId,
-    std::uint32_t const& RootDirectoryFileId,
-    std::filesystem::path const& RelativeFilePath)
+// Probe the capabilities of the server with the root directory, so the
+// operations can be routed to the cheapest supported path. All probes are
+// harmless to the share, and the default assumptions of the plain 9P2000.L
+// server are kept if any probe fails unexpectedly. The 9P2000.W messages are
+// only probed if the 9P2000.W session is negotiated.
+void ProbeServerCapabilities()
 {
-    OutputFileId = MILE_CIRNO_NOFID;
-    std::uint32_t ErrorCode = 0;
-    Mile::Cirno::WalkRequest WalkRequest = {};
-    WalkRequest.FileId = RootDirectoryFileId;
-    WalkRequest.NewFileId = g_Instance->AllocateFileId();
-    try
+    // The effective walk limit, which is probed by walking ".." from the
+    // root directory because it stays at the root directory.
+    for (std::size_t Count = MILE_CIRNO_MAXWELEM; Count; Count /= 2)
     {
-        for (std::filesystem::path const& Element : RelativeFilePath)
+        Mile::Cirno::WalkRequest Request = {};
+        Request.FileId = g_RootDirectoryFileId;
+        Request.NewFileId = g_Instance->AllocateFileId();
+        Request.Names.assign(Count, "..");
+        Mile::Cirno::WalkResponse Response = {};
+        std::uint32_t ErrorCode = g_Instance->Walk(Request, Response);
+        if (0 == ErrorCode && Count == Response.UniqueIds.size())
         {
-            WalkRequest.Names.push_back(Mile::ToString(
-                CP_UTF8,
-                Element.wstring()));
+            ::SimpleClunk(Request.NewFileId);
+            g_MaximumWalkElements = Count;
+            break;
         }
-    }
-    catch (...)
-    {
-        ErrorCode = APTX_EINVAL;
-    }
-    if (0 == ErrorCode)
-    {
-        Mile::Cirno::WalkResponse WalkResponse = {};
-        ErrorCode = g_Instance->Walk(WalkRequest, WalkResponse);
+        // Only unregister the file ID because the file ID is not used by the
+        // server if failed to walk.
+        g_Instance->FreeFileId(Request.NewFileId);
     }
 
-    if (0 == ErrorCode)
     {
-        OutputFileId = WalkRequest.NewFileId;
+        Mile::Cirno::GetAttributesRequest Request = {};
+        Request.FileId = g_RootDirectoryFileId;
+        Request.RequestMask = MileCirnoLinuxGetAttributesFlagGroupId;
+        Mile::Cirno::GetAttributesResponse Response = {};
+        if (0 == g_Instance->GetAttributes(Request, Response))
+        {
+            g_RootDirectoryGroupId = Response.GroupId;
+        }
     }
-    else
+
+    // Checking the write access of the root directory with the 9P2000.W
+    // Taccess is refused with EROFS on the read-only share, which modifies
+    // nothing. The share is assumed writable if Taccess is not supported,
+    // and the modifications fail with EROFS one by one in that case.
+    if (g_WindowsProtocolSupported)
     {
-        // Only unregister the file ID because the file ID is not used by the
-        // server if failed to walk.
-        g_Instance->FreeFileId(WalkRequest.NewFileId);
+        Mile::Cirno::AccessRequest Request = {};
+        Request.FileId = g_RootDirectoryFileId;
+        Request.Flags = MileCirnoWindowsAccessFlagWrite;
+        g_ReadOnlyShare = APTX_EROFS == g_Instance->Access(Request);
     }
-    return ErrorCode;
-}
 
-std::uint32_t SimpleMakeDirectory(
-    std::uint32_t const& RootDirectoryFileId,
-    std::filesystem::path const& RelativeFilePath)
-{
-    std::uint32_t ErrorCode = 0;
-
-    std::uint32_t RelativeRootDirectoryFileId = MILE_CIRNO_NOFID;
-    ErrorCode = ::SimpleWalk(
-        RelativeRootDirectoryFileId,
-        RootDirectoryFileId,
-        RelativeFilePath.parent_path());
-    if (0 == ErrorCode)
+    std::uint32_t IoUnit = 0;
+    std::uint32_t FileId = MILE_CIRNO_NOFID;
+    if (g_WindowsProtocolSupported)
     {
-        std::uint32_t RootDirectoryGroupId = 0;
+        FileId = g_Instance->AllocateFileId();
+        Mile::Cirno::WindowsOpenRequest Request = {};
+        Request.FileId = g_RootDirectoryFileId;
+        Request.NewFileId = FileId;
+        Request.Flags =
+            MileCirnoLinuxOpenCreateFlagReadOnly |
+            MileCirnoLinuxOpenCreateFlagDirectory |
+            MileCirnoLinuxOpenCreateFlagLargeFile |
+            MileCirnoLinuxOpenCreateFlagCloseOnExecute;
+        Request.WindowsFlags = MileCirnoWindowsOpenFlagNone;
+        Mile::Cirno::WindowsOpenResponse Response = {};
+        if (0 == g_Instance->WindowsOpen(Request, Response))
         {
-            Mile::Cirno::GetAttributesRequest Request = {};
-            Request.FileId = RelativeRootDirectoryFileId;
-            Request.RequestMask =
-                MileCirnoLinuxGetAttributesFlagGroupId;
-            Mile::Cirno::GetAttributesResponse Response = {};
-            ErrorCode = g_Instance->GetAttributes(Request, Response);
-            if (0 == ErrorCode)
+            if (MileCirnoWindowsOpenStatusOpened == Response.Status)
             {
-                RootDirectoryGroupId = Response.GroupId;
+                g_WindowsOpenSupported = true;
+                IoUnit = Response.IoUnit;
+            }
+            else
+            {
+                // Only unregister the file ID because the file ID is not
+                // used by the server if failed to open.
+                g_Instance->FreeFileId(FileId);
+                FileId = MILE_CIRNO_NOFID;
             }
         }
-        if (0 == ErrorCode)
+        else
         {
-            Mile::Cirno::MakeDirectoryRequest Request = {};
-            Request.DirectoryFileId = RelativeRootDirectoryFileId;
-            Request.Name = Mile::ToString(
-                CP_UTF8,
-                RelativeFilePath.filename().wstring());
-            Request.Mode = APTX_IRWXU;
-            Request.Mode |= APTX_IRGRP | APTX_IXGRP;
-            Request.Mode |= APTX_IROTH | APTX_IXOTH;
-            Request.GroupId = RootDirectoryGroupId;
-            Mile::Cirno::MakeDirectoryResponse Response = {};
-            ErrorCode = g_Instance->MakeDirectory(Request, Response);
+            g_Instance->FreeFileId(FileId);
+            FileId = MILE_CIRNO_NOFID;
         }
-
-        ::SimpleClunk(RelativeRootDirectoryFileId);
     }
-
-    return ErrorCode;
-}
-
-std::uint32_t SimpleLinuxCreate(
-    std::uint32_t const& RootDirectoryFileId,
-    std::filesystem::path const& RelativeFilePath,
-    std::uint32_t Flags,
-    std::uint32_t Mode)
-{
-    std::uint32_t ErrorCode = 0;
-
-    std::uint32_t RelativeRootDirectoryFileId = MILE_CIRNO_NOFID;
-    ErrorCode = ::SimpleWalk(
-        RelativeRootDirectoryFileId,
-        RootDirectoryFileId,
-        RelativeFilePath.parent_path());
-    if (0 == ErrorCode)
+    if (!g_WindowsOpenSupported)
     {
-        std::uint32_t RootDirectoryGroupId = 0;
+        std::uint32_t ErrorCode = 0;
+        FileId = g_Instance->AllocateFileId();
         {
-            Mile::Cirno::GetAttributesRequest Request = {};
-            Request.FileId = RelativeRootDirectoryFileId;
-            Request.RequestMask =
-                MileCirnoLinuxGetAttributesFlagGroupId;
-            Mile::Cirno::GetAttributesResponse Response = {};
-            ErrorCode = g_Instance->GetAttributes(Request, Response);
-            if (0 == ErrorCode)
-            {
-                RootDirectoryGroupId = Response.GroupId;
-            }
+            Mile::Cirno::WalkRequest Request = {};
+            Request.FileId = g_RootDirectoryFileId;
+            Request.NewFileId = FileId;
+            Mile::Cirno::WalkResponse Response = {};
+            ErrorCode = g_Instance->Walk(Request, Response);
         }
-        if (0 == ErrorCode)
+        if (0 != ErrorCode)
         {
-            Mile::Cirno::LinuxCreateRequest Request = {};
-            Request.FileId = RelativeRootDirectoryFileId;
-            Request.Name = Mile::ToString(
-                CP_UTF8,
-                RelativeFilePath.filename().wstring());
-            Request.Flags = Flags;
-            Request.Mode = Mode;
-            Request.GroupId = RootDirectoryGroupId;
-            Mile::Cirno::LinuxCreateResponse Response = {};
-            ErrorCode = g_Instance->LinuxCreate(Request, Response);
+            g_Instance->FreeFileId(FileId);
+            return;
+        }
+        {
+            Mile::Cirno::LinuxOpenRequest Request = {};
+            Request.FileId = FileId;
+            Request.Flags =
+                MileCirnoLinuxOpenCreateFlagReadOnly |
+                MileCirnoLinuxOpenCreateFlagDirectory |
+                MileCirnoLinuxOpenCreateFlagLargeFile |
+                MileCirnoLinuxOpenCreateFlagCloseOnExecute;
+            Mile::Cirno::LinuxOpenResponse Response = {};
+            ErrorCode = g_Instance->LinuxOpen(Request, Response);
+            IoUnit = Response.IoUnit;
+        }
+        if (0 != ErrorCode)
+        {
+            ::SimpleClunk(FileId);
+            return;
         }
-
-        ::SimpleClunk(RelativeRootDirectoryFileId);
     }
-
-    return ErrorCode;
-}
-
-#define MILE_CIRNO_ACCESS_READ ( \
-    GENERIC_READ | \
-    FILE_GENERIC_READ)
-#define MILE_CIRNO_ACCESS_WRITE ( \
-    GENERIC_WRITE | \
-    FILE_GENERIC_WRITE | \
-    DELETE | \
-    WRITE_DAC | \
-    WRITE_OWNER)
-#define MILE_CIRNO_ACCESS_EXECUTE ( \
-    GENERIC_EXECUTE | \
-    FILE_GENERIC_EXECUTE)
-
-NTSTATUS DOKAN_CALLBACK MileCirnoZwCreateFile(
-    _In_ LPCWSTR FileName,
-    _In_ PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
-    _In_ ACCESS_MASK DesiredAccess,
-    _In_ ULONG FileAttributes,
-    _In_ ULONG ShareAccess,
-    _In_ ULONG CreateDisposition,
-    _In_ ULONG CreateOptions,
-    _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
-{
-    UNREFERENCED_PARAMETER(SecurityContext);
-    UNREFERENCED_PARAMETER(FileAttributes);
-    UNREFERENCED_PARAMETER(ShareAccess);
-
-    DokanFileInfo->Context = MILE_CIRNO_NOFID;
-
-    if (0 == ::_wcsicmp(FileName, L"\\System Volume Information") ||
-        0 == ::_wcsicmp(FileName, L"\\$RECYCLE.BIN"))
+    if (g_WindowsProtocolSupported)
     {
-        return STATUS_NO_SUCH_FILE;
+        Mile::Cirno::WindowsReadDirectoryRequest Request = {};
+        Request.FileId = FileId;
+        Request.Offset = 0;
+        Request.Count = 1024;
+        Mile::Cirno::WindowsReadDirectoryResponse Response;
+        g_WindowsReadDirectorySupported = 0 == g_Instance->WindowsReadDirectory(
+            Request,
+            Response);
     }
+    ::SimpleClunk(FileId);
 
-    std::uint32_t ErrorCode = 0;
-
-    std::filesystem::path RelativeFilePath(&FileName[1]);
-
-    if (FILE_DIRECTORY_FILE == (FILE_DIRECTORY_FILE & CreateOptions))
+    // The effective message size, because the server may report the smaller
+    // I/O unit than the negotiated message size. The smallest header size is
+    // used, so no payload exceeds the I/O unit.
+    if (IoUnit &&
+        IoUnit < g_MaximumMessageSize - Mile::Cirno::ReadResponseHeaderSize)
     {
-        if (FILE_CREATE == CreateDisposition ||
-            FILE_OPEN_IF == CreateDisposition)
-        {
-            ErrorCode = ::SimpleMakeDirectory(
-                g_RootDirectoryFileId,
-                RelativeFilePath);
-            if (0 != ErrorCode)
-            {
-                return ::ToNtStatus(ErrorCode);
-            }
-            CreateDisposition = FILE_OPEN;
-        }
+        g_MaximumMessageSize = IoUnit + Mile::Cirno::ReadResponseHeaderSize;
     }
+}
 
-    std::uint32_t ConvertedFileMode = 0;
-    std::uint32_t ConvertedFlags =
-        MileCirnoLinuxOpenCreateFlagLargeFile |
-        MileCirnoLinuxOpenCreateFlagCloseOnExecute;
-
-    bool Readable = false;
-    bool Writable = false;
-    if (GENERIC_ALL == DesiredAccess)
-    {
-        DesiredAccess = FILE_ALL_ACCESS;
-    }
-    if (MILE_CIRNO_ACCESS_READ & DesiredAccess)
+Mile::Cirno::Client* ConnectToServer(
+    std::string const& Host,
+    std::string const& Port)
+{
+    if (0 == ::_stricmp(Host.c_str(), "HvSocket"))
     {
-        Readable = true;
-        ConvertedFileMode |= APTX_IRUSR | APTX_IRGRP | APTX_IROTH;
+        return Mile::Cirno::Client::ConnectWithHyperVSocket(
+            Mile::ToUInt32(Port));
     }
-    if (MILE_CIRNO_ACCESS_WRITE & DesiredAccess)
+    return Mile::Cirno::Client::ConnectWithTcpSocket(Host, Port);
+}
+
+// Open the dedicated connection for Tnotify, which only negotiates the
+// version because Tnotify needs no file ID, and probe Tlease with the root
+// directory. The leases are not used if anything fails.
+void ConnectLeaseNotification(
+    std::string const& Host,
+    std::string const& Port)
+{
+    try
     {
-        Writable = true;
-        ConvertedFileMode |= APTX_IWUSR | APTX_IWGRP | APTX_IWOTH;
+        g_NotificationInstance = ::ConnectToServer(Host, Port);
     }
-    if (MILE_CIRNO_ACCESS_EXECUTE & DesiredAccess)
+    catch (...)
     {
-        ConvertedFileMode |= APTX_IXUSR | APTX_IXGRP | APTX_IXOTH;
+        g_NotificationInstance = nullptr;
     }
-    if (Readable && !Writable)
+    if (!g_NotificationInstance)
     {
-        ConvertedFlags |= MileCirnoLinuxOpenCreateFlagReadOnly;
+        return;
     }
-    else if (!Readable && Writable)
+
+    std::uint32_t ErrorCode = 0;
     {
-        ConvertedFlags |= MileCirnoLinuxOpenCreateFlagWriteOnly;
+        Mile::Cirno::VersionRequest Request;
+        Request.MaximumMessageSize = g_MaximumMessageSize;
+        Request.ProtocolVersion = Mile::Cirno::ExtendedProtocolVersion;
+        Mile::Cirno::VersionResponse Response = {};
+        ErrorCode = g_NotificationInstance->Version(Request, Response);
+        if (0 == ErrorCode &&
+            Mile::Cirno::ExtendedProtocolVersion != Response.ProtocolVersion)
+        {
+            ErrorCode = APTX_LINUX_EPROTO;
+        }
     }
-    else if (Readable && Writable)
+    if (0 == ErrorCode)
     {
-        ConvertedFlags |= MileCirnoLinuxOpenCreateFlagReadWrite;
+        std::random_device Device;
+        g_LeaseKey = (static_cast<std::uint64_t>(Device()) << 32) | Device();
+
+        Mile::Cirno::LeaseRequest Request = {};
+        Request.FileId = g_RootDirectoryFileId;
+        Request.Key = g_LeaseKey;
+        Mile::Cirno::LeaseResponse Response = {};
+        ErrorCode = g_Instance->Lease(Request, Response);
     }
-    if (!(FILE_SYNCHRONOUS_IO_ALERT & CreateOptions) &&
-        !(FILE_SYNCHRONOUS_IO_NONALERT & CreateOptions))
+    if (0 != ErrorCode)
     {
-        ConvertedFlags |= MileCirnoLinuxOpenCreateFlagNonBlock;
+        delete g_NotificationInstance;
+        g_NotificationInstance = nullptr;
+        return;
     }
-    if (FILE_NO_INTERMEDIATE_BUFFERING & CreateOptions)
+
+    g_LeaseSupported = true;
+}
+
+namespace
+{
+    // The interned path component, which keeps the UTF-16 name used by Windows
+    // and the encoded name used by the 9p wire format (the 16-bit length
+    // prefix with the raw name) together. The UTF-16 name is converted from
+    // the raw name losslessly by DecodeRawName, so it can be used as the key.
+    // The interned names are never freed, so they can be referenced without
+    // holding the lock.
+    struct InternedName
     {
-        ConvertedFlags |= MileCirnoLinuxOpenCreateFlagDirect;
-    }
+        std::wstring Name;
+        std::vector<std::uint8_t> EncodedName;
+    };
 
-    NTSTATUS Status = STATUS_SUCCESS;
+    const std::size_t MaximumInternedNames = 65536;
+    std::shared_mutex g_InternedNamesMutex;
+    std::deque<InternedName> g_InternedNames;
+    std::unordered_map<std::wstring_view, InternedName const*>
+        g_InternedNamesByName;
+    std::unordered_map<std::string_view, InternedName const*>
+        g_InternedNamesByUtf8Name;
+}
 
-    std::uint32_t FileId = MILE_CIRNO_NOFID;
-    ErrorCode = ::SimpleWalk(
-        FileId,
-        g_RootDirectoryFileId,
-        RelativeFilePath);
-    if (0 != ErrorCode)
+// Decode the raw name as UTF-8 losslessly. Each byte which is not a part of
+// a valid UTF-8 sequence is mapped to the unpaired low surrogate from U+DC80
+// to U+DCFF, which cannot be decoded from valid UTF-8, so the different raw
+// names never share the same UTF-16 name.
+std::wstring DecodeRawName(
+    std::string_view RawName)
+{
+    std::wstring Result;
+    Result.reserve(RawName.size());
+
+    std::size_t Current = 0;
+    while (Current < RawName.size())
+    {
+        std::uint8_t Lead = static_cast<std::uint8_t>(RawName[Current]);
+        std::uint32_t CodePoint = 0;
+        std::uint32_t Minimum = 0;
+        std::size_t Length = 0;
+        if (Lead < 0x80)
+        {
+            CodePoint = Lead;
+            Length = 1;
+        }
+        else if (0xC0 == (Lead & 0xE0))
+        {
+            CodePoint = Lead & 0x1F;
+            Minimum = 0x80;
+            Length = 2;
+        }
+        else if (0xE0 == (Lead & 0xF0))
+        {
+            CodePoint = Lead & 0x0F;
+            Minimum = 0x800;
+            Length = 3;
+        }
+        else if (0xF0 == (Lead & 0xF8))
+        {
+            CodePoint = Lead & 0x07;
+            Minimum = 0x10000;
+            Length = 4;
+        }
+
+        bool Valid = Length && Current + Length <= RawName.size();
+        for (std::size_t i = 1; Valid && i < Length; ++i)
+        {
+            std::uint8_t Trail =
+                static_cast<std::uint8_t>(RawName[Current + i]);
+            Valid = 0x80 == (Trail & 0xC0);
+            CodePoint = (CodePoint << 6) | (Trail & 0x3F);
+        }
+        if (Valid &&
+            (CodePoint < Minimum ||
+            CodePoint > 0x10FFFF ||
+            (CodePoint >= 0xD800 && CodePoint <= 0xDFFF)))
+        {
+            Valid = false;
+        }
+        if (!Valid)
+        {
+            Result.push_back(static_cast<wchar_t>(0xDC00 | Lead));
+            ++Current;
+            continue;
+        }
+
+        if (CodePoint >= 0x10000)
+        {
+            CodePoint -= 0x10000;
+            Result.push_back(
+                static_cast<wchar_t>(0xD800 | (CodePoint >> 10)));
+            Result.push_back(
+                static_cast<wchar_t>(0xDC00 | (CodePoint & 0x3FF)));
+        }
+        else
+        {
+            Result.push_back(static_cast<wchar_t>(CodePoint));
+        }
+        Current += Length;
+    }
+
+    return Result;
+}
+
+// The inverse of DecodeRawName. The unpaired surrogates which are not made
+// by DecodeRawName are encoded as U+FFFD.
+std::string EncodeRawName(
+    std::wstring_view Name)
+{
+    std::string Result;
+    Result.reserve(Name.size());
+
+    for (std::size_t i = 0; i < Name.size(); ++i)
+    {
+        std::uint32_t CodePoint = static_cast<std::uint16_t>(Name[i]);
+        if (CodePoint >= 0xD800 && CodePoint <= 0xDBFF &&
+            i + 1 < Name.size() &&
+            Name[i + 1] >= 0xDC00 && Name[i + 1] <= 0xDFFF)
+        {
+            CodePoint = 0x10000 + ((CodePoint - 0xD800) << 10);
+            CodePoint += static_cast<std::uint16_t>(Name[++i]) - 0xDC00;
+        }
+        else if (CodePoint >= 0xDC80 && CodePoint <= 0xDCFF)
+        {
+            Result.push_back(static_cast<char>(CodePoint & 0xFF));
+            continue;
+        }
+        else if (CodePoint >= 0xD800 && CodePoint <= 0xDFFF)
+        {
+            CodePoint = 0xFFFD;
+        }
+
+        if (CodePoint < 0x80)
+        {
+            Result.push_back(static_cast<char>(CodePoint));
+        }
+        else if (CodePoint < 0x800)
+        {
+            Result.push_back(static_cast<char>(0xC0 | (CodePoint >> 6)));
+            Result.push_back(static_cast<char>(0x80 | (CodePoint & 0x3F)));
+        }
+        else if (CodePoint < 0x10000)
+        {
+            Result.push_back(static_cast<char>(0xE0 | (CodePoint >> 12)));
+            Result.push_back(
+                static_cast<char>(0x80 | ((CodePoint >> 6) & 0x3F)));
+            Result.push_back(static_cast<char>(0x80 | (CodePoint & 0x3F)));
+        }
+        else
+        {
+            Result.push_back(static_cast<char>(0xF0 | (CodePoint >> 18)));
+            Result.push_back(
+                static_cast<char>(0x80 | ((CodePoint >> 12) & 0x3F)));
+            Result.push_back(
+                static_cast<char>(0x80 | ((CodePoint >> 6) & 0x3F)));
+            Result.push_back(static_cast<char>(0x80 | (CodePoint & 0x3F)));
+        }
+    }
+
+    return Result;
+}
+
+bool MakeInternedName(
+    InternedName& Result,
+    std::wstring_view Name,
+    std::string_view Utf8Name)
+{
+    if (Utf8Name.size() > UINT16_MAX)
+    {
+        return false;
+    }
+    Result.Name = Name;
+    Result.EncodedName.clear();
+    Result.EncodedName.reserve(sizeof(std::uint16_t) + Utf8Name.size());
+    Mile::Cirno::PushUInt16(
+        Result.EncodedName,
+        static_cast<std::uint16_t>(Utf8Name.size()));
+    Result.EncodedName.insert(
+        Result.EncodedName.end(),
+        Utf8Name.begin(),
+        Utf8Name.end());
+    return true;
+}
+
+bool MakeInternedName(
+    InternedName& Result,
+    std::wstring_view Name)
+{
+    try
+    {
+        return ::MakeInternedName(
+            Result,
+            Name,
+            ::EncodeRawName(Name));
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+bool MakeInternedName(
+    InternedName& Result,
+    std::string_view Utf8Name)
+{
+    try
+    {
+        return ::MakeInternedName(
+            Result,
+            ::DecodeRawName(Utf8Name),
+            Utf8Name);
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+std::string_view GetInternedUtf8Name(
+    InternedName const& Value)
+{
+    return std::string_view(
+        reinterpret_cast<char const*>(Value.EncodedName.data()) +
+        sizeof(std::uint16_t),
+        Value.EncodedName.size() - sizeof(std::uint16_t));
+}
+
+InternedName const* InsertInternedName(
+    InternedName&& Candidate)
+{
+    std::unique_lock<std::shared_mutex> Guard(g_InternedNamesMutex);
+
+    auto Iterator = g_InternedNamesByName.find(Candidate.Name);
+    if (g_InternedNamesByName.end() != Iterator)
+    {
+        return Iterator->second;
+    }
+    if (g_InternedNames.size() >= MaximumInternedNames)
+    {
+        return nullptr;
+    }
+
+    InternedName const& Result =
+        g_InternedNames.emplace_back(std::move(Candidate));
+    g_InternedNamesByName.emplace(Result.Name, &Result);
+    g_InternedNamesByUtf8Name.emplace(::GetInternedUtf8Name(Result), &Result);
+    return &Result;
+}
+
+// Returns nullptr if the name cannot be converted or the table is full, the
+// caller should fall back to MakeInternedName with its own storage.
+InternedName const* InternName(
+    std::wstring_view Name)
+{
+    {
+        std::shared_lock<std::shared_mutex> Guard(g_InternedNamesMutex);
+        auto Iterator = g_InternedNamesByName.find(Name);
+        if (g_InternedNamesByName.end() != Iterator)
+        {
+            return Iterator->second;
+        }
+    }
+
+    InternedName Candidate;
+    if (!::MakeInternedName(Candidate, Name))
+    {
+        return nullptr;
+    }
+    return ::InsertInternedName(std::move(Candidate));
+}
+
+InternedName const* InternName(
+    std::string_view Utf8Name)
+{
+    {
+        std::shared_lock<std::shared_mutex> Guard(g_InternedNamesMutex);
+        auto Iterator = g_InternedNamesByUtf8Name.find(Utf8Name);
+        if (g_InternedNamesByUtf8Name.end() != Iterator)
+        {
+            return Iterator->second;
+        }
+    }
+
+    InternedName Candidate;
+    if (!::MakeInternedName(Candidate, Utf8Name))
+    {
+        return nullptr;
+    }
+    return ::InsertInternedName(std::move(Candidate));
+}
+
+// Get the raw name sent to the server for the name from Windows, which is
+// the same one used by the walks.
+std::string ToRawName(
+    std::wstring_view Name)
+{
+    InternedName const* Interned = ::InternName(Name);
+    if (Interned)
+    {
+        return std::string(::GetInternedUtf8Name(*Interned));
+    }
+    return ::EncodeRawName(Name);
+}
+
+void SimplePipelinedClunk(
+    std::vector<std::uint32_t> const& FileIds)
+{
+    if (FileIds.empty())
+    {
+        return;
+    }
+
+    std::vector<Mile::Cirno::PipelinedRequest> Requests(FileIds.size());
+    for (std::size_t i = 0; i < FileIds.size(); ++i)
+    {
+        Mile::Cirno::ClunkRequest Request = {};
+        Request.FileId = FileIds[i];
+        Requests[i].RequestType = MileCirnoClunkRequestMessage;
+        Requests[i].ResponseType = MileCirnoClunkResponseMessage;
+        Mile::Cirno::PushClunkRequest(Requests[i].RequestContent, Request);
+    }
+    g_Instance->PipelinedRequestResponse(Requests);
+    for (std::size_t i = 0; i < FileIds.size(); ++i)
+    {
+        if (0 == Requests[i].ErrorCode)
+        {
+            g_Instance->FreeFileId(FileIds[i]);
+        }
+    }
+}
+
+namespace
+{
+    // The file IDs of the intermediate directories at the segment boundaries
+    // of the segmented walks from the root directory, keyed by the relative
+    // path of the directory. They are reused as the starting point of later
+    // walks into the same deep directories. The parent directories of the
+    // created files are also cached here for the later queries of their
+    // groups. The entries expire after g_AttributeTimeout, or
+    // DefaultCachedWalkFileIdTimeout if it is zero, because the directories
+    // may be renamed by others, and they never expire for the immutable
+    // shares. The least recently used entries are evicted and clunked if
+    // the cache is full.
+    struct CachedWalkFileId
+    {
+        std::uint32_t FileId = MILE_CIRNO_NOFID;
+        std::size_t ReferenceCount = 0;
+        bool Invalidated = false;
+        std::chrono::steady_clock::time_point CreationTime;
+        std::uint64_t LastUsed = 0;
+    };
+
+    const std::size_t MaximumCachedWalkFileIds = 256;
+    const std::chrono::milliseconds DefaultCachedWalkFileIdTimeout(1000);
+
+    // The maximum number of the directory entries whose attributes are
+    // queried in a single pipelined batch when enumerating directories.
+    const std::size_t FindFilesBatchSize = 128;
+    std::mutex g_CachedWalkFileIdsMutex;
+    std::map<std::wstring, CachedWalkFileId> g_CachedWalkFileIds;
+    std::uint64_t g_CachedWalkFileIdSequence = 0;
+}
+
+std::wstring MakeWalkPathKey(
+    std::vector<InternedName const*> const& Names,
+    std::size_t const& Count)
+{
+    std::wstring Result;
+    for (std::size_t i = 0; i < Count; ++i)
+    {
+        if (i)
+        {
+            Result.push_back(L'\\');
+        }
+        Result.append(Names[i]->Name);
+    }
+    return Result;
+}
+
+bool IsCachedWalkFileIdExpired(
+    CachedWalkFileId const& Value)
+{
+    if (g_Immutable)
+    {
+        return false;
+    }
+    std::chrono::milliseconds Timeout = g_AttributeTimeout.count()
+        ? g_AttributeTimeout
+        : DefaultCachedWalkFileIdTimeout;
+    return std::chrono::steady_clock::now() - Value.CreationTime >= Timeout;
+}
+
+// The caller should hold g_CachedWalkFileIdsMutex. The expired entry is
+// invalidated, so it is clunked after the last reference is released.
+bool UseCachedWalkFileId(
+    CachedWalkFileId& Value)
+{
+    if (Value.Invalidated)
+    {
+        return false;
+    }
+    if (::IsCachedWalkFileIdExpired(Value))
+    {
+        Value.Invalidated = true;
+        return false;
+    }
+    Value.LastUsed = ++g_CachedWalkFileIdSequence;
+    return true;
+}
+
+// The caller should hold g_CachedWalkFileIdsMutex, and should clunk the
+// returned file IDs after releasing it. Drop the unreferenced entries which
+// are invalidated or expired, and then the least recently used unreferenced
+// entries until there is room for a new entry.
+std::vector<std::uint32_t> EvictCachedWalkFileIds()
+{
+    std::vector<std::uint32_t> Result;
+
+    std::vector<std::map<std::wstring, CachedWalkFileId>::iterator>
+        Candidates;
+    for (auto Iterator = g_CachedWalkFileIds.begin();
+        g_CachedWalkFileIds.end() != Iterator;)
+    {
+        CachedWalkFileId& Value = Iterator->second;
+        if (Value.ReferenceCount)
+        {
+            ++Iterator;
+        }
+        else if (Value.Invalidated || ::IsCachedWalkFileIdExpired(Value))
+        {
+            Result.push_back(Value.FileId);
+            Iterator = g_CachedWalkFileIds.erase(Iterator);
+        }
+        else
+        {
+            Candidates.push_back(Iterator++);
+        }
+    }
+    if (g_CachedWalkFileIds.size() < MaximumCachedWalkFileIds)
+    {
+        return Result;
+    }
+
+    std::sort(
+        Candidates.begin(),
+        Candidates.end(),
+        [](auto const& Left, auto const& Right) -> bool
+    {
+        return Left->second.LastUsed < Right->second.LastUsed;
+    });
+    for (auto const& Candidate : Candidates)
+    {
+        if (g_CachedWalkFileIds.size() < MaximumCachedWalkFileIds)
+        {
+            break;
+        }
+        Result.push_back(Candidate->second.FileId);
+        g_CachedWalkFileIds.erase(Candidate);
+    }
+    return Result;
+}
+
+std::size_t AcquireCachedWalkFileId(
+    std::vector<InternedName const*> const& Names,
+    std::uint32_t& FileId,
+    std::wstring& Key)
+{
+    // Try the deepest segment boundary first, and the last name should be
+    // always walked.
+    std::vector<std::pair<std::size_t, std::wstring>> Candidates;
+    for (std::size_t Count =
+        ((Names.size() - 1) / g_MaximumWalkElements) * g_MaximumWalkElements;
+        Count;
+        Count -= g_MaximumWalkElements)
+    {
+        Candidates.emplace_back(Count, ::MakeWalkPathKey(Names, Count));
+    }
+
+    std::lock_guard<std::mutex> Guard(g_CachedWalkFileIdsMutex);
+    for (auto& Candidate : Candidates)
+    {
+        auto Iterator = g_CachedWalkFileIds.find(Candidate.second);
+        if (g_CachedWalkFileIds.end() != Iterator &&
+            ::UseCachedWalkFileId(Iterator->second))
+        {
+            ++Iterator->second.ReferenceCount;
+            FileId = Iterator->second.FileId;
+            Key = std::move(Candidate.second);
+            return Candidate.first;
+        }
+    }
+    return 0;
+}
+
+void ReleaseCachedWalkFileId(
+    std::wstring const& Key,
+    bool Invalidate)
+{
+    std::uint32_t UnreferencedFileId = MILE_CIRNO_NOFID;
+    {
+        std::lock_guard<std::mutex> Guard(g_CachedWalkFileIdsMutex);
+        auto Iterator = g_CachedWalkFileIds.find(Key);
+        if (g_CachedWalkFileIds.end() == Iterator)
+        {
+            return;
+        }
+        if (Invalidate)
+        {
+            Iterator->second.Invalidated = true;
+        }
+        if (0 == --Iterator->second.ReferenceCount &&
+            Iterator->second.Invalidated)
+        {
+            UnreferencedFileId = Iterator->second.FileId;
+            g_CachedWalkFileIds.erase(Iterator);
+        }
+    }
+    if (MILE_CIRNO_NOFID != UnreferencedFileId)
+    {
+        ::SimpleClunk(UnreferencedFileId);
+    }
+}
+
+// The inserted entry is referenced by the caller if Referenced is true.
+bool InsertCachedWalkFileId(
+    std::wstring const& Key,
+    std::uint32_t const& FileId,
+    bool Referenced)
+{
+    bool Inserted = false;
+    std::vector<std::uint32_t> EvictedFileIds;
+    {
+        std::lock_guard<std::mutex> Guard(g_CachedWalkFileIdsMutex);
+        EvictedFileIds = ::EvictCachedWalkFileIds();
+        if (g_CachedWalkFileIds.size() < MaximumCachedWalkFileIds)
+        {
+            CachedWalkFileId Value;
+            Value.FileId = FileId;
+            Value.ReferenceCount = Referenced ? 1 : 0;
+            Value.CreationTime = std::chrono::steady_clock::now();
+            Value.LastUsed = ++g_CachedWalkFileIdSequence;
+            Inserted = g_CachedWalkFileIds.try_emplace(Key, Value).second;
+        }
+    }
+    ::SimplePipelinedClunk(EvictedFileIds);
+    return Inserted;
+}
+
+void InvalidateCachedWalkFileIds(
+    std::filesystem::path const& RelativeFilePath)
+{
+    std::wstring Prefix = RelativeFilePath.wstring();
+
+    std::vector<std::uint32_t> UnreferencedFileIds;
+    {
+        std::lock_guard<std::mutex> Guard(g_CachedWalkFileIdsMutex);
+        for (auto Iterator = g_CachedWalkFileIds.begin();
+            g_CachedWalkFileIds.end() != Iterator;)
+        {
+            std::wstring const& Key = Iterator->first;
+            if (0 != Key.compare(0, Prefix.size(), Prefix) ||
+                (Key.size() > Prefix.size() && L'\\' != Key[Prefix.size()]))
+            {
+                ++Iterator;
+                continue;
+            }
+            if (Iterator->second.ReferenceCount)
+            {
+                Iterator->second.Invalidated = true;
+                ++Iterator;
+                continue;
+            }
+            UnreferencedFileIds.push_back(Iterator->second.FileId);
+            Iterator = g_CachedWalkFileIds.erase(Iterator);
+        }
+    }
+    for (std::uint32_t const& FileId : UnreferencedFileIds)
+    {
+        ::SimpleClunk(FileId);
+    }
+}
+
+// Clunk all cached walk file IDs, which is used when unmounting.
+void ClearCachedWalkFileIds()
+{
+    std::vector<std::uint32_t> FileIds;
+    {
+        std::lock_guard<std::mutex> Guard(g_CachedWalkFileIdsMutex);
+        for (auto const& Current : g_CachedWalkFileIds)
+        {
+            FileIds.push_back(Current.second.FileId);
+        }
+        g_CachedWalkFileIds.clear();
+    }
+    ::SimplePipelinedClunk(FileIds);
+}
+
+Mile::Cirno::EncodedWalkRequest MakeEncodedWalkRequest(
+    std::uint32_t const& FileId,
+    std::uint32_t const& NewFileId,
+    std::vector<InternedName const*> const& Names,
+    std::size_t const& Offset,
+    std::size_t const& Count)
+{
+    Mile::Cirno::EncodedWalkRequest Result = {};
+    Result.FileId = FileId;
+    Result.NewFileId = NewFileId;
+    Result.Names.reserve(Count);
+    for (std::size_t i = Offset; i < Offset + Count; ++i)
+    {
+        Result.Names.push_back(&Names[i]->EncodedName);
+    }
+    return Result;
+}
+
+// Walk the names from the specific offset in the segments which contain at
+// most g_MaximumWalkElements names. Each segment is walked from the new file
+// ID of the previous segment, so all segments are sent in a single Tcompound
+// which is executed in order if supported, and one by one otherwise.
+std::uint32_t SimpleSegmentedWalk(
+    std::uint32_t& OutputFileId,
+    Mile::Cirno::Qid& OutputUniqueId,
+    std::uint32_t const& StartFileId,
+    std::vector<InternedName const*> const& Names,
+    std::size_t const& Start,
+    bool Cacheable)
+{
+    OutputFileId = MILE_CIRNO_NOFID;
+
+    std::vector<std::size_t> Offsets;
+    for (std::size_t Offset = Start;
+        Offset < Names.size();
+        Offset += g_MaximumWalkElements)
+    {
+        Offsets.push_back(Offset);
+    }
+    auto GetSegmentSize = [&](
+        std::size_t const& Index) -> std::size_t
+    {
+        return std::min<std::size_t>(
+            g_MaximumWalkElements,
+            Names.size() - Offsets[Index]);
+    };
+
+    std::vector<std::uint32_t> FileIds(Offsets.size());
+    std::vector<Mile::Cirno::PipelinedRequest> Requests(Offsets.size());
+    for (std::size_t i = 0; i < Offsets.size(); ++i)
+    {
+        // The file IDs below MILE_CIRNO_COMPOUND_FID_BASE outlive Tcompound.
+        FileIds[i] = g_Instance->AllocateFileId();
+        Requests[i].RequestType = MileCirnoWalkRequestMessage;
+        Requests[i].ResponseType = MileCirnoWalkResponseMessage;
+        Mile::Cirno::PushEncodedWalkRequest(
+            Requests[i].RequestContent,
+            ::MakeEncodedWalkRequest(
+                i ? FileIds[i - 1] : StartFileId,
+                FileIds[i],
+                Names,
+                Offsets[i],
+                GetSegmentSize(i)));
+    }
+    if (g_CompoundSupported)
+    {
+        std::uint32_t CompoundErrorCode = g_Instance->Compound(Requests);
+        if (0 != CompoundErrorCode)
+        {
+            for (Mile::Cirno::PipelinedRequest& Request : Requests)
+            {
+                Request.ErrorCode = CompoundErrorCode;
+            }
+        }
+    }
+
+    std::uint32_t ErrorCode = 0;
+    std::size_t Established = 0;
+    for (std::size_t i = 0; i < Offsets.size(); ++i)
+    {
+        if (!g_CompoundSupported)
+        {
+            Requests[i].ErrorCode = g_Instance->RequestResponse(
+                Requests[i].RequestType,
+                Requests[i].RequestContent,
+                Requests[i].ResponseType,
+                Requests[i].ResponseContent);
+        }
+        Mile::Cirno::WalkResponse Response = {};
+        std::uint32_t SegmentErrorCode = Requests[i].ErrorCode;
+        if (0 == SegmentErrorCode)
+        {
+            std::span<std::uint8_t> ResponseSpan =
+                std::span<std::uint8_t>(Requests[i].ResponseContent);
+            Response = Mile::Cirno::PopWalkResponse(ResponseSpan);
+        }
+        // The new file ID is not established if the walk is partial.
+        if (0 == SegmentErrorCode &&
+            GetSegmentSize(i) != Response.UniqueIds.size())
+        {
+            SegmentErrorCode = APTX_ENOENT;
+        }
+        if (0 != SegmentErrorCode)
+        {
+            ErrorCode = SegmentErrorCode;
+            break;
+        }
+        ++Established;
+        OutputUniqueId = Response.UniqueIds.back();
+    }
+
+    std::vector<std::uint32_t> UnusedFileIds;
+    for (std::size_t i = 0; i < Offsets.size(); ++i)
+    {
+        if (i >= Established)
+        {
+            // Only unregister the file ID because the file ID is not used by
+            // the server if failed to walk.
+            g_Instance->FreeFileId(FileIds[i]);
+        }
+        else if (0 == ErrorCode && Offsets.size() - 1 == i)
+        {
+            OutputFileId = FileIds[i];
+        }
+        else if (!(0 == ErrorCode && Cacheable && ::InsertCachedWalkFileId(
+            ::MakeWalkPathKey(Names, Offsets[i] + GetSegmentSize(i)),
+            FileIds[i],
+            false)))
+        {
+            UnusedFileIds.push_back(FileIds[i]);
+        }
+    }
+    ::SimplePipelinedClunk(UnusedFileIds);
+
+    return ErrorCode;
+}
+
+std::uint32_t SimpleWalk(
+    std::uint32_t& OutputFileId,
+    Mile::Cirno::Qid& OutputUniqueId,
+    std::uint32_t const& RootDirectoryFileId,
+    std::vector<InternedName const*> const& Names)
+{
+    OutputFileId = MILE_CIRNO_NOFID;
+
+    if (Names.size() > g_MaximumWalkElements)
+    {
+        bool Cacheable = g_RootDirectoryFileId == RootDirectoryFileId;
+        std::uint32_t StartFileId = RootDirectoryFileId;
+        std::wstring Key;
+        std::size_t Start = Cacheable
+            ? ::AcquireCachedWalkFileId(Names, StartFileId, Key)
+            : 0;
+        std::uint32_t ErrorCode = ::SimpleSegmentedWalk(
+            OutputFileId,
+            OutputUniqueId,
+            StartFileId,
+            Names,
+            Start,
+            Cacheable);
+        if (Start)
+        {
+            // Retry from the root directory once if the cached file ID is
+            // stale because of changes not made by ourselves.
+            ::ReleaseCachedWalkFileId(Key, 0 != ErrorCode);
+            if (0 != ErrorCode)
+            {
+                ErrorCode = ::SimpleSegmentedWalk(
+                    OutputFileId,
+                    OutputUniqueId,
+                    RootDirectoryFileId,
+                    Names,
+                    0,
+                    Cacheable);
+            }
+        }
+        return ErrorCode;
+    }
+
+    std::uint32_t ErrorCode = 0;
+    Mile::Cirno::EncodedWalkRequest WalkRequest = ::MakeEncodedWalkRequest(
+        RootDirectoryFileId,
+        g_Instance->AllocateFileId(),
+        Names,
+        0,
+        Names.size());
+    Mile::Cirno::WalkResponse WalkResponse = {};
+    ErrorCode = g_Instance->Walk(WalkRequest, WalkResponse);
+    if (0 == ErrorCode && Names.size() != WalkResponse.UniqueIds.size())
+    {
+        // The server returns the qids of the walked elements if the walk is
+        // partial, and the new file ID is not established in that case.
+        ErrorCode = APTX_ENOENT;
+    }
+    if (0 == ErrorCode && !WalkResponse.UniqueIds.empty())
+    {
+        // The qid of the last element is the qid of the new file ID. Keep
+        // the output qid unchanged when walking to the same file because
+        // the server returns no qid in that case.
+        OutputUniqueId = WalkResponse.UniqueIds.back();
+    }
+
+    if (0 == ErrorCode)
+    {
+        OutputFileId = WalkRequest.NewFileId;
+    }
+    else
+    {
+        // Only unregister the file ID because the file ID is not used by the
+        // server if failed to walk.
+        g_Instance->FreeFileId(WalkRequest.NewFileId);
+    }
+    return ErrorCode;
+}
+
+// The uninterned names are only used when the name cannot be interned, and
+// should be kept alive with the result.
+std::uint32_t SplitRelativeFilePath(
+    std::filesystem::path const& RelativeFilePath,
+    std::vector<InternedName const*>& Names,
+    std::forward_list<InternedName>& UninternedNames)
+{
+    std::wstring RawPath = RelativeFilePath.wstring();
+    std::wstring_view Remaining(RawPath);
+    while (!Remaining.empty())
+    {
+        std::size_t Separator = Remaining.find_first_of(L"\\/");
+        std::wstring_view Element = Remaining.substr(0, Separator);
+        Remaining = std::wstring_view::npos == Separator
+            ? std::wstring_view()
+            : Remaining.substr(Separator + 1);
+        if (Element.empty())
+        {
+            continue;
+        }
+        InternedName const* Name = ::InternName(Element);
+        if (!Name)
+        {
+            InternedName& Uninterned = UninternedNames.emplace_front();
+            if (!::MakeInternedName(Uninterned, Element))
+            {
+                return APTX_EINVAL;
+            }
+            Name = &Uninterned;
+        }
+        Names.push_back(Name);
+    }
+
+    return 0;
+}
+
+std::uint32_t SimpleWalk(
+    std::uint32_t& OutputFileId,
+    Mile::Cirno::Qid& OutputUniqueId,
+    std::uint32_t const& RootDirectoryFileId,
+    std::filesystem::path const& RelativeFilePath)
+{
+    OutputFileId = MILE_CIRNO_NOFID;
+
+    std::vector<InternedName const*> Names;
+    std::forward_list<InternedName> UninternedNames;
+    std::uint32_t ErrorCode = ::SplitRelativeFilePath(
+        RelativeFilePath,
+        Names,
+        UninternedNames);
+    if (0 != ErrorCode)
+    {
+        return ErrorCode;
+    }
+
+    return ::SimpleWalk(
+        OutputFileId,
+        OutputUniqueId,
+        RootDirectoryFileId,
+        Names);
+}
+
+std::uint32_t SimpleWalk(
+    std::uint32_t& OutputFileId,
+    std::uint32_t const& RootDirectoryFileId,
+    std::filesystem::path const& RelativeFilePath)
+{
+    Mile::Cirno::Qid UniqueId = {};
+    return ::SimpleWalk(
+        OutputFileId,
+        UniqueId,
+        RootDirectoryFileId,
+        RelativeFilePath);
+}
+
+// The key is empty if the file ID is not cached, and the file ID should be
+// clunked by ReleaseDirectoryFileId unless it is the root directory.
+std::uint32_t AcquireDirectoryFileId(
+    std::filesystem::path const& RelativeDirectoryPath,
+    std::uint32_t& FileId,
+    std::wstring& Key)
+{
+    FileId = MILE_CIRNO_NOFID;
+    Key.clear();
+
+    std::vector<InternedName const*> Names;
+    std::forward_list<InternedName> UninternedNames;
+    std::uint32_t ErrorCode = ::SplitRelativeFilePath(
+        RelativeDirectoryPath,
+        Names,
+        UninternedNames);
+    if (0 != ErrorCode)
+    {
+        return ErrorCode;
+    }
+    if (Names.empty())
+    {
+        FileId = g_RootDirectoryFileId;
+        return 0;
+    }
+
+    std::wstring CandidateKey = ::MakeWalkPathKey(Names, Names.size());
+    {
+        std::lock_guard<std::mutex> Guard(g_CachedWalkFileIdsMutex);
+        auto Iterator = g_CachedWalkFileIds.find(CandidateKey);
+        if (g_CachedWalkFileIds.end() != Iterator &&
+            ::UseCachedWalkFileId(Iterator->second))
+        {
+            ++Iterator->second.ReferenceCount;
+            FileId = Iterator->second.FileId;
+            Key = std::move(CandidateKey);
+            return 0;
+        }
+    }
+
+    Mile::Cirno::Qid UniqueId = {};
+    ErrorCode = ::SimpleWalk(FileId, UniqueId, g_RootDirectoryFileId, Names);
+    if (0 != ErrorCode)
+    {
+        return ErrorCode;
+    }
+
+    if (::InsertCachedWalkFileId(CandidateKey, FileId, true))
+    {
+        Key = std::move(CandidateKey);
+    }
+    return 0;
+}
+
+void ReleaseDirectoryFileId(
+    std::uint32_t const& FileId,
+    std::wstring const& Key,
+    bool Invalidate)
+{
+    if (!Key.empty())
+    {
+        ::ReleaseCachedWalkFileId(Key, Invalidate);
+    }
+    else if (g_RootDirectoryFileId != FileId)
+    {
+        ::SimpleClunk(FileId);
+    }
+}
+
+// The parent directory is always walked again instead of starting from the
+// cached walk file IDs, because a cached directory may be renamed by others,
+// and the entry with the same name in another directory would be deleted.
+std::uint32_t SimpleUnlinkAt(
+    std::filesystem::path const& RelativeFilePath,
+    bool const& IsDirectory)
+{
+    Mile::Cirno::UnlinkAtRequest Request = {};
+    Request.DirectoryFileId = g_RootDirectoryFileId;
+    Request.Name = ::ToRawName(RelativeFilePath.filename().wstring());
+    Request.Flags = IsDirectory
+        ? MileCirnoLinuxUnlinkAtFlagRemoveDirectory
+        : 0;
+
+    std::vector<InternedName const*> Names;
+    std::forward_list<InternedName> UninternedNames;
+    std::uint32_t ErrorCode = ::SplitRelativeFilePath(
+        RelativeFilePath.parent_path(),
+        Names,
+        UninternedNames);
+    if (0 != ErrorCode)
+    {
+        return ErrorCode;
+    }
+    if (!Names.empty())
+    {
+        Mile::Cirno::Qid UniqueId = {};
+        ErrorCode = Names.size() > g_MaximumWalkElements
+            ? ::SimpleSegmentedWalk(
+                Request.DirectoryFileId,
+                UniqueId,
+                g_RootDirectoryFileId,
+                Names,
+                0,
+                false)
+            : ::SimpleWalk(
+                Request.DirectoryFileId,
+                UniqueId,
+                g_RootDirectoryFileId,
+                Names);
+        if (0 != ErrorCode)
+        {
+            return ErrorCode;
+        }
+    }
+
+    ErrorCode = g_Instance->UnlinkAt(Request);
+
+    if (g_RootDirectoryFileId != Request.DirectoryFileId)
+    {
+        ::SimpleClunk(Request.DirectoryFileId);
+    }
+    return ErrorCode;
+}
+
+void AppendCompoundWalk(
+    std::vector<Mile::Cirno::PipelinedRequest>& Operations,
+    std::uint32_t const& FileId,
+    std::uint32_t const& NewFileId,
+    std::vector<InternedName const*> const& Names)
+{
+    Mile::Cirno::PipelinedRequest& Operation = Operations.emplace_back();
+    Operation.RequestType = MileCirnoWalkRequestMessage;
+    Operation.ResponseType = MileCirnoWalkResponseMessage;
+    Mile::Cirno::PushEncodedWalkRequest(
+        Operation.RequestContent,
+        ::MakeEncodedWalkRequest(
+            FileId,
+            NewFileId,
+            Names,
+            0,
+            Names.size()));
+}
+
+// The new file ID is not established if the walk is partial, so the later
+// operations which use it will fail anyway.
+std::uint32_t GetCompoundWalkResult(
+    Mile::Cirno::PipelinedRequest& Operation,
+    std::size_t const& NumberOfNames)
+{
+    if (0 != Operation.ErrorCode)
+    {
+        return Operation.ErrorCode;
+    }
+    std::span<std::uint8_t> ResponseSpan =
+        std::span<std::uint8_t>(Operation.ResponseContent);
+    if (NumberOfNames != Mile::Cirno::PopWalkResponse(
+        ResponseSpan).UniqueIds.size())
+    {
+        return APTX_ENOENT;
+    }
+    return 0;
+}
+
+std::uint32_t SimpleMakeDirectory(
+    std::uint32_t const& RootDirectoryFileId,
+    std::filesystem::path const& RelativeFilePath)
+{
+    std::uint32_t ErrorCode = 0;
+
+    std::uint32_t RelativeRootDirectoryFileId = MILE_CIRNO_NOFID;
+    ErrorCode = ::SimpleWalk(
+        RelativeRootDirectoryFileId,
+        RootDirectoryFileId,
+        RelativeFilePath.parent_path());
+    if (0 == ErrorCode)
+    {
+        std::uint32_t RootDirectoryGroupId = 0;
+        {
+            Mile::Cirno::GetAttributesRequest Request = {};
+            Request.FileId = RelativeRootDirectoryFileId;
+            Request.RequestMask =
+                MileCirnoLinuxGetAttributesFlagGroupId;
+            Mile::Cirno::GetAttributesResponse Response = {};
+            ErrorCode = g_Instance->GetAttributes(Request, Response);
+            if (0 == ErrorCode)
+            {
+                RootDirectoryGroupId = Response.GroupId;
+            }
+        }
+        if (0 == ErrorCode)
+        {
+            Mile::Cirno::MakeDirectoryRequest Request = {};
+            Request.DirectoryFileId = RelativeRootDirectoryFileId;
+            Request.Name = ::ToRawName(
+                RelativeFilePath.filename().wstring());
+            Request.Mode = APTX_IRWXU;
+            Request.Mode |= APTX_IRGRP | APTX_IXGRP;
+            Request.Mode |= APTX_IROTH | APTX_IXOTH;
+            Request.GroupId = RootDirectoryGroupId;
+            Mile::Cirno::MakeDirectoryResponse Response = {};
+            ErrorCode = g_Instance->MakeDirectory(Request, Response);
+        }
+
+        ::SimpleClunk(RelativeRootDirectoryFileId);
+    }
+
+    return ErrorCode;
+}
+
+std::uint32_t SimpleLinuxCreate(
+    std::uint32_t& OutputFileId,
+    std::uint32_t const& RootDirectoryFileId,
+    std::filesystem::path const& RelativeFilePath,
+    std::uint32_t Flags,
+    std::uint32_t Mode)
+{
+    OutputFileId = MILE_CIRNO_NOFID;
+    std::uint32_t ErrorCode = 0;
+
+    // Clone the parent directory into the new file ID because Tlcreate will
+    // turn the file ID into the opened new file, so the caller can use it
+    // directly without walking and opening the new file again.
+    std::uint32_t FileId = MILE_CIRNO_NOFID;
+    ErrorCode = ::SimpleWalk(
+        FileId,
+        RootDirectoryFileId,
+        RelativeFilePath.parent_path());
+    if (0 == ErrorCode)
+    {
+        std::uint32_t RootDirectoryGroupId = 0;
+        {
+            Mile::Cirno::GetAttributesRequest Request = {};
+            Request.FileId = FileId;
+            Request.RequestMask =
+                MileCirnoLinuxGetAttributesFlagGroupId;
+            Mile::Cirno::GetAttributesResponse Response = {};
+            ErrorCode = g_Instance->GetAttributes(Request, Response);
+            if (0 == ErrorCode)
+            {
+                RootDirectoryGroupId = Response.GroupId;
+            }
+        }
+        if (0 == ErrorCode)
+        {
+            Mile::Cirno::LinuxCreateRequest Request = {};
+            Request.FileId = FileId;
+            Request.Name = ::ToRawName(
+                RelativeFilePath.filename().wstring());
+            Request.Flags = Flags;
+            Request.Mode = Mode;
+            Request.GroupId = RootDirectoryGroupId;
+            Mile::Cirno::LinuxCreateResponse Response = {};
+            ErrorCode = g_Instance->LinuxCreate(Request, Response);
+        }
+
+        if (0 == ErrorCode)
+        {
+            OutputFileId = FileId;
+        }
+        else
+        {
+            ::SimpleClunk(FileId);
+        }
+    }
+
+    return ErrorCode;
+}
+
+std::wstring ToCaseFoldedName(
+    std::wstring const& Name)
+{
+    std::wstring Result(Name);
+    if (!Result.empty())
+    {
+        ::LCMapStringEx(
+            LOCALE_NAME_INVARIANT,
+            LCMAP_UPPERCASE,
+            Name.c_str(),
+            static_cast<int>(Name.size()),
+            &Result[0],
+            static_cast<int>(Result.size()),
+            nullptr,
+            nullptr,
+            0);
+    }
+    return Result;
+}
+
+std::uint32_t BuildCaseInsensitiveIndex(
+    std::filesystem::path const& RelativeDirectoryPath,
+    CaseInsensitiveIndex& Index)
+{
+    std::uint32_t ErrorCode = 0;
+
+    std::uint32_t FileId = MILE_CIRNO_NOFID;
+    ErrorCode = ::SimpleWalk(
+        FileId,
+        g_RootDirectoryFileId,
+        RelativeDirectoryPath);
+    if (0 != ErrorCode)
+    {
+        return ErrorCode;
+    }
+
+    {
+        Mile::Cirno::LinuxOpenRequest Request = {};
+        Request.FileId = FileId;
+        Request.Flags =
+            MileCirnoLinuxOpenCreateFlagReadOnly |
+            MileCirnoLinuxOpenCreateFlagDirectory |
+            MileCirnoLinuxOpenCreateFlagLargeFile |
+            MileCirnoLinuxOpenCreateFlagCloseOnExecute;
+        Mile::Cirno::LinuxOpenResponse Response = {};
+        ErrorCode = g_Instance->LinuxOpen(Request, Response);
+    }
+
+    std::uint64_t LastOffset = 0;
+    while (0 == ErrorCode)
+    {
+        Mile::Cirno::ReadDirectoryRequest Request = {};
+        Request.FileId = FileId;
+        Request.Offset = LastOffset;
+        LastOffset = 0;
+        Request.Count = g_MaximumMessageSize;
+        Request.Count -= Mile::Cirno::ReadDirectoryResponseHeaderSize;
+        Mile::Cirno::ReadDirectoryResponse Response = {};
+        ErrorCode = g_Instance->ReadDirectory(Request, Response);
+        if (0 != ErrorCode)
+        {
+            break;
+        }
+        for (Mile::Cirno::DirectoryEntry const& Entry : Response.Data)
+        {
+            LastOffset = Entry.Offset;
+
+            if ("." == Entry.Name || ".." == Entry.Name)
+            {
+                continue;
+            }
+
+            std::wstring Name = ::DecodeRawName(Entry.Name);
+            Index[::ToCaseFoldedName(Name)].push_back(Name);
+        }
+        if (!LastOffset)
+        {
+            break;
+        }
+    }
+
+    ::SimpleClunk(FileId);
+
+    return ErrorCode;
+}
+
+bool LookupCaseInsensitiveName(
+    std::filesystem::path const& RelativeDirectoryPath,
+    std::wstring const& Name,
+    std::wstring& RealName)
+{
+    std::wstring DirectoryKey = ::ToCaseFoldedName(
+        RelativeDirectoryPath.wstring());
+    std::wstring NameKey = ::ToCaseFoldedName(Name);
+
+    auto PickRealName = [&](
+        CaseInsensitiveIndex const& Index) -> bool
+    {
+        auto Iterator = Index.find(NameKey);
+        if (Index.end() == Iterator)
+        {
+            return false;
+        }
+        // Prefer the exact match if there are multiple names which are only
+        // different in case.
+        RealName = Iterator->second.front();
+        for (std::wstring const& Candidate : Iterator->second)
+        {
+            if (Candidate == Name)
+            {
+                RealName = Candidate;
+                break;
+            }
+        }
+        return true;
+    };
+
+    std::chrono::milliseconds Timeout = g_AttributeTimeout.count()
+        ? g_AttributeTimeout
+        : DefaultCaseInsensitiveIndexTimeout;
+    {
+        std::lock_guard<std::mutex> Guard(g_CaseInsensitiveIndexesMutex);
+        auto Iterator = g_CaseInsensitiveIndexes.find(DirectoryKey);
+        if (g_CaseInsensitiveIndexes.end() != Iterator &&
+            (g_Immutable ||
+            std::chrono::steady_clock::now() - Iterator->second.UpdateTime <
+            Timeout))
+        {
+            return PickRealName(Iterator->second.Index);
+        }
+    }
+
+    CaseInsensitiveDirectory Directory;
+    Directory.UpdateTime = std::chrono::steady_clock::now();
+    if (0 != ::BuildCaseInsensitiveIndex(
+        RelativeDirectoryPath,
+        Directory.Index))
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> Guard(g_CaseInsensitiveIndexesMutex);
+    if (g_CaseInsensitiveIndexes.size() >= MaximumCaseInsensitiveIndexes)
+    {
+        g_CaseInsensitiveIndexes.clear();
+    }
+    return PickRealName(g_CaseInsensitiveIndexes.insert_or_assign(
+        DirectoryKey,
+        std::move(Directory)).first->second.Index);
+}
+
+// Returns the number of the leading elements of the path which exist with
+// the exact names, which is probed with a single Twalk because the index is
+// not needed for them. If the whole path exists with the exact names, the
+// walked file ID is returned instead of being clunked, and the caller should
+// clunk it.
+std::size_t WalkExactPath(
+    std::filesystem::path const& RelativeFilePath,
+    std::uint32_t& FileId,
+    Mile::Cirno::Qid& UniqueId)
+{
+    FileId = MILE_CIRNO_NOFID;
+
+    Mile::Cirno::WalkRequest Request = {};
+    Request.FileId = g_RootDirectoryFileId;
+    bool Complete = true;
+    for (std::filesystem::path const& Element : RelativeFilePath)
+    {
+        if (Request.Names.size() >= g_MaximumWalkElements)
+        {
+            Complete = false;
+            break;
+        }
+        Request.Names.push_back(::ToRawName(Element.wstring()));
+    }
+    if (Request.Names.empty())
+    {
+        return 0;
+    }
+
+    Request.NewFileId = g_Instance->AllocateFileId();
+    Mile::Cirno::WalkResponse Response = {};
+    if (0 != g_Instance->Walk(Request, Response))
+    {
+        g_Instance->FreeFileId(Request.NewFileId);
+        return 0;
+    }
+    // The new file ID is only established if all names are walked.
+    if (Request.Names.size() != Response.UniqueIds.size())
+    {
+        g_Instance->FreeFileId(Request.NewFileId);
+    }
+    else if (Complete)
+    {
+        FileId = Request.NewFileId;
+        UniqueId = Response.UniqueIds.back();
+    }
+    else
+    {
+        ::SimpleClunk(Request.NewFileId);
+    }
+    return Response.UniqueIds.size();
+}
+
+// The file ID walked for probing the exact names is returned if the whole
+// path exists with the exact names, and the caller should clunk it.
+std::filesystem::path ResolveCaseInsensitivePath(
+    std::filesystem::path const& RelativeFilePath,
+    std::uint32_t& FileId,
+    Mile::Cirno::Qid& UniqueId)
+{
+    FileId = MILE_CIRNO_NOFID;
+
+    if (!g_CaseInsensitive)
+    {
+        return RelativeFilePath;
+    }
+
+    // Keep the leading elements which exist with the exact names, and keep
+    // the remaining elements as is after the first unresolved element,
+    // because they can only be the names which will be created.
+    std::size_t ExactCount = ::WalkExactPath(
+        RelativeFilePath,
+        FileId,
+        UniqueId);
+    std::filesystem::path Result;
+    bool Resolving = true;
+    for (std::filesystem::path const& Element : RelativeFilePath)
+    {
+        std::wstring Name = Element.wstring();
+        if (ExactCount)
+        {
+            --ExactCount;
+        }
+        else if (Resolving)
+        {
+            std::wstring RealName;
+            if (::LookupCaseInsensitiveName(Result, Name, RealName))
+            {
+                Name = RealName;
+            }
+            else
+            {
+                Resolving = false;
+            }
+        }
+        Result /= Name;
+    }
+    return Result;
+}
+
+std::filesystem::path ResolveCaseInsensitivePath(
+    std::filesystem::path const& RelativeFilePath)
+{
+    std::uint32_t FileId = MILE_CIRNO_NOFID;
+    Mile::Cirno::Qid UniqueId = {};
+    std::filesystem::path Result = ::ResolveCaseInsensitivePath(
+        RelativeFilePath,
+        FileId,
+        UniqueId);
+    if (MILE_CIRNO_NOFID != FileId)
+    {
+        ::SimpleClunk(FileId);
+    }
+    return Result;
+}
+
+std::filesystem::path GetRelativeFilePath(
+    FileContext* Context)
+{
+    std::lock_guard<std::mutex> Guard(Context->Mutex);
+    return Context->RelativeFilePath;
+}
+
+void UpdateCaseInsensitiveIndex(
+    std::filesystem::path const& RelativeFilePath,
+    bool Exists)
+{
+    if (!g_CaseInsensitive)
+    {
+        return;
+    }
+
+    std::wstring DirectoryKey = ::ToCaseFoldedName(
+        RelativeFilePath.parent_path().wstring());
+    std::wstring Name = RelativeFilePath.filename().wstring();
+    std::wstring NameKey = ::ToCaseFoldedName(Name);
+
+    std::lock_guard<std::mutex> Guard(g_CaseInsensitiveIndexesMutex);
+    auto Iterator = g_CaseInsensitiveIndexes.find(DirectoryKey);
+    if (g_CaseInsensitiveIndexes.end() == Iterator)
+    {
+        return;
+    }
+    std::vector<std::wstring>& Names = Iterator->second.Index[NameKey];
+    std::erase(Names, Name);
+    if (Exists)
+    {
+        Names.push_back(Name);
+    }
+    if (Names.empty())
+    {
+        Iterator->second.Index.erase(NameKey);
+    }
+}
+
+// The attributes are only cached if the timeout is set, and the immutable mode
+// uses its own caches instead.
+bool IsAttributeCacheEnabled()
+{
+    return !g_Immutable && g_AttributeTimeout.count();
+}
+
+// Returns false if the attributes are not cached or too stale to be served.
+bool LookupCachedAttributes(
+    std::uint64_t const& UniqueIdPath,
+    Mile::Cirno::GetAttributesResponse& Response)
+{
+    if (!::IsAttributeCacheEnabled())
+    {
+        return false;
+    }
+
+    std::chrono::steady_clock::duration Age;
+    bool Refresh = false;
+    {
+        std::lock_guard<std::mutex> Guard(g_CachedAttributesMutex);
+        auto Iterator = g_CachedAttributes.find(UniqueIdPath);
+        if (g_CachedAttributes.end() == Iterator)
+        {
+            return false;
+        }
+        std::chrono::steady_clock::time_point CurrentTime =
+            std::chrono::steady_clock::now();
+        if (CurrentTime < Iterator->second.LeaseExpireTime)
+        {
+            Response = Iterator->second.Response;
+            return true;
+        }
+        Age = CurrentTime - Iterator->second.UpdateTime;
+        if (Age >= 2 * g_AttributeTimeout)
+        {
+            return false;
+        }
+        Response = Iterator->second.Response;
+        if (Age >= g_AttributeTimeout && !Iterator->second.Refreshing)
+        {
+            Iterator->second.Refreshing = true;
+            g_AttributeRefreshQueue.push_back(UniqueIdPath);
+            Refresh = true;
+        }
+    }
+    if (Refresh)
+    {
+        g_AttributeRefreshCondition.notify_one();
+    }
+
+    return true;
+}
+
+void InsertCachedAttributes(
+    std::filesystem::path const& RelativeFilePath,
+    Mile::Cirno::GetAttributesResponse const& Response)
+{
+    if (!::IsAttributeCacheEnabled())
+    {
+        return;
+    }
+
+    CachedAttributes Value;
+    Value.Response = Response;
+    Value.UpdateTime = std::chrono::steady_clock::now();
+    Value.RelativeFilePath = RelativeFilePath.wstring();
+
+    std::lock_guard<std::mutex> Guard(g_CachedAttributesMutex);
+    if (g_CachedAttributes.size() >= MaximumCachedAttributes)
+    {
+        g_CachedAttributes.clear();
+    }
+    g_CachedAttributes.insert_or_assign(
+        Response.UniqueId.Path,
+        std::move(Value));
+}
+
+// Discard the cached attributes of the file modified by ourselves.
+void InvalidateCachedAttributes(
+    std::uint64_t const& UniqueIdPath)
+{
+    if (!::IsAttributeCacheEnabled())
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> Guard(g_CachedAttributesMutex);
+    g_CachedAttributes.erase(UniqueIdPath);
+}
+
+Mile::Cirno::GetAttributesRequest MakeGetAttributesRequest(
+    std::uint32_t const& FileId)
+{
+    Mile::Cirno::GetAttributesRequest Result = {};
+    Result.FileId = FileId;
+    Result.RequestMask =
+        MileCirnoLinuxGetAttributesFlagMode |
+        MileCirnoLinuxGetAttributesFlagNumberOfHardLinks |
+        MileCirnoLinuxGetAttributesFlagLastAccessTime |
+        MileCirnoLinuxGetAttributesFlagLastWriteTime |
+        MileCirnoLinuxGetAttributesFlagSize;
+    return Result;
+}
+
+std::uint32_t SimpleGetAttributes(
+    std::uint32_t const& FileId,
+    Mile::Cirno::GetAttributesResponse& Response)
+{
+    return g_Instance->GetAttributes(
+        ::MakeGetAttributesRequest(FileId),
+        Response);
+}
+
+void RunAttributeRefresh()
+{
+    for (;;)
+    {
+        std::uint64_t UniqueIdPath = 0;
+        std::wstring RelativeFilePath;
+        {
+            std::unique_lock<std::mutex> Lock(g_CachedAttributesMutex);
+            g_AttributeRefreshCondition.wait(Lock, []() -> bool
+            {
+                return
+                    g_AttributeRefreshStopping ||
+                    !g_AttributeRefreshQueue.empty();
+            });
+            if (g_AttributeRefreshStopping)
+            {
+                return;
+            }
+            UniqueIdPath = g_AttributeRefreshQueue.front();
+            g_AttributeRefreshQueue.pop_front();
+            auto Iterator = g_CachedAttributes.find(UniqueIdPath);
+            if (g_CachedAttributes.end() == Iterator ||
+                !Iterator->second.Refreshing)
+            {
+                continue;
+            }
+            RelativeFilePath = Iterator->second.RelativeFilePath;
+        }
+
+        Mile::Cirno::GetAttributesResponse Response = {};
+        std::uint32_t FileId = MILE_CIRNO_NOFID;
+        std::uint32_t ErrorCode = ::SimpleWalk(
+            FileId,
+            g_RootDirectoryFileId,
+            std::filesystem::path(RelativeFilePath));
+        if (0 == ErrorCode)
+        {
+            ErrorCode = ::SimpleGetAttributes(FileId, Response);
+            ::SimpleClunk(FileId);
+        }
+
+        std::lock_guard<std::mutex> Guard(g_CachedAttributesMutex);
+        auto Iterator = g_CachedAttributes.find(UniqueIdPath);
+        if (g_CachedAttributes.end() == Iterator ||
+            !Iterator->second.Refreshing)
+        {
+            // Replaced by a newer result while refreshing.
+            continue;
+        }
+        if (0 != ErrorCode || UniqueIdPath != Response.UniqueId.Path)
+        {
+            // The file is removed or replaced by another one.
+            g_CachedAttributes.erase(Iterator);
+            continue;
+        }
+        Iterator->second.Response = Response;
+        Iterator->second.UpdateTime = std::chrono::steady_clock::now();
+        Iterator->second.Refreshing = false;
+    }
+}
+
+// Request the read lease on the file whose attributes are just cached. The
+// lease is not used if the file is changed before the lease is granted,
+// which is detected by the qid version.
+void AcquireAttributesLease(
+    std::uint32_t const& FileId,
+    Mile::Cirno::GetAttributesResponse const& Attributes)
+{
+    if (!g_LeaseSupported || MILE_CIRNO_NOFID == FileId)
+    {
+        return;
+    }
+
+    Mile::Cirno::LeaseRequest Request = {};
+    Request.FileId = FileId;
+    Request.Key = g_LeaseKey;
+    Mile::Cirno::LeaseResponse Response = {};
+    if (0 != g_Instance->Lease(Request, Response) ||
+        !Response.Duration ||
+        Attributes.UniqueId.Path != Response.UniqueId.Path ||
+        Attributes.UniqueId.Version != Response.UniqueId.Version)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> Guard(g_CachedAttributesMutex);
+    auto Iterator = g_CachedAttributes.find(Response.UniqueId.Path);
+    if (g_CachedAttributes.end() != Iterator &&
+        Response.UniqueId.Version ==
+        Iterator->second.Response.UniqueId.Version)
+    {
+        Iterator->second.LeaseExpireTime =
+            std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(Response.Duration);
+    }
+}
+
+void RunLeaseNotification()
+{
+    for (;;)
+    {
+        Mile::Cirno::NotifyRequest Request = {};
+        Request.Key = g_LeaseKey;
+        Mile::Cirno::NotifyResponse Response;
+        if (0 != g_NotificationInstance->Notify(Request, Response))
+        {
+            break;
+        }
+        for (Mile::Cirno::Qid const& UniqueId : Response.UniqueIds)
+        {
+            ::InvalidateCachedAttributes(UniqueId.Path);
+        }
+    }
+
+    // Fall back to the attribute timeout because the broken leases cannot be
+    // reported anymore.
+    g_LeaseSupported = false;
+    std::lock_guard<std::mutex> Guard(g_CachedAttributesMutex);
+    for (auto& Item : g_CachedAttributes)
+    {
+        Item.second.LeaseExpireTime = {};
+    }
+}
+
+template <typename CacheType, typename KeyType, typename ValueType>
+void InsertImmutableCacheEntry(
+    CacheType& Cache,
+    KeyType const& Key,
+    ValueType const& Value)
+{
+    std::lock_guard<std::mutex> Guard(g_ImmutableCachesMutex);
+    if (Cache.size() >= MaximumImmutableCacheEntries)
+    {
+        Cache.clear();
+    }
+    Cache.insert_or_assign(Key, Value);
+}
+
+bool LookupImmutableUniqueId(
+    std::filesystem::path const& RelativeFilePath,
+    std::optional<Mile::Cirno::Qid>& UniqueId)
+{
+    std::lock_guard<std::mutex> Guard(g_ImmutableCachesMutex);
+    auto Iterator = g_ImmutableUniqueIds.find(RelativeFilePath.wstring());
+    if (g_ImmutableUniqueIds.end() == Iterator)
+    {
+        return false;
+    }
+    UniqueId = Iterator->second;
+    return true;
+}
+
+bool LookupImmutableAttributes(
+    std::uint64_t const& UniqueIdPath,
+    Mile::Cirno::GetAttributesResponse& Attributes)
+{
+    std::lock_guard<std::mutex> Guard(g_ImmutableCachesMutex);
+    auto Iterator = g_ImmutableAttributes.find(UniqueIdPath);
+    if (g_ImmutableAttributes.end() == Iterator)
+    {
+        return false;
+    }
+    Attributes = Iterator->second;
+    return true;
+}
+
+std::shared_ptr<std::vector<WIN32_FIND_DATAW> const> LookupImmutableDirectory(
+    std::uint64_t const& UniqueIdPath)
+{
+    std::lock_guard<std::mutex> Guard(g_ImmutableCachesMutex);
+    auto Iterator = g_ImmutableDirectories.find(UniqueIdPath);
+    if (g_ImmutableDirectories.end() == Iterator)
+    {
+        return nullptr;
+    }
+    return Iterator->second;
+}
+
+// Copy the cached content of the specific block from the specific offset in
+// the block. Returns false if the block is not cached, and the block is the
+// last one of the file if BlockSize is less than CachedFileBlockSize.
+bool ReadImmutableFileBlock(
+    std::uint64_t const& UniqueIdPath,
+    std::uint64_t const& BlockIndex,
+    std::size_t const& BlockOffset,
+    std::uint8_t* Buffer,
+    std::size_t const& BufferLength,
+    std::size_t& ReadLength,
+    std::size_t& BlockSize)
+{
+    std::lock_guard<std::mutex> Guard(g_ImmutableCachesMutex);
+    auto Iterator = g_ImmutableFileBlocks.find(
+        std::make_pair(UniqueIdPath, BlockIndex));
+    if (g_ImmutableFileBlocks.end() == Iterator)
+    {
+        return false;
+    }
+    BlockSize = Iterator->second.size();
+    ReadLength = 0;
+    if (BlockOffset < BlockSize)
+    {
+        ReadLength = std::min(BlockSize - BlockOffset, BufferLength);
+        std::memcpy(Buffer, &Iterator->second[BlockOffset], ReadLength);
+    }
+    return true;
+}
+
+void InsertImmutableFileBlock(
+    std::uint64_t const& UniqueIdPath,
+    std::uint64_t const& BlockIndex,
+    std::vector<std::uint8_t>&& Block)
+{
+    std::lock_guard<std::mutex> Guard(g_ImmutableCachesMutex);
+    if (g_ImmutableFileBlocksSize + Block.size() >
+        MaximumImmutableFileBlocksSize)
+    {
+        g_ImmutableFileBlocks.clear();
+        g_ImmutableFileBlocksSize = 0;
+    }
+    std::size_t Size = Block.size();
+    if (g_ImmutableFileBlocks.try_emplace(
+        std::make_pair(UniqueIdPath, BlockIndex),
+        std::move(Block)).second)
+    {
+        g_ImmutableFileBlocksSize += Size;
+    }
+}
+
+// The caller should hold the lock of the context.
+std::uint32_t WalkDeferredFile(
+    FileContext* Context)
+{
+    if (MILE_CIRNO_NOFID != Context->FileId)
+    {
+        return 0;
+    }
+
+    Mile::Cirno::Qid UniqueId = Context->UniqueId;
+    return ::SimpleWalk(
+        Context->FileId,
+        UniqueId,
+        g_RootDirectoryFileId,
+        Context->RelativeFilePath);
+}
+
+std::uint32_t EnsureFileWalked(
+    FileContext* Context)
+{
+    std::lock_guard<std::mutex> Guard(Context->Mutex);
+    return ::WalkDeferredFile(Context);
+}
+
+std::uint32_t EnsureFileOpened(
+    FileContext* Context,
+    std::uint32_t const& InitialReadSize = 0)
+{
+    std::lock_guard<std::mutex> Guard(Context->Mutex);
+
+    if (Context->Opened)
+    {
+        return 0;
+    }
+
+    // The truncating opens are never shared because the truncation needs to
+    // be done by the server for each open.
+    bool Shareable =
+        MileCirnoQidTypeFile == Context->UniqueId.Type &&
+        !(MileCirnoLinuxOpenCreateFlagTruncate & Context->OpenFlags);
+    SharedOpenedFileKey Key(Context->UniqueId.Path, Context->OpenFlags);
+    if (Shareable)
+    {
+        std::lock_guard<std::mutex> TableGuard(g_SharedOpenedFilesMutex);
+        auto Iterator = g_SharedOpenedFiles.find(Key);
+        if (g_SharedOpenedFiles.end() != Iterator)
+        {
+            ++Iterator->second.ReferenceCount;
+            Context->OpenedFileId = Iterator->second.FileId;
+            Context->Shared = true;
+            Context->Opened = true;
+            return 0;
+        }
+    }
+
+    // Send the deferred walk, Tlopen and the initial Tread in one Tcompound
+    // if supported, or pipeline them otherwise, so opening and reading the
+    // small files only costs one round trip.
+    std::vector<InternedName const*> Names;
+    std::forward_list<InternedName> UninternedNames;
+    bool Walking = MILE_CIRNO_NOFID == Context->FileId;
+    if (Walking)
+    {
+        std::uint32_t ErrorCode = ::SplitRelativeFilePath(
+            Context->RelativeFilePath,
+            Names,
+            UninternedNames);
+        if (0 != ErrorCode)
+        {
+            return ErrorCode;
+        }
+        if (Names.size() > g_MaximumWalkElements)
+        {
+            ErrorCode = ::WalkDeferredFile(Context);
+            if (0 != ErrorCode)
+            {
+                return ErrorCode;
+            }
+            Walking = false;
+        }
+    }
+    std::uint32_t FileId = Walking
+        ? g_Instance->AllocateFileId()
+        : Context->FileId;
+
+    std::vector<Mile::Cirno::PipelinedRequest> Operations;
+    if (Walking)
+    {
+        ::AppendCompoundWalk(
+            Operations,
+            g_RootDirectoryFileId,
+            FileId,
+            Names);
+    }
+    Mile::Cirno::LinuxOpenRequest Request = {};
+    Request.FileId = FileId;
+    Request.Flags = Context->OpenFlags;
+    {
+        Mile::Cirno::PipelinedRequest& Current = Operations.emplace_back();
+        Current.RequestType = MileCirnoLinuxOpenRequestMessage;
+        Current.ResponseType = MileCirnoLinuxOpenResponseMessage;
+        Mile::Cirno::PushLinuxOpenRequest(Current.RequestContent, Request);
+    }
+    if (InitialReadSize)
+    {
+        Mile::Cirno::ReadRequest ReadRequest = {};
+        ReadRequest.FileId = FileId;
+        ReadRequest.Offset = 0;
+        ReadRequest.Count = InitialReadSize;
+        Mile::Cirno::PipelinedRequest& Current = Operations.emplace_back();
+        Current.RequestType = MileCirnoReadRequestMessage;
+        Current.ResponseType = MileCirnoReadResponseMessage;
+        Mile::Cirno::PushReadRequest(Current.RequestContent, ReadRequest);
+    }
+    if (g_CompoundSupported)
+    {
+        std::uint32_t ErrorCode = g_Instance->Compound(Operations);
+        if (0 != ErrorCode)
+        {
+            if (Walking)
+            {
+                // The server has not executed any operation if the whole
+                // Tcompound is failed.
+                g_Instance->FreeFileId(FileId);
+            }
+            return ErrorCode;
+        }
+    }
+    else
+    {
+        // The server may process the pipelined requests in any order, so
+        // Tlopen is sent again if it fails after a successful walk, and the
+        // initial Tread only succeeds if it is processed after Tlopen.
+        g_Instance->PipelinedRequestResponse(Operations);
+    }
+
+    std::size_t Index = 0;
+    if (Walking)
+    {
+        std::uint32_t ErrorCode = ::GetCompoundWalkResult(
+            Operations[Index],
+            Names.size());
+        if (0 != ErrorCode)
+        {
+            // Only unregister the file ID because the file ID is not used by
+            // the server if failed to walk.
+            g_Instance->FreeFileId(FileId);
+            return ErrorCode;
+        }
+        Context->FileId = FileId;
+        ++Index;
+    }
+    std::uint32_t ErrorCode = Operations[Index++].ErrorCode;
+    bool Retried = false;
+    if (!g_CompoundSupported && Walking && 0 != ErrorCode)
+    {
+        Mile::Cirno::LinuxOpenResponse Response = {};
+        ErrorCode = g_Instance->LinuxOpen(Request, Response);
+        Retried = true;
+    }
+    // The opens are always read-only in the immutable mode.
+    if (!g_Immutable &&
+        (APTX_EROFS == ErrorCode || APTX_EACCES == ErrorCode))
+    {
+        Request.Flags &= ~MileCirnoLinuxOpenCreateFlagWriteOnly;
+        Request.Flags &= ~MileCirnoLinuxOpenCreateFlagReadWrite;
+        Request.Flags |= MileCirnoLinuxOpenCreateFlagReadOnly;
+        Mile::Cirno::LinuxOpenResponse Response = {};
+        ErrorCode = g_Instance->LinuxOpen(Request, Response);
+        Retried = true;
+    }
+    if (0 != ErrorCode)
+    {
+        return ErrorCode;
+    }
+    if (Retried)
+    {
+        // The file ID is only shared with the read-only opens, and it is
+        // released with the same key when the handle is closed.
+        Context->OpenFlags = Request.Flags;
+        Key.second = Request.Flags;
+    }
+
+    // The initial Tread is not executed or fails if the first Tlopen is
+    // failed.
+    if (Index < Operations.size() &&
+        !Retried &&
+        0 == Operations[Index].ErrorCode)
+    {
+        std::span<std::uint8_t> ResponseSpan =
+            std::span<std::uint8_t>(Operations[Index].ResponseContent);
+        Context->InitialContent =
+            Mile::Cirno::PopReadResponse(ResponseSpan).Data;
+        Context->InitialContentComplete =
+            Context->InitialContent.size() < InitialReadSize;
+        Context->InitialContentValid = true;
+        if (Context->InitialContentComplete &&
+            Context->InitialContent.size() <= CachedFileBlockSize)
+        {
+            ::InsertImmutableFileBlock(
+                Context->UniqueId.Path,
+                0,
+                std::vector<std::uint8_t>(Context->InitialContent));
+        }
+    }
+
+    Context->OpenedFileId = Context->FileId;
+    Context->Opened = true;
+
+    if (Shareable)
+    {
+        std::lock_guard<std::mutex> TableGuard(g_SharedOpenedFilesMutex);
+        auto Result = g_SharedOpenedFiles.try_emplace(Key);
+        // Keep the file ID exclusive if another open of the same file has won
+        // the race for publishing its opened file ID.
+        if (Result.second)
+        {
+            Result.first->second.FileId = Context->FileId;
+            Result.first->second.ReferenceCount = 1;
+            Context->Shared = true;
+        }
+    }
+
+    return 0;
+}
+
+void RegisterCopyDestination(
+    ULONG const& ProcessId,
+    FileContext* Context)
+{
+    if (!g_CopyRangeSupported || g_WriteProtected)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> Guard(g_CopySourcesMutex);
+    ++g_CopyDestinations[ProcessId];
+    Context->CopyDestinationProcessId = ProcessId;
+}
+
+// The handle is not used by others yet, so the lock is not needed.
+void RegisterCopySource(
+    ULONG const& ProcessId,
+    FileContext* Context)
+{
+    if (!g_CopyRangeSupported || g_WriteProtected)
+    {
+        return;
+    }
+
+    Context->CopySourceProcessId = ProcessId;
+}
+
+void RecordCopySource(
+    ULONG const& ProcessId,
+    FileContext* Context,
+    std::uint64_t const& Offset,
+    void const* Buffer,
+    std::uint32_t const& Length)
+{
+    if (!g_CopyRangeSupported ||
+        g_WriteProtected ||
+        Length < MinimumCopySourceSize ||
+        Length > MaximumCopySourceSize ||
+        Context->CopySourceProcessId != ProcessId)
+    {
+        return;
+    }
+
+    CopySource Source;
+    Source.Context = Context;
+    Source.Offset = Offset;
+    {
+        std::lock_guard<std::mutex> Guard(g_CopySourcesMutex);
+        if (g_CopyDestinations.end() == g_CopyDestinations.find(ProcessId))
+        {
+            return;
+        }
+        auto Iterator = g_CopySources.find(ProcessId);
+        if (g_CopySources.end() != Iterator)
+        {
+            if (Iterator->second.Busy)
+            {
+                return;
+            }
+            Source.Content.swap(Iterator->second.Content);
+        }
+    }
+
+    // The lock is not held for copying the content.
+    Source.Content.assign(
+        static_cast<std::uint8_t const*>(Buffer),
+        static_cast<std::uint8_t const*>(Buffer) + Length);
+
+    std::lock_guard<std::mutex> Guard(g_CopySourcesMutex);
+    auto Iterator = g_CopySources.find(ProcessId);
+    if (g_CopySources.end() != Iterator && Iterator->second.Busy)
+    {
+        return;
+    }
+    if (g_CopySources.end() == Iterator &&
+        g_CopySources.size() >= MaximumCopySources)
+    {
+        for (Iterator = g_CopySources.begin();
+            g_CopySources.end() != Iterator;)
+        {
+            if (Iterator->second.Busy)
+            {
+                ++Iterator;
+            }
+            else
+            {
+                Iterator = g_CopySources.erase(Iterator);
+            }
+        }
+    }
+    g_CopySources[ProcessId] = std::move(Source);
+}
+
+// Wait for the Tcopyrange which is using the handle as the source, so the
+// handle can be closed safely.
+void ForgetCopySource(
+    FileContext* Context)
+{
+    std::unique_lock<std::mutex> Guard(g_CopySourcesMutex);
+    g_CopySourcesCondition.wait(Guard, [&]()
+    {
+        for (auto const& Current : g_CopySources)
+        {
+            if (Context == Current.second.Context && Current.second.Busy)
+            {
+                return false;
+            }
+        }
+        return true;
+    });
+    for (auto Iterator = g_CopySources.begin();
+        g_CopySources.end() != Iterator;)
+    {
+        if (Context == Iterator->second.Context)
+        {
+            Iterator = g_CopySources.erase(Iterator);
+        }
+        else
+        {
+            ++Iterator;
+        }
+    }
+
+    if (Context->CopyDestinationProcessId.has_value())
+    {
+        auto Iterator = g_CopyDestinations.find(
+            Context->CopyDestinationProcessId.value());
+        if (g_CopyDestinations.end() != Iterator &&
+            0 == --Iterator->second)
+        {
+            g_CopyDestinations.erase(Iterator);
+        }
+    }
+}
+
+// Copy on the server if the content written by the process to the file it
+// has created or truncated is the same as its last read from the same offset
+// of another file. Returns the size copied by the server, and the rest should
+// be written as usual.
+std::uint32_t OffloadCopiedWrite(
+    ULONG const& ProcessId,
+    FileContext* Context,
+    std::uint64_t const& Offset,
+    void const* Buffer,
+    std::uint32_t const& Length)
+{
+    if (!g_CopyRangeSupported ||
+        Length < MinimumCopySourceSize ||
+        Context->CopyDestinationProcessId != ProcessId)
+    {
+        return 0;
+    }
+
+    FileContext* SourceContext = nullptr;
+    {
+        std::lock_guard<std::mutex> Guard(g_CopySourcesMutex);
+        auto Iterator = g_CopySources.find(ProcessId);
+        if (g_CopySources.end() == Iterator)
+        {
+            return 0;
+        }
+        CopySource& Source = Iterator->second;
+        if (Source.Busy ||
+            Context == Source.Context ||
+            Offset != Source.Offset ||
+            Length > Source.Content.size() ||
+            0 != std::memcmp(Buffer, Source.Content.data(), Length))
+        {
+            return 0;
+        }
+        Source.Busy = true;
+        SourceContext = Source.Context;
+    }
+
+    // The server copies the current content of the source, which is the same
+    // as the written bytes unless the source is modified by others since the
+    // read, and the short copy is completed by the usual write.
+    std::uint32_t CopiedSize = 0;
+    std::uint32_t ErrorCode = ::EnsureFileOpened(SourceContext);
+    if (0 == ErrorCode)
+    {
+        Mile::Cirno::CopyRangeRequest Request = {};
+        Request.FileId = SourceContext->OpenedFileId;
+        Request.Offset = Offset;
+        Request.DestinationFileId = Context->OpenedFileId;
+        Request.DestinationOffset = Offset;
+        Request.Count = Length;
+        Mile::Cirno::CopyRangeResponse Response = {};
+        ErrorCode = g_Instance->CopyRange(Request, Response);
+        if (APTX_LINUX_ENOSYS == ErrorCode ||
+            APTX_LINUX_EOPNOTSUPP == ErrorCode)
+        {
+            g_CopyRangeSupported = false;
+        }
+        if (0 == ErrorCode)
+        {
+            CopiedSize = static_cast<std::uint32_t>(
+                std::min<std::uint64_t>(Response.Count, Length));
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> Guard(g_CopySourcesMutex);
+        g_CopySources.erase(ProcessId);
+    }
+    g_CopySourcesCondition.notify_all();
+
+    return CopiedSize;
+}
+
+// Returns APTX_LINUX_EOPNOTSUPP without writing anything if Tappend is not
+// supported. Each chunk is appended atomically, so the content written by
+// others is never overwritten, but it may be interleaved between the chunks
+// of the write larger than the maximum message size.
+std::uint32_t AppendToEndOfFile(
+    std::uint32_t const& FileId,
+    LPCVOID Buffer,
+    DWORD const& NumberOfBytesToWrite,
+    DWORD& NumberOfBytesWritten)
+{
+    NumberOfBytesWritten = 0;
+
+    if (!g_AppendSupported)
+    {
+        return APTX_LINUX_EOPNOTSUPP;
+    }
+
+    while (NumberOfBytesWritten < NumberOfBytesToWrite)
+    {
+        std::uint32_t RequestCount = g_MaximumMessageSize;
+        RequestCount -= Mile::Cirno::AppendRequestHeaderSize;
+        if (NumberOfBytesToWrite - NumberOfBytesWritten < RequestCount)
+        {
+            RequestCount = NumberOfBytesToWrite - NumberOfBytesWritten;
+        }
+        const std::uint8_t* Current =
+            static_cast<const std::uint8_t*>(Buffer) + NumberOfBytesWritten;
+
+        Mile::Cirno::AppendRequest Request = {};
+        Request.FileId = FileId;
+        Request.Data.assign(Current, Current + RequestCount);
+        Mile::Cirno::AppendResponse Response = {};
+        std::uint32_t ErrorCode = g_Instance->Append(Request, Response);
+        if (!NumberOfBytesWritten &&
+            (APTX_LINUX_ENOSYS == ErrorCode ||
+            APTX_LINUX_EOPNOTSUPP == ErrorCode))
+        {
+            g_AppendSupported = false;
+            return APTX_LINUX_EOPNOTSUPP;
+        }
+        if (0 != ErrorCode)
+        {
+            return ErrorCode;
+        }
+        if (!Response.Count)
+        {
+            break;
+        }
+        NumberOfBytesWritten += std::min(Response.Count, RequestCount);
+    }
+
+    return 0;
+}
+
+std::uint32_t FlushFileWithGroupCommit(
+    FileContext* Context)
+{
+    std::shared_ptr<FlushGroup> Group;
+    {
+        std::lock_guard<std::mutex> Guard(g_FlushGroupsMutex);
+        std::shared_ptr<FlushGroup>& Item =
+            g_FlushGroups[Context->UniqueId.Path];
+        if (!Item)
+        {
+            Item = std::make_shared<FlushGroup>();
+        }
+        Group = Item;
+        ++Group->ReferenceCount;
+    }
+
+    std::uint32_t ErrorCode = 0;
+    {
+        std::unique_lock<std::mutex> Lock(Group->Mutex);
+
+        std::uint64_t Generation = ++Group->RequestedGeneration;
+        if (Context->MetadataChanged.exchange(false))
+        {
+            Group->MetadataChanged = true;
+        }
+
+        while (Group->CompletedGeneration < Generation)
+        {
+            if (Group->Flushing)
+            {
+                Group->Condition.wait(Lock);
+                continue;
+            }
+
+            Group->Flushing = true;
+            std::uint64_t TargetGeneration = Group->RequestedGeneration;
+            Mile::Cirno::FlushFileRequest Request = {};
+            Request.FileId = Context->OpenedFileId;
+            Request.DataSync = Group->MetadataChanged ? 0 : 1;
+            Group->MetadataChanged = false;
+            Lock.unlock();
+
+            std::uint32_t FlushErrorCode = g_Instance->FlushFile(Request);
+
+            Lock.lock();
+            if (0 != FlushErrorCode && !Request.DataSync)
+            {
+                // Keep the metadata for the next flush.
+                Group->MetadataChanged = true;
+            }
+            Group->Flushing = false;
+            Group->CompletedGeneration = TargetGeneration;
+            Group->CompletedErrorCode = FlushErrorCode;
+            Group->Condition.notify_all();
+        }
+
+        // The later batch also covers this caller if it is completed first.
+        ErrorCode = Group->CompletedErrorCode;
+    }
+
+    {
+        std::lock_guard<std::mutex> Guard(g_FlushGroupsMutex);
+        if (!--Group->ReferenceCount)
+        {
+            g_FlushGroups.erase(Context->UniqueId.Path);
+        }
+    }
+
+    return ErrorCode;
+}
+
+void ReleaseFileContext(
+    FileContext* Context)
+{
+    ::ForgetCopySource(Context);
+
+    if (!Context->Shared)
+    {
+        if (MILE_CIRNO_NOFID != Context->FileId)
+        {
+            ::SimpleClunk(Context->FileId);
+        }
+        return;
+    }
+
+    std::uint32_t UnreferencedFileId = MILE_CIRNO_NOFID;
+    {
+        std::lock_guard<std::mutex> TableGuard(g_SharedOpenedFilesMutex);
+        auto Iterator = g_SharedOpenedFiles.find(SharedOpenedFileKey(
+            Context->UniqueId.Path,
+            Context->OpenFlags));
+        if (g_SharedOpenedFiles.end() != Iterator &&
+            0 == --Iterator->second.ReferenceCount)
+        {
+            UnreferencedFileId = Iterator->second.FileId;
+            g_SharedOpenedFiles.erase(Iterator);
+        }
+    }
+    if (MILE_CIRNO_NOFID != UnreferencedFileId)
+    {
+        ::SimpleClunk(UnreferencedFileId);
+    }
+
+    // The walked file ID is only owned by the handle if the opened file ID is
+    // borrowed from another handle.
+    if (MILE_CIRNO_NOFID != Context->FileId &&
+        Context->OpenedFileId != Context->FileId)
+    {
+        ::SimpleClunk(Context->FileId);
+    }
+}
+
+bool IsFileOpened(
+    FileContext* Context)
+{
+    std::lock_guard<std::mutex> Guard(Context->Mutex);
+    return Context->Opened;
+}
+
+// Returns false if the range is not covered by the initial content.
+bool ReadInitialContent(
+    FileContext* Context,
+    std::uint64_t const& Offset,
+    void* Buffer,
+    std::uint32_t const& BufferLength,
+    std::uint32_t& ReadLength)
+{
+    std::lock_guard<std::mutex> Guard(Context->Mutex);
+
+    if (!Context->InitialContentValid)
+    {
+        return false;
+    }
+
+    std::uint64_t Size = Context->InitialContent.size();
+    if (Offset + BufferLength > Size && !Context->InitialContentComplete)
+    {
+        return false;
+    }
+
+    ReadLength = 0;
+    if (Offset < Size)
+    {
+        ReadLength = static_cast<std::uint32_t>(
+            std::min<std::uint64_t>(Size - Offset, BufferLength));
+        std::memcpy(Buffer, &Context->InitialContent[Offset], ReadLength);
+    }
+    return true;
+}
+
+void DiscardInitialContent(
+    FileContext* Context)
+{
+    std::lock_guard<std::mutex> Guard(Context->Mutex);
+    Context->InitialAttributesValid = false;
+    Context->InitialContentValid = false;
+    Context->InitialContent.clear();
+    Context->InitialContent.shrink_to_fit();
+}
+
+void DiscardInitialAttributes(
+    FileContext* Context)
+{
+    std::lock_guard<std::mutex> Guard(Context->Mutex);
+    Context->InitialAttributesValid = false;
+}
+
+// Decide how many bytes should be read together with Tlopen for reading the
+// small files in one round trip, and 0 means no initial read. The initial
+// content is only read in the immutable mode, because it would be stale if
+// the file is modified through other handles.
+std::uint32_t GetInitialReadSize(
+    FileContext* Context)
+{
+    if (!g_Immutable)
+    {
+        return 0;
+    }
+
+    std::uint32_t Result = SmallFileThreshold;
+    std::uint32_t Limit = g_MaximumMessageSize;
+    Limit -= Mile::Cirno::ReadResponseHeaderSize;
+    if (g_CompoundSupported)
+    {
+        // The Rread is wrapped as a result of Rcompound.
+        Limit -= CompoundResultOverhead;
+    }
+    if (Result > Limit)
+    {
+        Result = Limit;
+    }
+
+    // The persistent cache is preferred.
+    if (!g_CacheDirectory.empty())
+    {
+        return 0;
+    }
+    std::uint8_t Probe = 0;
+    std::size_t ProbeLength = 0;
+    std::size_t BlockSize = 0;
+    if (::ReadImmutableFileBlock(
+        Context->UniqueId.Path,
+        0,
+        0,
+        &Probe,
+        sizeof(Probe),
+        ProbeLength,
+        BlockSize))
+    {
+        return 0;
+    }
+
+    // Read one more byte than the file size to confirm the whole file is
+    // read, and skip the files larger than the threshold.
+    Mile::Cirno::GetAttributesResponse Attributes = {};
+    if (::LookupImmutableAttributes(Context->UniqueId.Path, Attributes))
+    {
+        if (Attributes.FileSize >= Result)
+        {
+            return 0;
+        }
+        Result = static_cast<std::uint32_t>(Attributes.FileSize) + 1;
+    }
+
+    return Result;
+}
+
+#define MILE_CIRNO_ACCESS_READ ( \
+    GENERIC_READ | \
+    FILE_GENERIC_READ)
+#define MILE_CIRNO_ACCESS_WRITE ( \
+    GENERIC_WRITE | \
+    FILE_GENERIC_WRITE | \
+    DELETE | \
+    WRITE_DAC | \
+    WRITE_OWNER)
+#define MILE_CIRNO_ACCESS_EXECUTE ( \
+    GENERIC_EXECUTE | \
+    FILE_GENERIC_EXECUTE)
+#define MILE_CIRNO_ACCESS_DATA ( \
+    GENERIC_READ | \
+    GENERIC_WRITE | \
+    GENERIC_EXECUTE | \
+    FILE_READ_DATA | \
+    FILE_WRITE_DATA | \
+    FILE_APPEND_DATA | \
+    FILE_EXECUTE)
+#define MILE_CIRNO_ACCESS_MODIFY ( \
+    GENERIC_ALL | \
+    GENERIC_WRITE | \
+    FILE_WRITE_DATA | \
+    FILE_APPEND_DATA | \
+    FILE_WRITE_ATTRIBUTES | \
+    FILE_WRITE_EA | \
+    DELETE | \
+    WRITE_DAC | \
+    WRITE_OWNER)
+
+Mile::Cirno::GetAttributesResponse ToGetAttributesResponse(
+    Mile::Cirno::WindowsOpenResponse const& Response)
+{
+    Mile::Cirno::GetAttributesResponse Result = {};
+    Result.Valid = MileCirnoLinuxGetAttributesFlagAll;
+    Result.UniqueId = Response.UniqueId;
+    Result.Mode = Response.Mode;
+    Result.OwnerUserId = Response.OwnerUserId;
+    Result.GroupId = Response.GroupId;
+    Result.NumberOfHardLinks = Response.NumberOfHardLinks;
+    Result.DeviceId = Response.DeviceId;
+    Result.FileSize = Response.FileSize;
+    Result.BlockSize = Response.BlockSize;
+    Result.AllocatedBlocks = Response.AllocatedBlocks;
+    Result.LastAccessTimeSeconds = Response.LastAccessTimeSeconds;
+    Result.LastAccessTimeNanoseconds = Response.LastAccessTimeNanoseconds;
+    Result.LastWriteTimeSeconds = Response.LastWriteTimeSeconds;
+    Result.LastWriteTimeNanoseconds = Response.LastWriteTimeNanoseconds;
+    Result.ChangeTimeSeconds = Response.ChangeTimeSeconds;
+    Result.ChangeTimeNanoseconds = Response.ChangeTimeNanoseconds;
+    Result.BirthTimeSeconds = Response.BirthTimeSeconds;
+    Result.BirthTimeNanoseconds = Response.BirthTimeNanoseconds;
+    Result.Generation = Response.Generation;
+    Result.DataVersion = Response.DataVersion;
+    return Result;
+}
+
+// Twreaddir entries carry the basic attributes only.
+Mile::Cirno::GetAttributesResponse ToGetAttributesResponse(
+    Mile::Cirno::WindowsDirectoryEntry const& Entry)
+{
+    Mile::Cirno::GetAttributesResponse Result = {};
+    Result.Valid = MileCirnoLinuxGetAttributesFlagBasic;
+    Result.UniqueId = Entry.UniqueId;
+    Result.Mode = Entry.Mode;
+    Result.OwnerUserId = Entry.OwnerUserId;
+    Result.GroupId = Entry.GroupId;
+    Result.NumberOfHardLinks = Entry.NumberOfHardLinks;
+    Result.DeviceId = Entry.DeviceId;
+    Result.FileSize = Entry.FileSize;
+    Result.BlockSize = Entry.BlockSize;
+    Result.AllocatedBlocks = Entry.AllocatedBlocks;
+    Result.LastAccessTimeSeconds = Entry.LastAccessTimeSeconds;
+    Result.LastAccessTimeNanoseconds = Entry.LastAccessTimeNanoseconds;
+    Result.LastWriteTimeSeconds = Entry.LastWriteTimeSeconds;
+    Result.LastWriteTimeNanoseconds = Entry.LastWriteTimeNanoseconds;
+    Result.ChangeTimeSeconds = Entry.ChangeTimeSeconds;
+    Result.ChangeTimeNanoseconds = Entry.ChangeTimeNanoseconds;
+    return Result;
+}
+
+// Query the group of the parent directory, which is inherited by the new file
+// in the same way as Tlcreate. It is only used by Twopen if the server refuses
+// the group of the root directory.
+std::uint32_t GetParentDirectoryGroupId(
+    std::filesystem::path const& RelativeFilePath,
+    std::uint32_t& GroupId)
+{
+    std::filesystem::path RelativeDirectoryPath =
+        RelativeFilePath.parent_path();
+    if (RelativeDirectoryPath.empty())
+    {
+        GroupId = g_RootDirectoryGroupId;
+        return 0;
+    }
+
+    std::uint32_t FileId = MILE_CIRNO_NOFID;
+    std::wstring Key;
+    std::uint32_t ErrorCode = ::AcquireDirectoryFileId(
+        RelativeDirectoryPath,
+        FileId,
+        Key);
+    if (0 != ErrorCode)
+    {
+        return ErrorCode;
+    }
+    Mile::Cirno::GetAttributesRequest Request = {};
+    Request.FileId = FileId;
+    Request.RequestMask = MileCirnoLinuxGetAttributesFlagGroupId;
+    Mile::Cirno::GetAttributesResponse Response = {};
+    ErrorCode = g_Instance->GetAttributes(Request, Response);
+    if (0 == ErrorCode)
+    {
+        GroupId = Response.GroupId;
+    }
+    ::ReleaseDirectoryFileId(FileId, Key, false);
+    return ErrorCode;
+}
+
+// Walk, open or create the file and query its attributes with a single
+// Twopen. The context owns the opened file ID only if the file is opened or
+// created.
+std::uint32_t SimpleWindowsOpen(
+    FileContext* Context,
+    std::filesystem::path const& RelativeFilePath,
+    std::uint32_t const& Flags,
+    std::uint32_t const& WindowsFlags,
+    std::uint32_t const& Mode,
+    std::uint8_t& Status)
+{
+    Mile::Cirno::WindowsOpenRequest Request = {};
+    Request.FileId = g_RootDirectoryFileId;
+    Request.Flags = Flags;
+    Request.WindowsFlags = WindowsFlags;
+    Request.Mode = Mode;
+    Request.GroupId = g_RootDirectoryGroupId;
+    Request.AttributesMask = MileCirnoLinuxGetAttributesFlagAll;
+    for (std::filesystem::path const& Element : RelativeFilePath)
+    {
+        Request.Names.push_back(::ToRawName(Element.wstring()));
+    }
+    // Only query the group of the parent directory if the server has refused
+    // the group of the root directory, because it costs a walk and Tgetattr.
+    bool QueryGroupId =
+        (MileCirnoLinuxOpenCreateFlagCreate & Flags) &&
+        RelativeFilePath.has_parent_path();
+    if (QueryGroupId && !g_WindowsOpenRootGroupIdAccepted)
+    {
+        std::uint32_t ErrorCode = ::GetParentDirectoryGroupId(
+            RelativeFilePath,
+            Request.GroupId);
+        if (0 != ErrorCode)
+        {
+            return ErrorCode;
+        }
+        QueryGroupId = false;
+    }
+    Request.NewFileId = g_Instance->AllocateFileId();
+
+    Mile::Cirno::WindowsOpenResponse Response = {};
+    std::uint32_t ErrorCode = g_Instance->WindowsOpen(Request, Response);
+    if (QueryGroupId &&
+        (APTX_EPERM == ErrorCode || APTX_EINVAL == ErrorCode))
+    {
+        g_WindowsOpenRootGroupIdAccepted = false;
+        ErrorCode = ::GetParentDirectoryGroupId(
+            RelativeFilePath,
+            Request.GroupId);
+        if (0 == ErrorCode)
+        {
+            ErrorCode = g_Instance->WindowsOpen(Request, Response);
+        }
+    }
+    if (0 == ErrorCode)
+    {
+        Status = Response.Status;
+    }
+    if (0 != ErrorCode ||
+        (MileCirnoWindowsOpenStatusOpened != Response.Status &&
+        MileCirnoWindowsOpenStatusCreated != Response.Status))
+    {
+        // Only unregister the file ID because the file ID is not used by the
+        // server if failed to open.
+        g_Instance->FreeFileId(Request.NewFileId);
+        return ErrorCode;
+    }
+
+    std::lock_guard<std::mutex> Guard(Context->Mutex);
+    Context->FileId = Request.NewFileId;
+    Context->OpenedFileId = Request.NewFileId;
+    Context->Opened = true;
+    Context->OpenFlags = Flags;
+    Context->UniqueId = Response.UniqueId;
+    Context->InitialAttributes = ::ToGetAttributesResponse(Response);
+    Context->InitialAttributesValid = true;
+
+    return 0;
+}
+
+NTSTATUS DOKAN_CALLBACK MileCirnoZwCreateFile(
+    _In_ LPCWSTR FileName,
+    _In_ PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_ ULONG FileAttributes,
+    _In_ ULONG ShareAccess,
+    _In_ ULONG CreateDisposition,
+    _In_ ULONG CreateOptions,
+    _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
+{
+    UNREFERENCED_PARAMETER(SecurityContext);
+    UNREFERENCED_PARAMETER(FileAttributes);
+    UNREFERENCED_PARAMETER(ShareAccess);
+
+    DokanFileInfo->Context = 0;
+
+    if (0 == ::_wcsicmp(FileName, L"\\System Volume Information") ||
+        0 == ::_wcsicmp(FileName, L"\\$RECYCLE.BIN"))
+    {
+        return STATUS_NO_SUCH_FILE;
+    }
+
+    std::uint32_t ErrorCode = 0;
+
+    // Only the opens of the existing files without modifications are allowed
+    // on the write-protected share.
+    if (g_WriteProtected &&
+        ((FILE_OPEN != CreateDisposition && FILE_OPEN_IF != CreateDisposition) ||
+        (MILE_CIRNO_ACCESS_MODIFY & DesiredAccess) ||
+        (FILE_DELETE_ON_CLOSE & CreateOptions)))
+    {
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    }
+
+    // The path is only resolved once for the handle, and the file ID walked
+    // for probing the exact names is reused if the whole path exists.
+    std::uint32_t ProbedFileId = MILE_CIRNO_NOFID;
+    Mile::Cirno::Qid ProbedUniqueId = {};
+    std::filesystem::path RelativeFilePath = ::ResolveCaseInsensitivePath(
+        std::filesystem::path(&FileName[1]),
+        ProbedFileId,
+        ProbedUniqueId);
+    auto ProbedFileIdCleanupHandler = Mile::ScopeExitTaskHandler([&]()
+    {
+        if (MILE_CIRNO_NOFID != ProbedFileId)
+        {
+            ::SimpleClunk(ProbedFileId);
+        }
+    });
+
+    if (!g_WriteProtected &&
+        FILE_DIRECTORY_FILE == (FILE_DIRECTORY_FILE & CreateOptions))
+    {
+        if (FILE_CREATE == CreateDisposition ||
+            FILE_OPEN_IF == CreateDisposition)
+        {
+            ErrorCode = ::SimpleMakeDirectory(
+                g_RootDirectoryFileId,
+                RelativeFilePath);
+            if (0 != ErrorCode)
+            {
+                return ::ToNtStatus(ErrorCode);
+            }
+            ::UpdateCaseInsensitiveIndex(RelativeFilePath, true);
+            CreateDisposition = FILE_OPEN;
+        }
+    }
+
+    std::uint32_t ConvertedFileMode = 0;
+    std::uint32_t ConvertedFlags =
+        MileCirnoLinuxOpenCreateFlagLargeFile |
+        MileCirnoLinuxOpenCreateFlagCloseOnExecute;
+
+    bool Readable = false;
+    bool Writable = false;
+    if (GENERIC_ALL == DesiredAccess)
+    {
+        DesiredAccess = FILE_ALL_ACCESS;
+    }
+    if (MILE_CIRNO_ACCESS_READ & DesiredAccess)
+    {
+        Readable = true;
+        ConvertedFileMode |= APTX_IRUSR | APTX_IRGRP | APTX_IROTH;
+    }
+    if (MILE_CIRNO_ACCESS_WRITE & DesiredAccess)
+    {
+        Writable = true;
+        ConvertedFileMode |= APTX_IWUSR | APTX_IWGRP | APTX_IWOTH;
+    }
+    if (MILE_CIRNO_ACCESS_EXECUTE & DesiredAccess)
+    {
+        ConvertedFileMode |= APTX_IXUSR | APTX_IXGRP | APTX_IXOTH;
+    }
+    if (Readable && !Writable)
+    {
+        ConvertedFlags |= MileCirnoLinuxOpenCreateFlagReadOnly;
+    }
+    else if (!Readable && Writable)
+    {
+        ConvertedFlags |= MileCirnoLinuxOpenCreateFlagWriteOnly;
+    }
+    else if (Readable && Writable)
+    {
+        ConvertedFlags |= MileCirnoLinuxOpenCreateFlagReadWrite;
+    }
+    if (!(FILE_SYNCHRONOUS_IO_ALERT & CreateOptions) &&
+        !(FILE_SYNCHRONOUS_IO_NONALERT & CreateOptions))
+    {
+        ConvertedFlags |= MileCirnoLinuxOpenCreateFlagNonBlock;
+    }
+    if (FILE_NO_INTERMEDIATE_BUFFERING & CreateOptions)
+    {
+        ConvertedFlags |= MileCirnoLinuxOpenCreateFlagDirect;
+    }
+    if (g_WriteProtected)
+    {
+        ConvertedFlags &= ~MileCirnoLinuxOpenCreateFlagWriteOnly;
+        ConvertedFlags &= ~MileCirnoLinuxOpenCreateFlagReadWrite;
+        ConvertedFlags |= MileCirnoLinuxOpenCreateFlagReadOnly;
+    }
+
+    NTSTATUS Status = STATUS_SUCCESS;
+
+    FileContext* Context = new (std::nothrow) FileContext();
+    if (!Context)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    auto ContextCleanupHandler = Mile::ScopeExitTaskHandler([&]()
+    {
+        if (Context)
+        {
+            if (MILE_CIRNO_NOFID != Context->FileId)
+            {
+                ::SimpleClunk(Context->FileId);
+            }
+            delete Context;
+        }
+    });
+    Context->RelativeFilePath = RelativeFilePath;
+
+    // Open or create the file with a single Twopen if the server supports
+    // it. The directory opens and the metadata-only opens still use the walk
+    // because their Tlopen is deferred, and the walk path is also used if
+    // Twopen is failed for any other reason or the file is already walked
+    // when resolving the path.
+    bool Creating =
+        FILE_SUPERSEDE == CreateDisposition ||
+        FILE_CREATE == CreateDisposition ||
+        FILE_OPEN_IF == CreateDisposition ||
+        FILE_OVERWRITE_IF == CreateDisposition;
+    bool Truncating =
+        FILE_SUPERSEDE == CreateDisposition ||
+        FILE_OVERWRITE == CreateDisposition ||
+        FILE_OVERWRITE_IF == CreateDisposition;
+    // The process which creates an empty file or truncates a file for
+    // writing may be copying another file into it, which is opened only for
+    // reading by the same process.
+    bool CreatedEmpty = false;
+    auto CopyHandler = Mile::ScopeExitTaskHandler([&]()
+    {
+        if (Context ||
+            !DokanFileInfo->Context ||
+            DokanFileInfo->IsDirectory)
+        {
+            return;
+        }
+        FileContext* OpenedContext =
+            reinterpret_cast<FileContext*>(DokanFileInfo->Context);
+        if (Writable && CreatedEmpty)
+        {
+            ::RegisterCopyDestination(DokanFileInfo->ProcessId, OpenedContext);
+        }
+        else if (Readable && !Writable)
+        {
+            ::RegisterCopySource(DokanFileInfo->ProcessId, OpenedContext);
+        }
+    });
+    if (g_WindowsOpenSupported &&
+        !g_Immutable &&
+        MILE_CIRNO_NOFID == ProbedFileId &&
+        !(FILE_DIRECTORY_FILE & CreateOptions) &&
+        std::distance(RelativeFilePath.begin(), RelativeFilePath.end()) <=
+        static_cast<std::ptrdiff_t>(g_MaximumWalkElements) &&
+        (Creating ||
+        Truncating ||
+        (MILE_CIRNO_ACCESS_DATA & DesiredAccess)))
+    {
+        std::uint32_t Flags = ConvertedFlags;
+        if (Creating)
+        {
+            Flags |= MileCirnoLinuxOpenCreateFlagCreate;
+        }
+        if (FILE_CREATE == CreateDisposition)
+        {
+            Flags |= MileCirnoLinuxOpenCreateFlagExclusive;
+        }
+        if (Truncating)
+        {
+            Flags |= MileCirnoLinuxOpenCreateFlagTruncate;
+        }
+        std::uint32_t WindowsFlags = MileCirnoWindowsOpenFlagNone;
+        if (FILE_NON_DIRECTORY_FILE & CreateOptions)
+        {
+            WindowsFlags |= MileCirnoWindowsOpenFlagNonDirectoryFile;
+        }
+        if (DELETE & DesiredAccess)
+        {
+            WindowsFlags |= MileCirnoWindowsOpenFlagDeleteAccess;
+        }
+        std::uint8_t OpenStatus = MileCirnoWindowsOpenStatusStopped;
+        ErrorCode = ::SimpleWindowsOpen(
+            Context,
+            RelativeFilePath,
+            Flags,
+            WindowsFlags,
+            ConvertedFileMode,
+            OpenStatus);
+        if (0 == ErrorCode)
+        {
+            if (MileCirnoWindowsOpenStatusOpened == OpenStatus ||
+                MileCirnoWindowsOpenStatusCreated == OpenStatus)
+            {
+                if (MileCirnoQidTypeDirectory & Context->UniqueId.Type)
+                {
+                    DokanFileInfo->IsDirectory = TRUE;
+                }
+                if (MileCirnoWindowsOpenStatusCreated == OpenStatus)
+                {
+                    ::UpdateCaseInsensitiveIndex(RelativeFilePath, true);
+                    CreatedEmpty = true;
+                }
+                else if (Truncating)
+                {
+                    ::InvalidateCachedAttributes(Context->UniqueId.Path);
+                    CreatedEmpty = true;
+                }
+                DokanFileInfo->Context = reinterpret_cast<ULONG64>(Context);
+                Context = nullptr;
+                return STATUS_SUCCESS;
+            }
+            else if (MileCirnoWindowsOpenStatusParentNotFound == OpenStatus)
+            {
+                return STATUS_OBJECT_PATH_NOT_FOUND;
+            }
+            else if (MileCirnoWindowsOpenStatusNotFound == OpenStatus)
+            {
+                // Forget the stale name if it is resolved from the index,
+                // and let the walk path decide the result.
+                ::UpdateCaseInsensitiveIndex(RelativeFilePath, false);
+            }
+        }
+        else if (APTX_EEXIST == ErrorCode &&
+            FILE_CREATE == CreateDisposition)
+        {
+            return STATUS_OBJECT_NAME_COLLISION;
+        }
+        ErrorCode = 0;
+    }
+
+    Context->UniqueId = g_RootDirectoryUniqueId;
+    std::optional<Mile::Cirno::Qid> CachedUniqueId;
+    if (g_Immutable &&
+        ::LookupImmutableUniqueId(RelativeFilePath, CachedUniqueId))
+    {
+        // Defer the walk until the walked file ID is needed.
+        if (CachedUniqueId)
+        {
+            Context->UniqueId = CachedUniqueId.value();
+        }
+        else
+        {
+            ErrorCode = APTX_ENOENT;
+        }
+    }
+    else
+    {
+        if (MILE_CIRNO_NOFID != ProbedFileId)
+        {
+            Context->FileId = ProbedFileId;
+            Context->UniqueId = ProbedUniqueId;
+            ProbedFileId = MILE_CIRNO_NOFID;
+        }
+        else
+        {
+            ErrorCode = ::SimpleWalk(
+                Context->FileId,
+                Context->UniqueId,
+                g_RootDirectoryFileId,
+                RelativeFilePath);
+        }
+        if (g_Immutable && 0 == ErrorCode)
+        {
+            ::InsertImmutableCacheEntry(
+                g_ImmutableUniqueIds,
+                RelativeFilePath.wstring(),
+                std::optional<Mile::Cirno::Qid>(Context->UniqueId));
+        }
+        else if (g_Immutable && APTX_ENOENT == ErrorCode)
+        {
+            ::InsertImmutableCacheEntry(
+                g_ImmutableUniqueIds,
+                RelativeFilePath.wstring(),
+                std::optional<Mile::Cirno::Qid>());
+        }
+    }
+    if (0 != ErrorCode)
     {
         Status = ::ToNtStatus(ErrorCode);
+        if (APTX_ENOENT == ErrorCode)
+        {
+            // Forget the stale name if it is resolved from the index.
+            ::UpdateCaseInsensitiveIndex(RelativeFilePath, false);
+        }
+    }
+    if (STATUS_SUCCESS != Status)
+    {
+        Status = STATUS_SUCCESS;
+
+        if (DokanFileInfo->IsDirectory)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        if (FILE_OPEN == CreateDisposition ||
+            FILE_OVERWRITE == CreateDisposition)
+        {
+            return STATUS_OBJECT_NAME_NOT_FOUND;
+        }
+
+        // These are available dispositions:
+        // - FILE_SUPERSEDE
+        // - FILE_CREATE
+        // - FILE_OPEN_IF
+        // - FILE_OVERWRITE_IF
+        // According to the documentation, these dispositions will create the
+        // file if the file does not exist.
+
+        if (g_WriteProtected)
+        {
+            return STATUS_MEDIA_WRITE_PROTECTED;
+        }
+
+        // The file ID returned from SimpleLinuxCreate is already opened by
+        // Tlcreate, so it can be used as the context directly.
+        Context->OpenFlags = ConvertedFlags | MileCirnoLinuxOpenCreateFlagCreate;
+        ErrorCode = ::SimpleLinuxCreate(
+            Context->FileId,
+            g_RootDirectoryFileId,
+            RelativeFilePath,
+            Context->OpenFlags,
+            ConvertedFileMode);
+        if (0 != ErrorCode)
+        {
+            return ::ToNtStatus(ErrorCode);
+        }
+        Context->Opened = true;
+        Context->OpenedFileId = Context->FileId;
+        ::UpdateCaseInsensitiveIndex(RelativeFilePath, true);
+        CreatedEmpty = true;
+
+        DokanFileInfo->Context = reinterpret_cast<ULONG64>(Context);
+        Context = nullptr;
+        return STATUS_SUCCESS;
+    }
+
+    if (FILE_CREATE == CreateDisposition)
+    {
+        Status = STATUS_OBJECT_NAME_COLLISION;
+    }
+
+    // These are available dispositions:
+    // - FILE_SUPERSEDE
+    // - FILE_OPEN
+    // - FILE_OPEN_IF
+    // - FILE_OVERWRITE
+    // - FILE_OVERWRITE_IF
+    // According to the documentation, these dispositions will only open the
+    // file if the file exists and the dispositions is FILE_OPEN or
+    // FILE_OPEN_IF, or will overwrite the file if the file exists.
+
+    if (STATUS_SUCCESS == Status)
+    {
+        if (MileCirnoQidTypeDirectory & Context->UniqueId.Type)
+        {
+            DokanFileInfo->IsDirectory = TRUE;
+            if (FILE_NON_DIRECTORY_FILE & CreateOptions)
+            {
+                Status = STATUS_OBJECT_NAME_NOT_FOUND;
+            }
+
+            // Directories can only be opened as read-only on POSIX systems,
+            // and the opened file ID is only used for reading directories.
+            ConvertedFlags &= ~MileCirnoLinuxOpenCreateFlagWriteOnly;
+            ConvertedFlags &= ~MileCirnoLinuxOpenCreateFlagReadWrite;
+            ConvertedFlags |= MileCirnoLinuxOpenCreateFlagReadOnly;
+        }
+    }
+
+    if (STATUS_SUCCESS == Status)
+    {
+        bool Truncate = false;
+        if (!DokanFileInfo->IsDirectory &&
+            (FILE_SUPERSEDE == CreateDisposition ||
+            FILE_OVERWRITE == CreateDisposition ||
+            FILE_OVERWRITE_IF == CreateDisposition))
+        {
+            Truncate = true;
+            ConvertedFlags |= MileCirnoLinuxOpenCreateFlagTruncate;
+        }
+        Context->OpenFlags = ConvertedFlags;
+
+        // Defer Tlopen until the first data access for directories and the
+        // metadata-only opens, because the walked file ID is enough for
+        // querying and setting attributes. Open the file immediately for the
+        // data access to keep reporting the access errors from CreateFile,
+        // except in the immutable mode because the data may be cached.
+        std::uint32_t InitialReadSize = 0;
+        if (!Truncate &&
+            MileCirnoQidTypeFile == Context->UniqueId.Type &&
+            ((GENERIC_READ | FILE_READ_DATA) & DesiredAccess) &&
+            !((GENERIC_WRITE | FILE_WRITE_DATA | FILE_APPEND_DATA) &
+            DesiredAccess))
+        {
+            InitialReadSize = ::GetInitialReadSize(Context);
+        }
+        if (Truncate ||
+            InitialReadSize ||
+            (!g_Immutable &&
+            !DokanFileInfo->IsDirectory &&
+            (MILE_CIRNO_ACCESS_DATA & DesiredAccess)))
+        {
+            ErrorCode = ::EnsureFileOpened(Context, InitialReadSize);
+            if (0 != ErrorCode)
+            {
+                Status = ::ToNtStatus(ErrorCode);
+            }
+            else if (Truncate)
+            {
+                ::InvalidateCachedAttributes(Context->UniqueId.Path);
+                CreatedEmpty = true;
+            }
+        }
+    }
+
+    if (STATUS_SUCCESS == Status)
+    {
+        DokanFileInfo->Context = reinterpret_cast<ULONG64>(Context);
+        Context = nullptr;
+    }
+
+    return Status;
+}
+
+// Remove the file with Tremove on the file ID of the handle, which is only
+// used if the server does not support Tunlinkat.
+std::uint32_t SimpleRemove(
+    FileContext* Context,
+    std::filesystem::path const& RelativeFilePath)
+{
+    std::uint32_t FileId = MILE_CIRNO_NOFID;
+    bool Borrowed = false;
+    {
+        std::lock_guard<std::mutex> Guard(Context->Mutex);
+        FileId = Context->FileId;
+        Borrowed = MILE_CIRNO_NOFID == FileId ||
+            (Context->Shared && FileId == Context->OpenedFileId);
+    }
+
+    // Tremove clunks the file ID, so remove the file through a new file ID
+    // if the file ID is shared with other handles or not walked yet. The new
+    // file ID is walked from the root directory because walking from the
+    // opened file ID is not allowed.
+    std::uint32_t RemoveFileId = FileId;
+    if (Borrowed)
+    {
+        RemoveFileId = MILE_CIRNO_NOFID;
+        std::uint32_t ErrorCode = ::SimpleWalk(
+            RemoveFileId,
+            g_RootDirectoryFileId,
+            RelativeFilePath);
+        if (0 != ErrorCode)
+        {
+            return ErrorCode;
+        }
+    }
+
+    Mile::Cirno::RemoveRequest Request = {};
+    Request.FileId = RemoveFileId;
+    std::uint32_t ErrorCode = g_Instance->Remove(Request);
+
+    // The file ID is clunked even if Tremove fails, so it should not be
+    // clunked again when the handle is closed.
+    g_Instance->FreeFileId(RemoveFileId);
+    if (!Borrowed)
+    {
+        std::lock_guard<std::mutex> Guard(Context->Mutex);
+        Context->FileId = MILE_CIRNO_NOFID;
+    }
+
+    return ErrorCode;
+}
+
+void DOKAN_CALLBACK MileCirnoCleanup(
+    _In_ LPCWSTR FileName,
+    _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
+{
+    UNREFERENCED_PARAMETER(FileName);
+
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
+    {
+        return;
+    }
+
+    if (DokanFileInfo->DeletePending)
+    {
+        std::filesystem::path RelativeFilePath = ::GetRelativeFilePath(
+            Context);
+
+        // The server decides whether the directory is empty again, and the
+        // file ID of the handle is kept until the handle is closed.
+        std::uint32_t ErrorCode = APTX_LINUX_EOPNOTSUPP;
+        if (g_UnlinkAtSupported)
+        {
+            ErrorCode = ::SimpleUnlinkAt(
+                RelativeFilePath,
+                MileCirnoQidTypeDirectory & Context->UniqueId.Type);
+            if (APTX_LINUX_ENOSYS == ErrorCode ||
+                APTX_LINUX_EOPNOTSUPP == ErrorCode)
+            {
+                g_UnlinkAtSupported = false;
+                ErrorCode = APTX_LINUX_EOPNOTSUPP;
+            }
+        }
+        if (APTX_LINUX_EOPNOTSUPP == ErrorCode)
+        {
+            ErrorCode = ::SimpleRemove(Context, RelativeFilePath);
+        }
+
+        // The caches are dropped as well if the file is already deleted by
+        // others.
+        if (0 == ErrorCode || APTX_ENOENT == ErrorCode)
+        {
+            ::InvalidateCachedAttributes(Context->UniqueId.Path);
+            ::InvalidateCachedWalkFileIds(RelativeFilePath);
+            ::UpdateCaseInsensitiveIndex(RelativeFilePath, false);
+        }
+    }
+}
+
+void DOKAN_CALLBACK MileCirnoCloseFile(
+    _In_ LPCWSTR FileName,
+    _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
+{
+    UNREFERENCED_PARAMETER(FileName);
+
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
+    {
+        return;
+    }
+
+    ::ReleaseFileContext(Context);
+    delete Context;
+}
+
+std::uint32_t QueryFileAttributes(
+    FileContext* Context,
+    Mile::Cirno::GetAttributesResponse& Response)
+{
+    {
+        std::lock_guard<std::mutex> Guard(Context->Mutex);
+        if (Context->InitialAttributesValid)
+        {
+            Context->InitialAttributesValid = false;
+            Response = Context->InitialAttributes;
+            return 0;
+        }
+    }
+
+    if (g_Immutable &&
+        ::LookupImmutableAttributes(Context->UniqueId.Path, Response))
+    {
+        return 0;
+    }
+
+    std::uint32_t ErrorCode = ::EnsureFileWalked(Context);
+    if (0 != ErrorCode)
+    {
+        return ErrorCode;
+    }
+
+    ErrorCode = ::SimpleGetAttributes(Context->FileId, Response);
+    if (0 != ErrorCode)
+    {
+        return ErrorCode;
+    }
+    if (g_Immutable)
+    {
+        ::InsertImmutableCacheEntry(
+            g_ImmutableAttributes,
+            Context->UniqueId.Path,
+            Response);
+    }
+
+    return 0;
+}
+
+// The caller should hold g_PersistentCacheSegmentsMutex.
+void EvictPersistentCacheFiles()
+{
+    if (g_PersistentCacheUsage <= g_PersistentCacheSize)
+    {
+        return;
+    }
+
+    std::vector<std::map<std::wstring, PersistentCacheFile>::iterator>
+        Candidates;
+    for (auto Iterator = g_PersistentCacheFiles.begin();
+        g_PersistentCacheFiles.end() != Iterator;
+        ++Iterator)
+    {
+        Candidates.push_back(Iterator);
+    }
+    std::sort(
+        Candidates.begin(),
+        Candidates.end(),
+        [](auto const& Left, auto const& Right) -> bool
+    {
+        return Left->second.LastUsed < Right->second.LastUsed;
+    });
+
+    for (auto const& Candidate : Candidates)
+    {
+        if (g_PersistentCacheUsage <= g_PersistentCacheSize)
+        {
+            break;
+        }
+        if (!::DeleteFileW(Candidate->first.c_str()) &&
+            ERROR_FILE_NOT_FOUND != ::GetLastError())
+        {
+            continue;
+        }
+        g_PersistentCacheUsage -= Candidate->second.Size;
+        g_PersistentCacheFiles.erase(Candidate);
+    }
+}
+
+// The caller should hold g_PersistentCacheSegmentsMutex.
+void TouchPersistentCacheFile(
+    std::filesystem::path const& FilePath,
+    std::uint64_t const& Size)
+{
+    PersistentCacheFile& Current = g_PersistentCacheFiles[FilePath.wstring()];
+    g_PersistentCacheUsage -= Current.Size;
+    g_PersistentCacheUsage += Size;
+    Current.Size = Size;
+    Current.LastUsed = ++g_PersistentCacheSequence;
+    ::EvictPersistentCacheFiles();
+}
+
+// Load the segment files left by the previous mounts, which are ordered by
+// the last write time.
+void LoadPersistentCacheFiles()
+{
+    struct LoadedFile
+    {
+        std::filesystem::path Path;
+        std::uint64_t Size = 0;
+        std::filesystem::file_time_type LastWriteTime;
+    };
+    std::vector<LoadedFile> Files;
+
+    std::error_code ErrorCode;
+    for (std::filesystem::directory_entry const& Entry :
+        std::filesystem::directory_iterator(g_CacheDirectory, ErrorCode))
+    {
+        if (0 != ::_wcsicmp(
+            Entry.path().extension().wstring().c_str(),
+            L".MileCirnoCache"))
+        {
+            continue;
+        }
+        LoadedFile Current;
+        Current.Path = Entry.path();
+        Current.Size = Entry.file_size(ErrorCode);
+        if (ErrorCode)
+        {
+            continue;
+        }
+        Current.LastWriteTime = Entry.last_write_time(ErrorCode);
+        if (ErrorCode)
+        {
+            continue;
+        }
+        Files.push_back(std::move(Current));
+    }
+    std::sort(
+        Files.begin(),
+        Files.end(),
+        [](LoadedFile const& Left, LoadedFile const& Right) -> bool
+    {
+        return Left.LastWriteTime < Right.LastWriteTime;
+    });
+
+    std::lock_guard<std::mutex> Guard(g_PersistentCacheSegmentsMutex);
+    for (LoadedFile const& File : Files)
+    {
+        ::TouchPersistentCacheFile(File.Path, File.Size);
+    }
+}
+
+// Get the persistent cache segment for the regular file, which is validated
+// by the current attributes of the file once for each handle.
+std::shared_ptr<Mile::Cirno::PersistentCacheSegment> AcquirePersistentCacheSegment(
+    FileContext* Context)
+{
+    if (g_CacheDirectory.empty() ||
+        MileCirnoQidTypeFile != Context->UniqueId.Type)
+    {
+        return nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> Guard(Context->Mutex);
+        if (Context->CacheSegmentAcquired)
+        {
+            return Context->CacheSegment;
+        }
+    }
+
+    std::shared_ptr<Mile::Cirno::PersistentCacheSegment> Segment;
+
+    Mile::Cirno::GetAttributesResponse Response = {};
+    if (0 == ::QueryFileAttributes(Context, Response))
+    {
+        Mile::Cirno::PersistentCacheIdentity Identity = {};
+        Identity.VolumeSerialNumber = g_VolumeSerialNumber;
+        Identity.Version = Context->UniqueId.Version;
+        Identity.Path = Context->UniqueId.Path;
+        Identity.FileSize = Response.FileSize;
+        Identity.LastWriteTimeSeconds = Response.LastWriteTimeSeconds;
+        Identity.LastWriteTimeNanoseconds = Response.LastWriteTimeNanoseconds;
+
+        std::lock_guard<std::mutex> Guard(g_PersistentCacheSegmentsMutex);
+        auto Iterator = g_PersistentCacheSegments.find(Identity.Path);
+        if (g_PersistentCacheSegments.end() != Iterator)
+        {
+            Segment = Iterator->second.lock();
+        }
+        if (Segment && !Segment->Prepare(Identity))
+        {
+            Segment = nullptr;
+        }
+        if (!Segment)
+        {
+            std::filesystem::path FilePath =
+                g_CacheDirectory / Mile::FormatString(
+                    "%08X-%016llX.MileCirnoCache",
+                    Identity.VolumeSerialNumber,
+                    Identity.Path);
+            Segment.reset(Mile::Cirno::PersistentCacheSegment::Open(
+                FilePath,
+                Identity));
+            if (Segment)
+            {
+                ::TouchPersistentCacheFile(
+                    FilePath,
+                    Mile::Cirno::PersistentCacheSegment::GetSegmentSize(
+                        Identity.FileSize));
+            }
+        }
+        if (Segment)
+        {
+            if (g_PersistentCacheSegments.size() >=
+                MaximumPersistentCacheSegments)
+            {
+                std::erase_if(g_PersistentCacheSegments, [](
+                    auto const& Item) -> bool
+                {
+                    return Item.second.expired();
+                });
+            }
+            g_PersistentCacheSegments.insert_or_assign(Identity.Path, Segment);
+        }
+    }
+
+    std::lock_guard<std::mutex> Guard(Context->Mutex);
+    if (!Context->CacheSegmentAcquired)
+    {
+        Context->CacheSegmentAcquired = true;
+        Context->CacheSegment = Segment;
+    }
+    return Context->CacheSegment;
+}
+
+// Discard the persistent cache of the file modified by ourselves.
+void InvalidatePersistentCacheSegment(
+    FileContext* Context)
+{
+    if (g_CacheDirectory.empty())
+    {
+        return;
+    }
+
+    std::shared_ptr<Mile::Cirno::PersistentCacheSegment> Segment;
+    {
+        std::lock_guard<std::mutex> Guard(g_PersistentCacheSegmentsMutex);
+        auto Iterator = g_PersistentCacheSegments.find(Context->UniqueId.Path);
+        if (g_PersistentCacheSegments.end() != Iterator)
+        {
+            Segment = Iterator->second.lock();
+        }
+    }
+    if (Segment)
+    {
+        Segment->Invalidate();
+    }
+}
+
+std::uint32_t SimpleRead(
+    std::uint32_t const& FileId,
+    std::uint64_t const& Offset,
+    void* Buffer,
+    std::uint32_t const& BufferLength,
+    std::uint32_t& ReadLength)
+{
+    ReadLength = 0;
+    std::uint32_t UnproceededSize = BufferLength;
+
+    while (UnproceededSize)
+    {
+        std::uint32_t NumberOfBytesToRead = g_MaximumMessageSize;
+        NumberOfBytesToRead -= Mile::Cirno::ReadResponseHeaderSize;
+        if (UnproceededSize < NumberOfBytesToRead)
+        {
+            NumberOfBytesToRead = UnproceededSize;
+        }
+        std::uint32_t CurrentProceededSize = 0;
+        std::uint32_t ErrorCode = g_Instance->Read(
+            FileId,
+            Offset + ReadLength,
+            static_cast<std::uint8_t*>(Buffer) + ReadLength,
+            NumberOfBytesToRead,
+            CurrentProceededSize);
+        if (0 != ErrorCode)
+        {
+            return ErrorCode;
+        }
+        if (!CurrentProceededSize)
+        {
+            break;
+        }
+        ReadLength += CurrentProceededSize;
+        UnproceededSize -= CurrentProceededSize;
+    }
+
+    return 0;
+}
+
+// Read the file through the block cache of the immutable mode and the
+// persistent cache, and the file is only opened if the blocks are not cached.
+std::uint32_t ReadCachedFile(
+    FileContext* Context,
+    Mile::Cirno::PersistentCacheSegment* Segment,
+    std::uint64_t const& Offset,
+    void* Buffer,
+    std::uint32_t const& BufferLength,
+    std::uint32_t& ReadLength)
+{
+    ReadLength = 0;
+
+    while (ReadLength < BufferLength)
+    {
+        std::uint64_t CurrentOffset = Offset + ReadLength;
+        std::uint64_t BlockIndex = CurrentOffset / CachedFileBlockSize;
+        std::size_t BlockOffset = CurrentOffset % CachedFileBlockSize;
+        std::uint8_t* CurrentBuffer =
+            static_cast<std::uint8_t*>(Buffer) + ReadLength;
+        std::size_t CurrentBufferLength = BufferLength - ReadLength;
+
+        std::size_t CurrentReadLength = 0;
+        std::size_t BlockSize = 0;
+        if (!g_Immutable || !::ReadImmutableFileBlock(
+            Context->UniqueId.Path,
+            BlockIndex,
+            BlockOffset,
+            CurrentBuffer,
+            CurrentBufferLength,
+            CurrentReadLength,
+            BlockSize))
+        {
+            std::vector<std::uint8_t> Block(CachedFileBlockSize);
+            if (!Segment || !Segment->ReadBlock(
+                BlockIndex,
+                Block.data(),
+                BlockSize))
+            {
+                std::uint32_t ErrorCode = ::EnsureFileOpened(Context);
+                if (0 != ErrorCode)
+                {
+                    return ErrorCode;
+                }
+
+                std::uint32_t BlockReadLength = 0;
+                ErrorCode = ::SimpleRead(
+                    Context->OpenedFileId,
+                    BlockIndex * CachedFileBlockSize,
+                    Block.data(),
+                    static_cast<std::uint32_t>(Block.size()),
+                    BlockReadLength);
+                if (0 != ErrorCode)
+                {
+                    return ErrorCode;
+                }
+                BlockSize = BlockReadLength;
+
+                if (Segment)
+                {
+                    Segment->WriteBlock(BlockIndex, Block.data(), BlockSize);
+                }
+            }
+            Block.resize(BlockSize);
+
+            if (BlockOffset < BlockSize)
+            {
+                CurrentReadLength = std::min(
+                    BlockSize - BlockOffset,
+                    CurrentBufferLength);
+                std::memcpy(
+                    CurrentBuffer,
+                    &Block[BlockOffset],
+                    CurrentReadLength);
+            }
+            if (g_Immutable)
+            {
+                ::InsertImmutableFileBlock(
+                    Context->UniqueId.Path,
+                    BlockIndex,
+                    std::move(Block));
+            }
+        }
+
+        ReadLength += static_cast<std::uint32_t>(CurrentReadLength);
+        if (BlockSize < CachedFileBlockSize &&
+            BlockOffset + CurrentReadLength >= BlockSize)
+        {
+            // Reached the end of the file.
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// Get the file ranges of the sections from the headers of the PE image, and
+// returns false if the content is not a PE image.
+bool GetImageSectionRanges(
+    std::vector<std::uint8_t> const& Content,
+    std::vector<std::pair<std::uint64_t, std::uint64_t>>& Ranges)
+{
+    IMAGE_DOS_HEADER DosHeader = {};
+    if (Content.size() < sizeof(DosHeader))
+    {
+        return false;
+    }
+    std::memcpy(&DosHeader, Content.data(), sizeof(DosHeader));
+    if (IMAGE_DOS_SIGNATURE != DosHeader.e_magic || DosHeader.e_lfanew < 0)
+    {
+        return false;
+    }
+
+    std::size_t Offset = static_cast<std::size_t>(DosHeader.e_lfanew);
+    DWORD Signature = 0;
+    IMAGE_FILE_HEADER FileHeader = {};
+    if (Offset + sizeof(Signature) + sizeof(FileHeader) > Content.size())
+    {
+        return false;
+    }
+    std::memcpy(&Signature, &Content[Offset], sizeof(Signature));
+    if (IMAGE_NT_SIGNATURE != Signature)
+    {
+        return false;
+    }
+    Offset += sizeof(Signature);
+    std::memcpy(&FileHeader, &Content[Offset], sizeof(FileHeader));
+    Offset += sizeof(FileHeader) + FileHeader.SizeOfOptionalHeader;
+
+    for (WORD i = 0; i < FileHeader.NumberOfSections; ++i)
+    {
+        IMAGE_SECTION_HEADER SectionHeader = {};
+        if (Offset + sizeof(SectionHeader) > Content.size())
+        {
+            break;
+        }
+        std::memcpy(&SectionHeader, &Content[Offset], sizeof(SectionHeader));
+        Offset += sizeof(SectionHeader);
+        if (SectionHeader.PointerToRawData && SectionHeader.SizeOfRawData)
+        {
+            Ranges.emplace_back(
+                SectionHeader.PointerToRawData,
+                SectionHeader.SizeOfRawData);
+        }
     }
-    if (STATUS_SUCCESS != Status)
+
+    return !Ranges.empty();
+}
+
+// Fetch the uncached blocks of the sections with the batches of pipelined
+// Tread, because the loader faults in the sections in scattered order and
+// each fault will be a synchronous round trip otherwise.
+void RunImagePrefetch(
+    ImagePrefetchJob* Job)
+{
+    auto JobCleanupHandler = Mile::ScopeExitTaskHandler([&]()
     {
-        Status = STATUS_SUCCESS;
+        ::ReleaseFileContext(&Job->Context);
+        delete Job;
+    });
 
-        if (DokanFileInfo->IsDirectory)
+    std::uint64_t UniqueIdPath = Job->Context.UniqueId.Path;
+
+    std::vector<std::uint64_t> Blocks;
+    std::vector<std::uint8_t> Probe(CachedFileBlockSize);
+    for (std::uint64_t const& BlockIndex : Job->Blocks)
+    {
+        std::size_t ProbeLength = 0;
+        std::size_t BlockSize = 0;
+        if (g_Immutable && ::ReadImmutableFileBlock(
+            UniqueIdPath,
+            BlockIndex,
+            0,
+            Probe.data(),
+            1,
+            ProbeLength,
+            BlockSize))
         {
-            return STATUS_INVALID_PARAMETER;
+            continue;
+        }
+        if (Job->Segment && Job->Segment->ReadBlock(
+            BlockIndex,
+            Probe.data(),
+            BlockSize))
+        {
+            continue;
         }
+        Blocks.push_back(BlockIndex);
+    }
+    if (Blocks.empty())
+    {
+        return;
+    }
 
-        if (FILE_OPEN == CreateDisposition ||
-            FILE_OVERWRITE == CreateDisposition)
+    if (0 != ::EnsureFileOpened(&Job->Context))
+    {
+        return;
+    }
+
+    std::uint32_t ChunkSize = g_MaximumMessageSize;
+    ChunkSize -= Mile::Cirno::ReadResponseHeaderSize;
+    if (ChunkSize > CachedFileBlockSize)
+    {
+        ChunkSize = static_cast<std::uint32_t>(CachedFileBlockSize);
+    }
+    std::size_t ChunksPerBlock =
+        (CachedFileBlockSize + ChunkSize - 1) / ChunkSize;
+
+    for (std::size_t Start = 0;
+        Start < Blocks.size();
+        Start += ImagePrefetchBatchSize)
+    {
+        if (g_PrefetchStopping)
         {
-            return STATUS_OBJECT_NAME_NOT_FOUND;
+            return;
         }
 
-        // These are available dispositions:
-        // - FILE_SUPERSEDE
-        // - FILE_CREATE
-        // - FILE_OPEN_IF
-        // - FILE_OVERWRITE_IF
-        // According to the documentation, these dispositions will create the
-        // file if the file does not exist.
+        std::size_t Count = std::min(
+            ImagePrefetchBatchSize,
+            Blocks.size() - Start);
 
-        ErrorCode = ::SimpleLinuxCreate(
-            g_RootDirectoryFileId,
-            RelativeFilePath,
-            ConvertedFlags | MileCirnoLinuxOpenCreateFlagCreate,
-            ConvertedFileMode);
-        if (0 != ErrorCode)
+        std::vector<Mile::Cirno::PipelinedRequest> Requests;
+        for (std::size_t i = Start; i < Start + Count; ++i)
         {
-            return ::ToNtStatus(ErrorCode);
+            for (std::size_t j = 0; j < ChunksPerBlock; ++j)
+            {
+                Mile::Cirno::ReadRequest Request = {};
+                Request.FileId = Job->Context.OpenedFileId;
+                Request.Offset = Blocks[i] * CachedFileBlockSize;
+                Request.Offset += j * ChunkSize;
+                Request.Count = static_cast<std::uint32_t>(std::min<std::size_t>(
+                    ChunkSize,
+                    CachedFileBlockSize - j * ChunkSize));
+                Mile::Cirno::PipelinedRequest& Current =
+                    Requests.emplace_back();
+                Current.RequestType = MileCirnoReadRequestMessage;
+                Current.ResponseType = MileCirnoReadResponseMessage;
+                Mile::Cirno::PushReadRequest(Current.RequestContent, Request);
+            }
         }
-        CreateDisposition = FILE_OPEN;
+        g_Instance->PipelinedRequestResponse(Requests);
 
-        ErrorCode = ::SimpleWalk(
-            FileId,
-            g_RootDirectoryFileId,
-            RelativeFilePath);
-        if (0 != ErrorCode)
+        for (std::size_t i = 0; i < Count; ++i)
         {
-            return ::ToNtStatus(ErrorCode);
+            std::vector<std::uint8_t> Block;
+            bool Failed = false;
+            for (std::size_t j = 0; j < ChunksPerBlock; ++j)
+            {
+                Mile::Cirno::PipelinedRequest& Current =
+                    Requests[i * ChunksPerBlock + j];
+                if (0 != Current.ErrorCode)
+                {
+                    Failed = true;
+                    break;
+                }
+                std::span<std::uint8_t> ResponseSpan =
+                    std::span<std::uint8_t>(Current.ResponseContent);
+                std::vector<std::uint8_t> Data =
+                    Mile::Cirno::PopReadResponse(ResponseSpan).Data;
+                Block.insert(Block.end(), Data.begin(), Data.end());
+                if (Data.size() < std::min<std::size_t>(
+                    ChunkSize,
+                    CachedFileBlockSize - j * ChunkSize))
+                {
+                    // Reached the end of the file.
+                    break;
+                }
+            }
+            if (Failed)
+            {
+                continue;
+            }
+
+            if (Job->Segment)
+            {
+                Job->Segment->WriteBlock(
+                    Blocks[Start + i],
+                    Block.data(),
+                    Block.size());
+            }
+            if (g_Immutable)
+            {
+                ::InsertImmutableFileBlock(
+                    UniqueIdPath,
+                    Blocks[Start + i],
+                    std::move(Block));
+            }
         }
     }
+}
 
-    if (FILE_CREATE == CreateDisposition)
+// Run the queued image prefetch jobs until the mount is stopping, and discard
+// the remaining ones then.
+void RunImagePrefetchWorker()
+{
+    for (;;)
     {
-        Status = STATUS_OBJECT_NAME_COLLISION;
+        ImagePrefetchJob* Job = nullptr;
+        {
+            std::unique_lock<std::mutex> Lock(g_PrefetchMutex);
+            g_PrefetchCondition.wait(Lock, []() -> bool
+            {
+                return g_PrefetchStopping || !g_ImagePrefetchJobs.empty();
+            });
+            if (g_PrefetchStopping)
+            {
+                break;
+            }
+            Job = g_ImagePrefetchJobs.front();
+            g_ImagePrefetchJobs.pop_front();
+        }
+        ::RunImagePrefetch(Job);
     }
 
-    // These are available dispositions:
-    // - FILE_SUPERSEDE
-    // - FILE_OPEN
-    // - FILE_OPEN_IF
-    // - FILE_OVERWRITE
-    // - FILE_OVERWRITE_IF
-    // According to the documentation, these dispositions will only open the
-    // file if the file exists and the dispositions is FILE_OPEN or
-    // FILE_OPEN_IF, or will overwrite the file if the file exists.
+    std::deque<ImagePrefetchJob*> Jobs;
+    {
+        std::lock_guard<std::mutex> Guard(g_PrefetchMutex);
+        Jobs.swap(g_ImagePrefetchJobs);
+    }
+    for (ImagePrefetchJob* Job : Jobs)
+    {
+        ::ReleaseFileContext(&Job->Context);
+        delete Job;
+    }
+}
 
-    if (STATUS_SUCCESS == Status)
+// Detect the PE image on the first read from the beginning of the file, and
+// queue the prefetch of its sections into the block caches.
+void StartImagePrefetch(
+    FileContext* Context,
+    std::shared_ptr<Mile::Cirno::PersistentCacheSegment> const& Segment)
+{
     {
-        if (FILE_SUPERSEDE == CreateDisposition ||
-            FILE_OVERWRITE == CreateDisposition ||
-            FILE_OVERWRITE_IF == CreateDisposition)
+        std::lock_guard<std::mutex> Guard(Context->Mutex);
+        if (Context->ImagePrefetchChecked)
         {
-            ConvertedFlags |= MileCirnoLinuxOpenCreateFlagTruncate;
+            return;
         }
+        Context->ImagePrefetchChecked = true;
+    }
 
-        Mile::Cirno::LinuxOpenRequest Request = {};
-        Request.FileId = FileId;
-        Request.Flags = ConvertedFlags;
-        Mile::Cirno::LinuxOpenResponse Response = {};
-        ErrorCode = g_Instance->LinuxOpen(Request, Response);
-        if (APTX_EROFS == ErrorCode || APTX_EACCES == ErrorCode)
+    // The first block is already cached by the previous read.
+    std::vector<std::uint8_t> Header(CachedFileBlockSize);
+    std::uint32_t HeaderLength = 0;
+    if (0 != ::ReadCachedFile(
+        Context,
+        Segment.get(),
+        0,
+        Header.data(),
+        static_cast<std::uint32_t>(Header.size()),
+        HeaderLength))
+    {
+        return;
+    }
+    Header.resize(HeaderLength);
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> Ranges;
+    if (!::GetImageSectionRanges(Header, Ranges))
+    {
+        return;
+    }
+
+    // The section headers are not trusted, so the ranges are clamped to the
+    // end of the file.
+    Mile::Cirno::GetAttributesResponse Attributes = {};
+    if (0 != ::QueryFileAttributes(Context, Attributes))
+    {
+        return;
+    }
+
+    ImagePrefetchJob* Job = new (std::nothrow) ImagePrefetchJob();
+    if (!Job)
+    {
+        return;
+    }
+    Job->Context.UniqueId = Context->UniqueId;
+    Job->Context.RelativeFilePath = ::GetRelativeFilePath(Context);
+    Job->Context.OpenFlags =
+        MileCirnoLinuxOpenCreateFlagLargeFile |
+        MileCirnoLinuxOpenCreateFlagCloseOnExecute |
+        MileCirnoLinuxOpenCreateFlagReadOnly;
+    Job->Segment = Segment;
+    for (auto const& Range : Ranges)
+    {
+        if (Range.first >= Attributes.FileSize)
         {
-            Request.Flags &= ~MileCirnoLinuxOpenCreateFlagWriteOnly;
-            Request.Flags &= ~MileCirnoLinuxOpenCreateFlagReadWrite;
-            Request.Flags |= MileCirnoLinuxOpenCreateFlagReadOnly;
-            ErrorCode = g_Instance->LinuxOpen(Request, Response);
+            continue;
         }
-        if (0 != ErrorCode)
+        std::uint64_t End = Range.first + std::min(
+            Range.second,
+            Attributes.FileSize - Range.first);
+        for (std::uint64_t BlockIndex = Range.first / CachedFileBlockSize;
+            BlockIndex <= (End - 1) / CachedFileBlockSize;
+            ++BlockIndex)
         {
-            Status = ::ToNtStatus(ErrorCode);
+            Job->Blocks.insert(BlockIndex);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> Guard(g_PrefetchMutex);
+        if (!Job->Blocks.empty() &&
+            !g_PrefetchStopping &&
+            g_ImagePrefetchJobs.size() < MaximumQueuedImagePrefetches &&
+            g_PrefetchedImages.size() < MaximumPrefetchedImages &&
+            g_PrefetchedImages.insert(Context->UniqueId.Path).second)
+        {
+            g_ImagePrefetchJobs.push_back(Job);
+            Job = nullptr;
+        }
+    }
+    if (Job)
+    {
+        delete Job;
+        return;
+    }
+    g_PrefetchCondition.notify_all();
+}
+
+void RecordPrefetchBlocks(
+    std::wstring_view RelativeFilePath,
+    std::uint64_t const& Offset,
+    std::uint32_t const& Length)
+{
+    if (!g_PrefetchRecording || !Length)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> Guard(g_PrefetchMutex);
+    for (std::uint64_t BlockIndex = Offset / CachedFileBlockSize;
+        BlockIndex <= (Offset + Length - 1) / CachedFileBlockSize;
+        ++BlockIndex)
+    {
+        if (g_PrefetchRecordedBlocks.size() >= MaximumPrefetchRecordedBlocks)
+        {
+            break;
+        }
+        PrefetchBlock Block(std::wstring(RelativeFilePath), BlockIndex);
+        if (g_PrefetchRecordedBlockSet.insert(Block).second)
+        {
+            g_PrefetchRecordedBlocks.push_back(std::move(Block));
+        }
+    }
+}
+
+std::filesystem::path GetPrefetchManifestPath()
+{
+    return g_CacheDirectory / Mile::FormatString(
+        "%08X.MileCirnoPrefetch",
+        g_VolumeSerialNumber);
+}
+
+// The manifest is a UTF-8 text file, and each line is a range in the
+// "[Offset] [Length] [RelativeFilePath]" format. The ranges of the same file
+// are stored in the consecutive lines.
+void LoadPrefetchManifest(
+    std::vector<PrefetchFileEntry>& Files)
+{
+    std::ifstream Stream(::GetPrefetchManifestPath(), std::ios::binary);
+    std::string Line;
+    while (std::getline(Stream, Line))
+    {
+        if (!Line.empty() && '\r' == Line.back())
+        {
+            Line.pop_back();
+        }
+
+        char* Current = Line.data();
+        std::uint64_t Offset = std::strtoull(Current, &Current, 10);
+        std::uint64_t Length = std::strtoull(Current, &Current, 10);
+        if (' ' != *Current || !Length)
+        {
+            continue;
+        }
+        std::wstring RelativeFilePath = Mile::ToWideString(
+            CP_UTF8,
+            std::string(Current + 1));
+        if (RelativeFilePath.empty())
+        {
+            continue;
+        }
+
+        if (Files.empty() || Files.back().RelativeFilePath != RelativeFilePath)
+        {
+            Files.emplace_back().RelativeFilePath = RelativeFilePath;
+        }
+        Files.back().Ranges.emplace_back(Offset, Length);
+    }
+}
+
+void SavePrefetchManifest()
+{
+    std::vector<PrefetchFileEntry> Files;
+    {
+        std::lock_guard<std::mutex> Guard(g_PrefetchMutex);
+        if (g_PrefetchRecordedBlocks.empty())
+        {
+            // Keep the previous manifest.
+            return;
         }
 
-        if (STATUS_SUCCESS == Status)
+        std::unordered_map<std::wstring, std::vector<std::uint64_t>> Blocks;
+        for (PrefetchBlock const& Block : g_PrefetchRecordedBlocks)
+        {
+            auto Result = Blocks.try_emplace(Block.first);
+            if (Result.second)
+            {
+                Files.emplace_back().RelativeFilePath = Block.first;
+            }
+            Result.first->second.push_back(Block.second);
+        }
+        for (PrefetchFileEntry& File : Files)
         {
-            if (MileCirnoQidTypeDirectory == Response.UniqueId.Type)
+            std::vector<std::uint64_t>& Indexes = Blocks[File.RelativeFilePath];
+            std::sort(Indexes.begin(), Indexes.end());
+            for (std::uint64_t const& Index : Indexes)
             {
-                DokanFileInfo->IsDirectory = TRUE;
-                if (FILE_NON_DIRECTORY_FILE & CreateOptions)
+                if (!File.Ranges.empty() &&
+                    File.Ranges.back().first + File.Ranges.back().second ==
+                    Index * CachedFileBlockSize)
                 {
-                    Status = STATUS_OBJECT_NAME_NOT_FOUND;
+                    File.Ranges.back().second += CachedFileBlockSize;
+                    continue;
                 }
+                File.Ranges.emplace_back(
+                    Index * CachedFileBlockSize,
+                    CachedFileBlockSize);
             }
         }
+    }
 
-        if (STATUS_SUCCESS == Status)
+    // Replace the previous manifest only if the new one is written
+    // completely.
+    std::filesystem::path ManifestPath = ::GetPrefetchManifestPath();
+    std::filesystem::path TemporaryPath = ManifestPath;
+    TemporaryPath += L".tmp";
+    {
+        std::ofstream Stream(TemporaryPath, std::ios::binary | std::ios::trunc);
+        for (PrefetchFileEntry const& File : Files)
+        {
+            std::string RelativeFilePath = Mile::ToString(
+                CP_UTF8,
+                File.RelativeFilePath);
+            for (auto const& Range : File.Ranges)
+            {
+                Stream << Range.first << ' ' << Range.second << ' '
+                    << RelativeFilePath << '\n';
+            }
+        }
+        Stream.flush();
+        if (!Stream)
         {
-            DokanFileInfo->Context = FileId;
+            return;
         }
     }
+    ::MoveFileExW(
+        TemporaryPath.wstring().c_str(),
+        ManifestPath.wstring().c_str(),
+        MOVEFILE_REPLACE_EXISTING);
+}
 
-    if (STATUS_SUCCESS != Status)
+void PrefetchFile(
+    PrefetchFileEntry const& File)
+{
+    FileContext Context;
+    Context.UniqueId = g_RootDirectoryUniqueId;
+    std::filesystem::path RelativeFilePath = ::ResolveCaseInsensitivePath(
+        std::filesystem::path(File.RelativeFilePath));
+    if (0 != ::SimpleWalk(
+        Context.FileId,
+        Context.UniqueId,
+        g_RootDirectoryFileId,
+        RelativeFilePath))
     {
-        ::SimpleClunk(FileId);
+        return;
     }
+    Context.OpenFlags =
+        MileCirnoLinuxOpenCreateFlagLargeFile |
+        MileCirnoLinuxOpenCreateFlagCloseOnExecute |
+        MileCirnoLinuxOpenCreateFlagReadOnly;
+    auto ContextCleanupHandler = Mile::ScopeExitTaskHandler([&]()
+    {
+        ::ReleaseFileContext(&Context);
+    });
 
-    return Status;
-}
+    if (MileCirnoQidTypeFile != Context.UniqueId.Type)
+    {
+        return;
+    }
 
-void DOKAN_CALLBACK MileCirnoCleanup(
-    _In_ LPCWSTR FileName,
-    _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
-{
-    UNREFERENCED_PARAMETER(FileName);
+    if (g_Immutable)
+    {
+        ::InsertImmutableCacheEntry(
+            g_ImmutableUniqueIds,
+            RelativeFilePath.wstring(),
+            std::optional<Mile::Cirno::Qid>(Context.UniqueId));
+        Mile::Cirno::GetAttributesResponse Response = {};
+        ::QueryFileAttributes(&Context, Response);
+    }
 
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    std::shared_ptr<Mile::Cirno::PersistentCacheSegment> Segment =
+        ::AcquirePersistentCacheSegment(&Context);
+    if (!g_Immutable && !Segment)
     {
         return;
     }
 
-    if (DokanFileInfo->DeletePending)
+    std::vector<std::uint8_t> Buffer(CachedFileBlockSize);
+    for (auto const& Range : File.Ranges)
     {
-        Mile::Cirno::RemoveRequest Request = {};
-        Request.FileId = FileId;
-        g_Instance->Remove(Request);
+        for (std::uint64_t Offset = Range.first;
+            Offset < Range.first + Range.second;
+            Offset += CachedFileBlockSize)
+        {
+            if (g_PrefetchStopping)
+            {
+                return;
+            }
+            std::uint32_t ReadLength = 0;
+            if (0 != ::ReadCachedFile(
+                &Context,
+                Segment.get(),
+                Offset,
+                Buffer.data(),
+                static_cast<std::uint32_t>(Buffer.size()),
+                ReadLength) ||
+                ReadLength < Buffer.size())
+            {
+                break;
+            }
+        }
     }
 }
 
-void DOKAN_CALLBACK MileCirnoCloseFile(
-    _In_ LPCWSTR FileName,
-    _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
+// Replay the manifest of the previous mount with parallel workers, and record
+// the new manifest until the recording duration is elapsed or the file
+// system is unmounted.
+void RunPrefetch()
 {
-    UNREFERENCED_PARAMETER(FileName);
+    auto Deadline =
+        std::chrono::steady_clock::now() + PrefetchRecordingDuration;
+
+    std::vector<PrefetchFileEntry> Files;
+    ::LoadPrefetchManifest(Files);
 
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    std::atomic<std::size_t> NextFile = 0;
+    std::vector<std::thread> Workers;
+    for (std::size_t i = 0;
+        i < std::min(PrefetchWorkerCount, Files.size());
+        ++i)
     {
-        return;
+        Workers.emplace_back([&]()
+        {
+            while (!g_PrefetchStopping)
+            {
+                std::size_t Index = NextFile++;
+                if (Index >= Files.size())
+                {
+                    break;
+                }
+                ::PrefetchFile(Files[Index]);
+            }
+        });
+    }
+    for (std::thread& Worker : Workers)
+    {
+        Worker.join();
     }
 
-    ::SimpleClunk(FileId);
+    {
+        std::unique_lock<std::mutex> Lock(g_PrefetchMutex);
+        g_PrefetchCondition.wait_until(Lock, Deadline, []() -> bool
+        {
+            return g_PrefetchStopping;
+        });
+    }
+    g_PrefetchRecording = false;
+
+    ::SavePrefetchManifest();
 }
 
 NTSTATUS DOKAN_CALLBACK MileCirnoReadFile(
@@ -636,46 +5034,66 @@ NTSTATUS DOKAN_CALLBACK MileCirnoReadFile(
     _In_ LONGLONG Offset,
     _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
 {
-    UNREFERENCED_PARAMETER(FileName);
-
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
     {
         return STATUS_INVALID_HANDLE;
     }
 
-    NTSTATUS Status = STATUS_SUCCESS;
-
-    DWORD ProceededSize = 0;
-    DWORD UnproceededSize = BufferLength;
+    ::RecordPrefetchBlocks(&FileName[1], Offset, BufferLength);
 
-    while (UnproceededSize)
+    std::uint32_t ErrorCode = 0;
+    std::uint32_t ProceededSize = 0;
+    if (::ReadInitialContent(
+        Context,
+        Offset,
+        Buffer,
+        BufferLength,
+        ProceededSize))
     {
-        std::uint32_t NumberOfBytesToRead = g_MaximumMessageSize;
-        NumberOfBytesToRead -= Mile::Cirno::ReadResponseHeaderSize;
-        if (UnproceededSize < NumberOfBytesToRead)
+        if (ReadLength)
         {
-            NumberOfBytesToRead = UnproceededSize;
+            *ReadLength = ProceededSize;
         }
-        std::uint32_t CurrentProceededSize = 0;
-        std::uint32_t ErrorCode = g_Instance->Read(
-            FileId,
-            Offset + ProceededSize,
-            static_cast<std::uint8_t*>(Buffer) + ProceededSize,
-            NumberOfBytesToRead,
-            CurrentProceededSize);
-        if (0 != ErrorCode)
+        return STATUS_SUCCESS;
+    }
+    std::shared_ptr<Mile::Cirno::PersistentCacheSegment> Segment =
+        ::AcquirePersistentCacheSegment(Context);
+    if (g_Immutable || Segment)
+    {
+        ErrorCode = ::ReadCachedFile(
+            Context,
+            Segment.get(),
+            Offset,
+            Buffer,
+            BufferLength,
+            ProceededSize);
+        if (0 == ErrorCode && 0 == Offset)
         {
-            Status = ::ToNtStatus(ErrorCode);
-            break;
+            ::StartImagePrefetch(Context, Segment);
         }
-        if (!CurrentProceededSize)
+    }
+    else
+    {
+        ErrorCode = ::EnsureFileOpened(Context);
+        if (0 == ErrorCode)
         {
-            break;
+            ErrorCode = ::SimpleRead(
+                Context->OpenedFileId,
+                Offset,
+                Buffer,
+                BufferLength,
+                ProceededSize);
         }
-        ProceededSize += CurrentProceededSize;
-        UnproceededSize -= CurrentProceededSize;
+    }
+    if (0 == ErrorCode)
+    {
+        ::RecordCopySource(
+            DokanFileInfo->ProcessId,
+            Context,
+            Offset,
+            Buffer,
+            ProceededSize);
     }
 
     if (ReadLength)
@@ -683,7 +5101,7 @@ NTSTATUS DOKAN_CALLBACK MileCirnoReadFile(
         *ReadLength = ProceededSize;
     }
 
-    return Status;
+    return ::ToNtStatus(ErrorCode);
 }
 
 NTSTATUS DOKAN_CALLBACK MileCirnoWriteFile(
@@ -694,15 +5112,28 @@ NTSTATUS DOKAN_CALLBACK MileCirnoWriteFile(
     _In_ LONGLONG Offset,
     _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
 {
+    if (g_WriteProtected)
+    {
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    }
+
     UNREFERENCED_PARAMETER(FileName);
 
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
     {
         return STATUS_INVALID_HANDLE;
     }
 
+    {
+        std::uint32_t ErrorCode = ::EnsureFileOpened(Context);
+        if (0 != ErrorCode)
+        {
+            return ::ToNtStatus(ErrorCode);
+        }
+    }
+    std::uint32_t FileId = Context->OpenedFileId;
+
     DWORD ProceededSize = 0;
     DWORD UnproceededSize = NumberOfBytesToWrite;
 
@@ -710,23 +5141,46 @@ NTSTATUS DOKAN_CALLBACK MileCirnoWriteFile(
 
     if (DokanFileInfo->WriteToEndOfFile || -1 == Offset)
     {
-        Mile::Cirno::GetAttributesRequest Request = {};
-        Request.FileId = FileId;
-        Request.RequestMask = MileCirnoLinuxGetAttributesFlagSize;
-        Mile::Cirno::GetAttributesResponse Response = {};
-        std::uint32_t ErrorCode = g_Instance->GetAttributes(Request, Response);
-        if (0 != ErrorCode)
+        std::uint32_t ErrorCode = ::AppendToEndOfFile(
+            FileId,
+            Buffer,
+            NumberOfBytesToWrite,
+            ProceededSize);
+        if (ProceededSize || APTX_LINUX_EOPNOTSUPP != ErrorCode)
         {
             Status = ::ToNtStatus(ErrorCode);
+            UnproceededSize = 0;
         }
         else
         {
-            Offset = Response.FileSize;
+            // Fall back to the write at the file size queried before, which
+            // is not atomic.
+            Mile::Cirno::GetAttributesRequest Request = {};
+            Request.FileId = FileId;
+            Request.RequestMask = MileCirnoLinuxGetAttributesFlagSize;
+            Mile::Cirno::GetAttributesResponse Response = {};
+            ErrorCode = g_Instance->GetAttributes(Request, Response);
+            if (0 != ErrorCode)
+            {
+                Status = ::ToNtStatus(ErrorCode);
+            }
+            else
+            {
+                Offset = Response.FileSize;
+            }
         }
     }
 
-    if (STATUS_SUCCESS == Status)
+    if (STATUS_SUCCESS == Status && UnproceededSize)
     {
+        ProceededSize = ::OffloadCopiedWrite(
+            DokanFileInfo->ProcessId,
+            Context,
+            Offset,
+            Buffer,
+            NumberOfBytesToWrite);
+        UnproceededSize -= ProceededSize;
+
         while (UnproceededSize)
         {
             std::uint32_t RequestCount = g_MaximumMessageSize;
@@ -756,6 +5210,13 @@ NTSTATUS DOKAN_CALLBACK MileCirnoWriteFile(
         }
     }
 
+    if (ProceededSize)
+    {
+        ::DiscardInitialContent(Context);
+        ::InvalidatePersistentCacheSegment(Context);
+        ::InvalidateCachedAttributes(Context->UniqueId.Path);
+    }
+
     if (NumberOfBytesWritten)
     {
         *NumberOfBytesWritten = ProceededSize;
@@ -770,16 +5231,19 @@ NTSTATUS DOKAN_CALLBACK MileCirnoFlushFileBuffers(
 {
     UNREFERENCED_PARAMETER(FileName);
 
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
     {
         return STATUS_INVALID_HANDLE;
     }
 
-    Mile::Cirno::FlushFileRequest Request = {};
-    Request.FileId = FileId;
-    return ::ToNtStatus(g_Instance->FlushFile(Request));
+    // Nothing needs to be flushed if the file is never opened.
+    if (!::IsFileOpened(Context))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    return ::ToNtStatus(::FlushFileWithGroupCommit(Context));
 }
 
 NTSTATUS DOKAN_CALLBACK MileCirnoGetFileInformation(
@@ -789,28 +5253,27 @@ NTSTATUS DOKAN_CALLBACK MileCirnoGetFileInformation(
 {
     UNREFERENCED_PARAMETER(FileName);
 
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
     {
         return STATUS_INVALID_HANDLE;
     }
 
     std::memset(Buffer, 0, sizeof(BY_HANDLE_FILE_INFORMATION));
 
-    Mile::Cirno::GetAttributesRequest Request = {};
-    Request.FileId = FileId;
-    Request.RequestMask =
-        MileCirnoLinuxGetAttributesFlagMode |
-        MileCirnoLinuxGetAttributesFlagNumberOfHardLinks |
-        MileCirnoLinuxGetAttributesFlagLastAccessTime |
-        MileCirnoLinuxGetAttributesFlagLastWriteTime |
-        MileCirnoLinuxGetAttributesFlagSize;
     Mile::Cirno::GetAttributesResponse Response = {};
-    std::uint32_t ErrorCode = g_Instance->GetAttributes(Request, Response);
-    if (0 != ErrorCode)
+    if (!::LookupCachedAttributes(Context->UniqueId.Path, Response))
     {
-        return ::ToNtStatus(ErrorCode);
+        std::uint32_t ErrorCode = ::QueryFileAttributes(Context, Response);
+        if (0 != ErrorCode)
+        {
+            return ::ToNtStatus(ErrorCode);
+        }
+        if (::IsAttributeCacheEnabled())
+        {
+            ::InsertCachedAttributes(::GetRelativeFilePath(Context), Response);
+            ::AcquireAttributesLease(Context->FileId, Response);
+        }
     }
 
     Buffer->dwFileAttributes = ::ToFileAttributes(
@@ -844,132 +5307,717 @@ NTSTATUS DOKAN_CALLBACK MileCirnoGetFileInformation(
     return STATUS_SUCCESS;
 }
 
-NTSTATUS DOKAN_CALLBACK MileCirnoFindFiles(
-    _In_ LPCWSTR FileName,
-    _In_ PFillFindData FillFindData,
-    _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
+std::uint32_t SimpleQueryAttributes(
+    std::uint32_t const& DirectoryFileId,
+    InternedName const& Name,
+    Mile::Cirno::GetAttributesResponse& Response)
 {
-    UNREFERENCED_PARAMETER(FileName);
-    UNREFERENCED_PARAMETER(FillFindData);
+    std::uint32_t ErrorCode = 0;
 
-    if (!DokanFileInfo->IsDirectory)
+    // Walk and query with a single Tcompound, and the compound-local file ID
+    // needs no Tclunk.
+    if (g_CompoundSupported)
     {
-        return STATUS_NOT_A_DIRECTORY;
+        const std::uint32_t LocalFileId = MILE_CIRNO_COMPOUND_FID_BASE;
+        std::vector<Mile::Cirno::PipelinedRequest> Operations;
+        ::AppendCompoundWalk(
+            Operations,
+            DirectoryFileId,
+            LocalFileId,
+            std::vector<InternedName const*>{ &Name });
+        Mile::Cirno::PipelinedRequest& GetAttributesOperation =
+            Operations.emplace_back();
+        GetAttributesOperation.RequestType =
+            MileCirnoGetAttributesRequestMessage;
+        GetAttributesOperation.ResponseType =
+            MileCirnoGetAttributesResponseMessage;
+        Mile::Cirno::PushGetAttributesRequest(
+            GetAttributesOperation.RequestContent,
+            ::MakeGetAttributesRequest(LocalFileId));
+
+        ErrorCode = g_Instance->Compound(Operations);
+        if (0 == ErrorCode)
+        {
+            ErrorCode = ::GetCompoundWalkResult(Operations[0], 1);
+        }
+        if (0 == ErrorCode)
+        {
+            ErrorCode = Operations[1].ErrorCode;
+        }
+        if (0 == ErrorCode)
+        {
+            std::span<std::uint8_t> ResponseSpan =
+                std::span<std::uint8_t>(Operations[1].ResponseContent);
+            Response = Mile::Cirno::PopGetAttributesResponse(ResponseSpan);
+        }
+        return ErrorCode;
     }
 
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    std::uint32_t FileId = MILE_CIRNO_NOFID;
+    Mile::Cirno::Qid UniqueId = {};
+    ErrorCode = ::SimpleWalk(
+        FileId,
+        UniqueId,
+        DirectoryFileId,
+        std::vector<InternedName const*>{ &Name });
+    if (0 != ErrorCode)
     {
-        return STATUS_INVALID_HANDLE;
+        return ErrorCode;
     }
 
-    NTSTATUS Status = STATUS_SUCCESS;
+    ErrorCode = ::SimpleGetAttributes(FileId, Response);
 
-    std::uint64_t LastOffset = 0;
-    do
+    ::SimpleClunk(FileId);
+
+    return ErrorCode;
+}
+
+void FillFindDataAttributes(
+    Mile::Cirno::GetAttributesResponse const& Response,
+    WIN32_FIND_DATAW& FindData)
+{
+    FindData.dwFileAttributes = ::ToFileAttributes(
+        Response.Mode);
+
+    FindData.ftLastAccessTime = ::ToFileTime(
+        Response.LastAccessTimeSeconds,
+        Response.LastAccessTimeNanoseconds);
+    FindData.ftLastWriteTime = ::ToFileTime(
+        Response.LastWriteTimeSeconds,
+        Response.LastWriteTimeNanoseconds);
+
+    // Assume creation time is the same as last write time.
+    FindData.ftCreationTime = FindData.ftLastWriteTime;
+
+    FindData.nFileSizeHigh =
+        static_cast<DWORD>(Response.FileSize >> 32);
+    FindData.nFileSizeLow =
+        static_cast<DWORD>(Response.FileSize);
+}
+
+// Enumerate the directory with Treaddir, and query the attributes of each
+// entry with a pipelined Tcompound of walk and getattr if supported.
+// Otherwise the independent walks, getattrs and clunks are pipelined in
+// separate rounds because each of them depends on the former one. Unmatched
+// entries are skipped unless the whole directory is listed.
+std::uint32_t EnumerateDirectoryWithWalk(
+    std::uint32_t const& FileId,
+    std::filesystem::path const& RelativeDirectoryPath,
+    LPCWSTR SearchPattern,
+    BOOL const& IgnoreCase,
+    PFillFindData FillFindData,
+    PDOKAN_FILE_INFO DokanFileInfo,
+    std::vector<WIN32_FIND_DATAW>* Listing)
+{
+    auto MakeReadDirectoryRequest = [&](
+        std::uint64_t const& Offset) -> Mile::Cirno::PipelinedRequest
     {
         Mile::Cirno::ReadDirectoryRequest Request = {};
         Request.FileId = FileId;
-        Request.Offset = LastOffset;
-        LastOffset = 0;
+        Request.Offset = Offset;
         Request.Count = g_MaximumMessageSize;
         Request.Count -= Mile::Cirno::ReadDirectoryResponseHeaderSize;
-        Mile::Cirno::ReadDirectoryResponse Response = {};
+        if (g_CompoundSupported)
         {
-            std::uint32_t ErrorCode = g_Instance->ReadDirectory(
-                Request,
-                Response);
-            if (0 != ErrorCode)
+            // The next page is wrapped as a Tcompound in the same pipeline
+            // with the attribute queries.
+            Request.Count -= CompoundResultOverhead;
+        }
+        Mile::Cirno::PipelinedRequest Result = {};
+        Result.RequestType = MileCirnoReadDirectoryRequestMessage;
+        Result.ResponseType = MileCirnoReadDirectoryResponseMessage;
+        Mile::Cirno::PushReadDirectoryRequest(Result.RequestContent, Request);
+        return Result;
+    };
+
+    struct PendingEntry
+    {
+        WIN32_FIND_DATAW FindData = {};
+        InternedName Uninterned;
+        InternedName const* Name = nullptr;
+        bool Matched = false;
+        bool Ready = false;
+        bool Cached = false;
+        bool Walked = false;
+        std::uint32_t FileId = MILE_CIRNO_NOFID;
+        std::size_t RequestIndex = 0;
+        Mile::Cirno::GetAttributesResponse Attributes = {};
+    };
+
+    std::vector<Mile::Cirno::PipelinedRequest> FirstPageRequests;
+    FirstPageRequests.push_back(MakeReadDirectoryRequest(0));
+    g_Instance->PipelinedRequestResponse(FirstPageRequests);
+    Mile::Cirno::PipelinedRequest Page = std::move(FirstPageRequests[0]);
+    for (;;)
+    {
+        if (0 != Page.ErrorCode)
+        {
+            return Page.ErrorCode;
+        }
+        std::span<std::uint8_t> PageSpan =
+            std::span<std::uint8_t>(Page.ResponseContent);
+        Mile::Cirno::ReadDirectoryResponse Response =
+            Mile::Cirno::PopReadDirectoryResponse(PageSpan);
+        if (Response.Data.empty())
+        {
+            break;
+        }
+
+        // The entries are reserved because they may refer to themselves.
+        std::vector<PendingEntry> Entries;
+        Entries.reserve(Response.Data.size());
+        for (Mile::Cirno::DirectoryEntry const& Entry : Response.Data)
+        {
+            if ("." == Entry.Name || ".." == Entry.Name)
             {
-                Status = ::ToNtStatus(ErrorCode);
-                break;
+                continue;
+            }
+
+            PendingEntry& Current = Entries.emplace_back();
+            Current.Name = ::InternName(std::string_view(Entry.Name));
+            if (!Current.Name)
+            {
+                if (!::MakeInternedName(
+                    Current.Uninterned,
+                    std::string_view(Entry.Name)))
+                {
+                    Entries.pop_back();
+                    continue;
+                }
+                Current.Name = &Current.Uninterned;
+            }
+
+            ::wcscpy_s(Current.FindData.cFileName, Current.Name->Name.c_str());
+
+            // Filter the entries before querying the attributes to avoid the
+            // walk, getattr and clunk round trips for unmatched entries.
+            Current.Matched = !SearchPattern || ::DokanIsNameInExpression(
+                SearchPattern,
+                Current.FindData.cFileName,
+                IgnoreCase);
+            if (!Current.Matched && !Listing)
+            {
+                Entries.pop_back();
+                continue;
             }
+
+            // Serve the cached attributes without the round trips, which
+            // may be stale for up to the attribute timeout.
+            Current.Cached = ::LookupCachedAttributes(
+                Entry.UniqueId.Path,
+                Current.Attributes);
+            Current.Ready = Current.Cached;
         }
-        for (Mile::Cirno::DirectoryEntry const& Entry : Response.Data)
+
+        // Request the next page together with the first batch of the
+        // attribute queries of the current page, so the later pages are in
+        // flight while the entries of the current page are processed.
+        std::uint64_t NextOffset = Response.Data.back().Offset;
+        std::size_t Start = 0;
+        do
         {
-            LastOffset = Entry.Offset;
+            std::size_t Count = std::min(
+                FindFilesBatchSize,
+                Entries.size() - Start);
+
+            if (g_CompoundSupported)
+            {
+                // The compound-local file IDs need no Tclunk.
+                const std::uint32_t LocalFileId =
+                    MILE_CIRNO_COMPOUND_FID_BASE;
+                std::vector<std::vector<Mile::Cirno::PipelinedRequest>>
+                    Compounds;
+                if (0 == Start)
+                {
+                    Compounds.emplace_back().push_back(
+                        MakeReadDirectoryRequest(NextOffset));
+                }
+                for (std::size_t i = Start; i < Start + Count; ++i)
+                {
+                    PendingEntry& Current = Entries[i];
+                    if (Current.Ready)
+                    {
+                        continue;
+                    }
+                    Current.RequestIndex = Compounds.size();
+                    std::vector<Mile::Cirno::PipelinedRequest>& Operations =
+                        Compounds.emplace_back();
+                    ::AppendCompoundWalk(
+                        Operations,
+                        FileId,
+                        LocalFileId,
+                        std::vector<InternedName const*>{ Current.Name });
+                    Mile::Cirno::PipelinedRequest& GetAttributesOperation =
+                        Operations.emplace_back();
+                    GetAttributesOperation.RequestType =
+                        MileCirnoGetAttributesRequestMessage;
+                    GetAttributesOperation.ResponseType =
+                        MileCirnoGetAttributesResponseMessage;
+                    Mile::Cirno::PushGetAttributesRequest(
+                        GetAttributesOperation.RequestContent,
+                        ::MakeGetAttributesRequest(LocalFileId));
+                }
+                if (!Compounds.empty())
+                {
+                    g_Instance->PipelinedCompound(Compounds);
+                }
+                if (0 == Start)
+                {
+                    Page = std::move(Compounds[0][0]);
+                }
+
+                for (std::size_t i = Start; i < Start + Count; ++i)
+                {
+                    PendingEntry& Current = Entries[i];
+                    if (Current.Ready)
+                    {
+                        continue;
+                    }
+                    std::vector<Mile::Cirno::PipelinedRequest>& Operations =
+                        Compounds[Current.RequestIndex];
+                    if (0 == ::GetCompoundWalkResult(Operations[0], 1) &&
+                        0 == Operations[1].ErrorCode)
+                    {
+                        std::span<std::uint8_t> ResponseSpan =
+                            std::span<std::uint8_t>(
+                                Operations[1].ResponseContent);
+                        Current.Attributes =
+                            Mile::Cirno::PopGetAttributesResponse(
+                                ResponseSpan);
+                        Current.Ready = true;
+                    }
+                }
+            }
+            else
+            {
+                // The walks are independent of each other, and the next page
+                // is requested together with them.
+                std::vector<Mile::Cirno::PipelinedRequest> Requests;
+                if (0 == Start)
+                {
+                    Requests.push_back(MakeReadDirectoryRequest(NextOffset));
+                }
+                for (std::size_t i = Start; i < Start + Count; ++i)
+                {
+                    PendingEntry& Current = Entries[i];
+                    if (Current.Ready)
+                    {
+                        continue;
+                    }
+                    Current.FileId = g_Instance->AllocateFileId();
+                    Current.RequestIndex = Requests.size();
+                    Mile::Cirno::PipelinedRequest& WalkRequest =
+                        Requests.emplace_back();
+                    WalkRequest.RequestType = MileCirnoWalkRequestMessage;
+                    WalkRequest.ResponseType = MileCirnoWalkResponseMessage;
+                    Mile::Cirno::PushEncodedWalkRequest(
+                        WalkRequest.RequestContent,
+                        ::MakeEncodedWalkRequest(
+                            FileId,
+                            Current.FileId,
+                            std::vector<InternedName const*>{ Current.Name },
+                            0,
+                            1));
+                }
+                if (!Requests.empty())
+                {
+                    g_Instance->PipelinedRequestResponse(Requests);
+                }
+                if (0 == Start)
+                {
+                    Page = std::move(Requests[0]);
+                }
+
+                std::vector<Mile::Cirno::PipelinedRequest>
+                    GetAttributesRequests;
+                for (std::size_t i = Start; i < Start + Count; ++i)
+                {
+                    PendingEntry& Current = Entries[i];
+                    if (Current.Ready)
+                    {
+                        continue;
+                    }
+                    Current.Walked = 0 == ::GetCompoundWalkResult(
+                        Requests[Current.RequestIndex],
+                        1);
+                    if (!Current.Walked)
+                    {
+                        // The file ID is not used by the server if failed to
+                        // walk.
+                        g_Instance->FreeFileId(Current.FileId);
+                        continue;
+                    }
+                    Current.RequestIndex = GetAttributesRequests.size();
+                    Mile::Cirno::PipelinedRequest& GetAttributesRequest =
+                        GetAttributesRequests.emplace_back();
+                    GetAttributesRequest.RequestType =
+                        MileCirnoGetAttributesRequestMessage;
+                    GetAttributesRequest.ResponseType =
+                        MileCirnoGetAttributesResponseMessage;
+                    Mile::Cirno::PushGetAttributesRequest(
+                        GetAttributesRequest.RequestContent,
+                        ::MakeGetAttributesRequest(Current.FileId));
+                }
+                if (!GetAttributesRequests.empty())
+                {
+                    g_Instance->PipelinedRequestResponse(
+                        GetAttributesRequests);
+                }
+
+                std::vector<Mile::Cirno::PipelinedRequest> ClunkRequests;
+                for (std::size_t i = Start; i < Start + Count; ++i)
+                {
+                    PendingEntry& Current = Entries[i];
+                    if (!Current.Walked)
+                    {
+                        continue;
+                    }
+                    Mile::Cirno::PipelinedRequest& GetAttributesRequest =
+                        GetAttributesRequests[Current.RequestIndex];
+                    if (0 == GetAttributesRequest.ErrorCode)
+                    {
+                        std::span<std::uint8_t> ResponseSpan =
+                            std::span<std::uint8_t>(
+                                GetAttributesRequest.ResponseContent);
+                        Current.Attributes =
+                            Mile::Cirno::PopGetAttributesResponse(
+                                ResponseSpan);
+                        Current.Ready = true;
+                    }
+                    else
+                    {
+                        // Retry alone in case the pipeline is broken.
+                        Current.Ready = 0 == ::SimpleGetAttributes(
+                            Current.FileId,
+                            Current.Attributes);
+                    }
+
+                    // Always clunk the walked file IDs, even if the getattr
+                    // is failed.
+                    Current.RequestIndex = ClunkRequests.size();
+                    Mile::Cirno::ClunkRequest Request = {};
+                    Request.FileId = Current.FileId;
+                    Mile::Cirno::PipelinedRequest& ClunkRequest =
+                        ClunkRequests.emplace_back();
+                    ClunkRequest.RequestType = MileCirnoClunkRequestMessage;
+                    ClunkRequest.ResponseType = MileCirnoClunkResponseMessage;
+                    Mile::Cirno::PushClunkRequest(
+                        ClunkRequest.RequestContent,
+                        Request);
+                }
+                if (!ClunkRequests.empty())
+                {
+                    g_Instance->PipelinedRequestResponse(ClunkRequests);
+                }
+                for (std::size_t i = Start; i < Start + Count; ++i)
+                {
+                    PendingEntry& Current = Entries[i];
+                    if (Current.Walked &&
+                        0 == ClunkRequests[Current.RequestIndex].ErrorCode)
+                    {
+                        g_Instance->FreeFileId(Current.FileId);
+                    }
+                }
+            }
+
+            for (std::size_t i = Start; i < Start + Count; ++i)
+            {
+                PendingEntry& Current = Entries[i];
+                if (!Current.Ready)
+                {
+                    continue;
+                }
+                if (!Current.Cached)
+                {
+                    ::InsertCachedAttributes(
+                        RelativeDirectoryPath / Current.Name->Name,
+                        Current.Attributes);
+                }
+
+                ::FillFindDataAttributes(
+                    Current.Attributes,
+                    Current.FindData);
+
+                if (Listing)
+                {
+                    Listing->push_back(Current.FindData);
+                }
+
+                if (Current.Matched)
+                {
+                    FillFindData(&Current.FindData, DokanFileInfo);
+                }
+            }
+
+            Start += Count;
+        } while (Start < Entries.size());
+    }
+
+    return 0;
+}
+
+// Enumerate the directory with Twreaddir, which returns the attributes
+// together with each entry, so no per-entry round trip is needed.
+std::uint32_t EnumerateDirectoryWithWindowsReadDirectory(
+    std::uint32_t const& FileId,
+    std::filesystem::path const& RelativeDirectoryPath,
+    LPCWSTR SearchPattern,
+    BOOL const& IgnoreCase,
+    PFillFindData FillFindData,
+    PDOKAN_FILE_INFO DokanFileInfo,
+    std::vector<WIN32_FIND_DATAW>* Listing)
+{
+    std::uint64_t Offset = 0;
+    for (;;)
+    {
+        Mile::Cirno::WindowsReadDirectoryRequest Request = {};
+        Request.FileId = FileId;
+        Request.Offset = Offset;
+        Request.Count = g_MaximumMessageSize;
+        Request.Count -= Mile::Cirno::ReadDirectoryResponseHeaderSize;
+        Mile::Cirno::WindowsReadDirectoryResponse Response;
+        std::uint32_t ErrorCode = g_Instance->WindowsReadDirectory(
+            Request,
+            Response);
+        if (0 != ErrorCode)
+        {
+            return ErrorCode;
+        }
+        if (Response.Data.empty())
+        {
+            break;
+        }
+
+        for (Mile::Cirno::WindowsDirectoryEntry const& Entry : Response.Data)
+        {
+            if ("." == Entry.Name || ".." == Entry.Name)
+            {
+                continue;
+            }
+
+            InternedName Uninterned;
+            InternedName const* Name = ::InternName(
+                std::string_view(Entry.Name));
+            if (!Name)
+            {
+                if (!::MakeInternedName(
+                    Uninterned,
+                    std::string_view(Entry.Name)))
+                {
+                    continue;
+                }
+                Name = &Uninterned;
+            }
+
+            WIN32_FIND_DATAW FindData = {};
+            ::wcscpy_s(FindData.cFileName, Name->Name.c_str());
+
+            bool Matched = !SearchPattern || ::DokanIsNameInExpression(
+                SearchPattern,
+                FindData.cFileName,
+                IgnoreCase);
+            if (!Matched && !Listing)
+            {
+                continue;
+            }
+
+            Mile::Cirno::GetAttributesResponse Attributes =
+                ::ToGetAttributesResponse(Entry);
+            ::InsertCachedAttributes(
+                RelativeDirectoryPath / Name->Name,
+                Attributes);
+            ::FillFindDataAttributes(Attributes, FindData);
+
+            if (Listing)
+            {
+                Listing->push_back(FindData);
+            }
+
+            if (Matched)
+            {
+                FillFindData(&FindData, DokanFileInfo);
+            }
+        }
+
+        Offset = Response.Data.back().Offset;
+    }
+
+    return 0;
+}
+
+NTSTATUS DOKAN_CALLBACK MileCirnoFindFilesWithPattern(
+    _In_ LPCWSTR PathName,
+    _In_opt_ LPCWSTR SearchPattern,
+    _In_ PFillFindData FillFindData,
+    _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
+{
+    UNREFERENCED_PARAMETER(PathName);
+
+    if (!DokanFileInfo->IsDirectory)
+    {
+        return STATUS_NOT_A_DIRECTORY;
+    }
+
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
+    {
+        return STATUS_INVALID_HANDLE;
+    }
+
+    // Match everything if no pattern is specified, which is also the most
+    // common case for enumerating the whole directory.
+    if (SearchPattern && (
+        L'\0' == SearchPattern[0] ||
+        0 == std::wcscmp(SearchPattern, L"*")))
+    {
+        SearchPattern = nullptr;
+    }
 
-            if ("." == Entry.Name || ".." == Entry.Name)
-            {
-                continue;
-            }
+    BOOL IgnoreCase = !(
+        DOKAN_OPTION_CASE_SENSITIVE & DokanFileInfo->DokanOptions->Options);
 
-            WIN32_FIND_DATAW FindData = {};
-            ::wcscpy_s(
-                FindData.cFileName,
-                Mile::ToWideString(CP_UTF8, Entry.Name).c_str());
+    std::filesystem::path RelativeDirectoryPath = ::GetRelativeFilePath(
+        Context);
 
-            std::uint32_t CurrentFileId = MILE_CIRNO_NOFID;
-            auto CurrentCleanupHandler = Mile::ScopeExitTaskHandler([&]()
+    if (g_Immutable)
+    {
+        std::shared_ptr<std::vector<WIN32_FIND_DATAW> const> Listing =
+            ::LookupImmutableDirectory(Context->UniqueId.Path);
+        if (Listing)
+        {
+            for (WIN32_FIND_DATAW const& Item : *Listing)
             {
-                if (MILE_CIRNO_NOFID != CurrentFileId)
+                if (SearchPattern && !::DokanIsNameInExpression(
+                    SearchPattern,
+                    Item.cFileName,
+                    IgnoreCase))
                 {
-                    ::SimpleClunk(CurrentFileId);
+                    continue;
                 }
-            });
-            if (0 != ::SimpleWalk(
-                CurrentFileId,
-                FileId,
-                Mile::ToWideString(CP_UTF8, Entry.Name)))
-            {
-                continue;
+                WIN32_FIND_DATAW FindData = Item;
+                FillFindData(&FindData, DokanFileInfo);
             }
+            return STATUS_SUCCESS;
+        }
+    }
 
-            Mile::Cirno::GetAttributesRequest InformationRequest = {};
-            InformationRequest.FileId = CurrentFileId;
-            InformationRequest.RequestMask =
-                MileCirnoLinuxGetAttributesFlagMode |
-                MileCirnoLinuxGetAttributesFlagLastAccessTime |
-                MileCirnoLinuxGetAttributesFlagLastWriteTime |
-                MileCirnoLinuxGetAttributesFlagSize;
-            Mile::Cirno::GetAttributesResponse InformationResponse = {};
-            std::uint32_t ErrorCode = g_Instance->GetAttributes(
-                InformationRequest,
-                InformationResponse);
-            if (0 != ErrorCode)
+    // Query the file directly if the pattern has no wildcard, because it can
+    // only match the file which has the same name on case-sensitive shares.
+    if (SearchPattern &&
+        !IgnoreCase &&
+        !std::wcspbrk(SearchPattern, L"*?<>\""))
+    {
+        if (0 == std::wcscmp(SearchPattern, L".") ||
+            0 == std::wcscmp(SearchPattern, L".."))
+        {
+            return STATUS_SUCCESS;
+        }
+        InternedName Uninterned;
+        InternedName const* Name = ::InternName(
+            std::wstring_view(SearchPattern));
+        if (!Name)
+        {
+            if (!::MakeInternedName(Uninterned, std::wstring_view(SearchPattern)))
             {
-                continue;
+                return STATUS_SUCCESS;
             }
+            Name = &Uninterned;
+        }
+        if (0 != ::EnsureFileWalked(Context))
+        {
+            return STATUS_SUCCESS;
+        }
+        WIN32_FIND_DATAW FindData = {};
+        Mile::Cirno::GetAttributesResponse Attributes = {};
+        if (0 == ::wcscpy_s(FindData.cFileName, SearchPattern) &&
+            0 == ::SimpleQueryAttributes(Context->FileId, *Name, Attributes))
+        {
+            ::InsertCachedAttributes(
+                RelativeDirectoryPath / Name->Name,
+                Attributes);
+            ::FillFindDataAttributes(Attributes, FindData);
+            FillFindData(&FindData, DokanFileInfo);
+        }
+        return STATUS_SUCCESS;
+    }
 
-            FindData.dwFileAttributes = ::ToFileAttributes(
-                InformationResponse.Mode);
-
-            FindData.ftLastAccessTime = ::ToFileTime(
-                InformationResponse.LastAccessTimeSeconds,
-                InformationResponse.LastAccessTimeNanoseconds);
-            FindData.ftLastWriteTime = ::ToFileTime(
-                InformationResponse.LastWriteTimeSeconds,
-                InformationResponse.LastWriteTimeNanoseconds);
+    {
+        std::uint32_t ErrorCode = ::EnsureFileOpened(Context);
+        if (0 != ErrorCode)
+        {
+            return ::ToNtStatus(ErrorCode);
+        }
+    }
+    std::uint32_t FileId = Context->OpenedFileId;
 
-            // Assume creation time is the same as last write time.
-            FindData.ftCreationTime = FindData.ftLastWriteTime;
+    // The whole directory is queried for caching in the immutable mode.
+    std::shared_ptr<std::vector<WIN32_FIND_DATAW>> Listing;
+    if (g_Immutable)
+    {
+        Listing = std::make_shared<std::vector<WIN32_FIND_DATAW>>();
+    }
 
-            FindData.nFileSizeHigh =
-                static_cast<DWORD>(InformationResponse.FileSize >> 32);
-            FindData.nFileSizeLow =
-                static_cast<DWORD>(InformationResponse.FileSize);
+    std::uint32_t ErrorCode = g_WindowsReadDirectorySupported
+        ? ::EnumerateDirectoryWithWindowsReadDirectory(
+            FileId,
+            RelativeDirectoryPath,
+            SearchPattern,
+            IgnoreCase,
+            FillFindData,
+            DokanFileInfo,
+            Listing.get())
+        : ::EnumerateDirectoryWithWalk(
+            FileId,
+            RelativeDirectoryPath,
+            SearchPattern,
+            IgnoreCase,
+            FillFindData,
+            DokanFileInfo,
+            Listing.get());
+    NTSTATUS Status = ::ToNtStatus(ErrorCode);
 
-            FillFindData(&FindData, DokanFileInfo);
-        }
-    } while (LastOffset);
+    if (Listing && STATUS_SUCCESS == Status)
+    {
+        ::InsertImmutableCacheEntry(
+            g_ImmutableDirectories,
+            Context->UniqueId.Path,
+            std::shared_ptr<std::vector<WIN32_FIND_DATAW> const>(
+                std::move(Listing)));
+    }
 
     return Status;
 }
 
+NTSTATUS DOKAN_CALLBACK MileCirnoFindFiles(
+    _In_ LPCWSTR FileName,
+    _In_ PFillFindData FillFindData,
+    _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
+{
+    return ::MileCirnoFindFilesWithPattern(
+        FileName,
+        nullptr,
+        FillFindData,
+        DokanFileInfo);
+}
+
 NTSTATUS DOKAN_CALLBACK MileCirnoSetFileAttributes(
     _In_ LPCWSTR FileName,
     _In_ DWORD FileAttributes,
     _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
 {
+    if (g_WriteProtected)
+    {
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    }
+
     UNREFERENCED_PARAMETER(FileName);
 
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
     {
         return STATUS_INVALID_HANDLE;
     }
+    std::uint32_t FileId = Context->FileId;
 
     Mile::Cirno::SetAttributesRequest Request = {};
     Request.FileId = FileId;
@@ -986,7 +6034,14 @@ NTSTATUS DOKAN_CALLBACK MileCirnoSetFileAttributes(
     {
         Request.Mode |= APTX_IFLNK;
     }
-    return ::ToNtStatus(g_Instance->SetAttributes(Request));
+    std::uint32_t ErrorCode = g_Instance->SetAttributes(Request);
+    if (0 == ErrorCode)
+    {
+        Context->MetadataChanged = true;
+        ::DiscardInitialAttributes(Context);
+        ::InvalidateCachedAttributes(Context->UniqueId.Path);
+    }
+    return ::ToNtStatus(ErrorCode);
 }
 
 NTSTATUS DOKAN_CALLBACK MileCirnoSetFileTime(
@@ -996,15 +6051,20 @@ NTSTATUS DOKAN_CALLBACK MileCirnoSetFileTime(
     _In_ CONST FILETIME* LastWriteTime,
     _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
 {
+    if (g_WriteProtected)
+    {
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    }
+
     UNREFERENCED_PARAMETER(FileName);
     UNREFERENCED_PARAMETER(CreationTime);
 
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
     {
         return STATUS_INVALID_HANDLE;
     }
+    std::uint32_t FileId = Context->FileId;
 
     Mile::Cirno::SetAttributesRequest Request = {};
     Request.FileId = FileId;
@@ -1029,13 +6089,25 @@ NTSTATUS DOKAN_CALLBACK MileCirnoSetFileTime(
             Request.LastWriteTimeSeconds,
             Request.LastWriteTimeNanoseconds);
     }
-    return ::ToNtStatus(g_Instance->SetAttributes(Request));
+    std::uint32_t ErrorCode = g_Instance->SetAttributes(Request);
+    if (0 == ErrorCode)
+    {
+        Context->MetadataChanged = true;
+        ::DiscardInitialAttributes(Context);
+        ::InvalidateCachedAttributes(Context->UniqueId.Path);
+    }
+    return ::ToNtStatus(ErrorCode);
 }
 
 NTSTATUS DOKAN_CALLBACK MileCirnoDeleteFile(
     _In_ LPCWSTR FileName,
     _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
 {
+    if (g_WriteProtected)
+    {
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    }
+
     UNREFERENCED_PARAMETER(FileName);
     UNREFERENCED_PARAMETER(DokanFileInfo);
 
@@ -1046,20 +6118,40 @@ NTSTATUS DOKAN_CALLBACK MileCirnoDeleteDirectory(
     _In_ LPCWSTR FileName,
     _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
 {
+    if (g_WriteProtected)
+    {
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    }
+
     UNREFERENCED_PARAMETER(FileName);
 
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
     {
         return STATUS_INVALID_HANDLE;
     }
 
+    {
+        std::uint32_t ErrorCode = ::EnsureFileOpened(Context);
+        if (0 != ErrorCode)
+        {
+            return ::ToNtStatus(ErrorCode);
+        }
+    }
+    std::uint32_t FileId = Context->OpenedFileId;
+
+    // Only three entries are needed to tell whether there is any entry other
+    // than "." and "..", and the server checks it again with Tunlinkat when
+    // the directory is actually deleted. Each entry has 24 bytes besides the
+    // name which is at most 255 bytes.
+    const std::uint32_t MaximumDirectoryEntrySize = 24 + 255;
+
     Mile::Cirno::ReadDirectoryRequest Request = {};
     Request.FileId = FileId;
     Request.Offset = 0;
-    Request.Count = g_MaximumMessageSize;
-    Request.Count -= Mile::Cirno::ReadDirectoryResponseHeaderSize;
+    Request.Count = std::min<std::uint32_t>(
+        3 * MaximumDirectoryEntrySize,
+        g_MaximumMessageSize - Mile::Cirno::ReadDirectoryResponseHeaderSize);
     Mile::Cirno::ReadDirectoryResponse Response = {};
     std::uint32_t ErrorCode = g_Instance->ReadDirectory(Request, Response);
     if (0 != ErrorCode)
@@ -1074,26 +6166,99 @@ NTSTATUS DOKAN_CALLBACK MileCirnoDeleteDirectory(
     return STATUS_SUCCESS;
 }
 
-NTSTATUS DOKAN_CALLBACK MileCirnoMoveFile(
-    _In_ LPCWSTR FileName,
-    _In_ LPCWSTR NewFileName,
-    _In_ BOOL ReplaceIfExisting,
-    _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
+Mile::Cirno::RenameAtRequest MakeRenameAtRequest(
+    std::uint32_t const& OldDirectoryFileId,
+    std::filesystem::path const& OldFilePath,
+    std::uint32_t const& NewDirectoryFileId,
+    std::filesystem::path const& NewFilePath)
 {
-    UNREFERENCED_PARAMETER(ReplaceIfExisting);
+    Mile::Cirno::RenameAtRequest Result;
+    Result.OldDirectoryFileId = OldDirectoryFileId;
+    Result.OldName = ::ToRawName(OldFilePath.filename().wstring());
+    Result.NewDirectoryFileId = NewDirectoryFileId;
+    Result.NewName = ::ToRawName(NewFilePath.filename().wstring());
+    return Result;
+}
+
+std::uint32_t SimpleRenameAt(
+    std::filesystem::path const& OldFilePath,
+    std::filesystem::path const& NewFilePath)
+{
+    std::uint32_t ErrorCode = 0;
 
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    // Walk both parent directories and rename with a single Tcompound if
+    // both walks fit in a single Twalk.
+    if (g_CompoundSupported)
     {
-        return STATUS_INVALID_HANDLE;
+        std::vector<InternedName const*> OldNames;
+        std::vector<InternedName const*> NewNames;
+        std::forward_list<InternedName> UninternedNames;
+        ErrorCode = ::SplitRelativeFilePath(
+            OldFilePath.parent_path(),
+            OldNames,
+            UninternedNames);
+        if (0 == ErrorCode)
+        {
+            ErrorCode = ::SplitRelativeFilePath(
+                NewFilePath.parent_path(),
+                NewNames,
+                UninternedNames);
+        }
+        if (0 != ErrorCode)
+        {
+            return ErrorCode;
+        }
+        if (OldNames.size() <= g_MaximumWalkElements &&
+            NewNames.size() <= g_MaximumWalkElements)
+        {
+            const std::uint32_t OldDirectoryFileId =
+                MILE_CIRNO_COMPOUND_FID_BASE;
+            const std::uint32_t NewDirectoryFileId =
+                MILE_CIRNO_COMPOUND_FID_BASE + 1;
+            std::vector<Mile::Cirno::PipelinedRequest> Operations;
+            ::AppendCompoundWalk(
+                Operations,
+                g_RootDirectoryFileId,
+                OldDirectoryFileId,
+                OldNames);
+            ::AppendCompoundWalk(
+                Operations,
+                g_RootDirectoryFileId,
+                NewDirectoryFileId,
+                NewNames);
+            Mile::Cirno::PipelinedRequest& RenameAtOperation =
+                Operations.emplace_back();
+            RenameAtOperation.RequestType = MileCirnoRenameAtRequestMessage;
+            RenameAtOperation.ResponseType = MileCirnoRenameAtResponseMessage;
+            Mile::Cirno::PushRenameAtRequest(
+                RenameAtOperation.RequestContent,
+                ::MakeRenameAtRequest(
+                    OldDirectoryFileId,
+                    OldFilePath,
+                    NewDirectoryFileId,
+                    NewFilePath));
+
+            ErrorCode = g_Instance->Compound(Operations);
+            if (0 == ErrorCode)
+            {
+                ErrorCode = ::GetCompoundWalkResult(
+                    Operations[0],
+                    OldNames.size());
+            }
+            if (0 == ErrorCode)
+            {
+                ErrorCode = ::GetCompoundWalkResult(
+                    Operations[1],
+                    NewNames.size());
+            }
+            if (0 == ErrorCode)
+            {
+                ErrorCode = Operations[2].ErrorCode;
+            }
+            return ErrorCode;
+        }
     }
 
-    std::filesystem::path OldFilePath(&FileName[1]);
-    std::filesystem::path NewFilePath(&NewFileName[1]);
-
-    std::uint32_t ErrorCode = 0;
-
     std::uint32_t OldDirectoryFileId = MILE_CIRNO_NOFID;
     ErrorCode = ::SimpleWalk(
         OldDirectoryFileId,
@@ -1108,16 +6273,11 @@ NTSTATUS DOKAN_CALLBACK MileCirnoMoveFile(
             NewFilePath.parent_path());
         if (0 == ErrorCode)
         {
-            Mile::Cirno::RenameAtRequest Request;
-            Request.OldDirectoryFileId = OldDirectoryFileId;
-            Request.OldName = Mile::ToString(
-                CP_UTF8,
-                OldFilePath.filename().wstring());
-            Request.NewDirectoryFileId = NewDirectoryFileId;
-            Request.NewName = Mile::ToString(
-                CP_UTF8,
-                NewFilePath.filename().wstring());
-            ErrorCode = g_Instance->RenameAt(Request);
+            ErrorCode = g_Instance->RenameAt(::MakeRenameAtRequest(
+                OldDirectoryFileId,
+                OldFilePath,
+                NewDirectoryFileId,
+                NewFilePath));
 
             ::SimpleClunk(NewDirectoryFileId);
         }
@@ -1125,6 +6285,53 @@ NTSTATUS DOKAN_CALLBACK MileCirnoMoveFile(
         ::SimpleClunk(OldDirectoryFileId);
     }
 
+    return ErrorCode;
+}
+
+NTSTATUS DOKAN_CALLBACK MileCirnoMoveFile(
+    _In_ LPCWSTR FileName,
+    _In_ LPCWSTR NewFileName,
+    _In_ BOOL ReplaceIfExisting,
+    _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
+{
+    if (g_WriteProtected)
+    {
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    }
+
+    UNREFERENCED_PARAMETER(FileName);
+    UNREFERENCED_PARAMETER(ReplaceIfExisting);
+
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
+    {
+        return STATUS_INVALID_HANDLE;
+    }
+
+    std::filesystem::path OldFilePath = ::GetRelativeFilePath(Context);
+    std::filesystem::path NewFilePath = ::ResolveCaseInsensitivePath(
+        std::filesystem::path(&NewFileName[1]));
+    if (g_CaseInsensitive &&
+        ::ToCaseFoldedName(OldFilePath.wstring()) ==
+        ::ToCaseFoldedName(NewFilePath.wstring()))
+    {
+        // Keep the new name as is for renaming the file to change the case.
+        NewFilePath.replace_filename(
+            std::filesystem::path(&NewFileName[1]).filename());
+    }
+
+    std::uint32_t ErrorCode = ::SimpleRenameAt(OldFilePath, NewFilePath);
+    if (0 == ErrorCode)
+    {
+        ::InvalidateCachedAttributes(Context->UniqueId.Path);
+        ::InvalidateCachedWalkFileIds(OldFilePath);
+        ::UpdateCaseInsensitiveIndex(OldFilePath, false);
+        ::UpdateCaseInsensitiveIndex(NewFilePath, true);
+
+        std::lock_guard<std::mutex> Guard(Context->Mutex);
+        Context->RelativeFilePath = NewFilePath;
+    }
+
     if (0 != ErrorCode)
     {
         return ::ToNtStatus(ErrorCode);
@@ -1138,20 +6345,32 @@ NTSTATUS DOKAN_CALLBACK MileCirnoSetEndOfFile(
     _In_ LONGLONG ByteOffset,
     _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
 {
+    if (g_WriteProtected)
+    {
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    }
+
     UNREFERENCED_PARAMETER(FileName);
 
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
     {
         return STATUS_INVALID_HANDLE;
     }
+    std::uint32_t FileId = Context->FileId;
 
     Mile::Cirno::SetAttributesRequest Request = {};
     Request.FileId = FileId;
     Request.Valid = MileCirnoLinuxSetAttributesFlagSize;
     Request.FileSize = ByteOffset;
-    return ::ToNtStatus(g_Instance->SetAttributes(Request));
+    std::uint32_t ErrorCode = g_Instance->SetAttributes(Request);
+    if (0 == ErrorCode)
+    {
+        ::DiscardInitialContent(Context);
+        ::InvalidatePersistentCacheSegment(Context);
+        ::InvalidateCachedAttributes(Context->UniqueId.Path);
+    }
+    return ::ToNtStatus(ErrorCode);
 }
 
 NTSTATUS DOKAN_CALLBACK MileCirnoSetAllocationSize(
@@ -1159,20 +6378,32 @@ NTSTATUS DOKAN_CALLBACK MileCirnoSetAllocationSize(
     _In_ LONGLONG AllocSize,
     _Inout_ PDOKAN_FILE_INFO DokanFileInfo)
 {
+    if (g_WriteProtected)
+    {
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    }
+
     UNREFERENCED_PARAMETER(FileName);
 
-    std::uint32_t FileId = static_cast<std::uint32_t>(
-        DokanFileInfo->Context);
-    if (MILE_CIRNO_NOFID == FileId)
+    FileContext* Context = ::GetFileContext(DokanFileInfo);
+    if (!Context)
     {
         return STATUS_INVALID_HANDLE;
     }
+    std::uint32_t FileId = Context->FileId;
 
     Mile::Cirno::SetAttributesRequest Request = {};
     Request.FileId = FileId;
     Request.Valid = MileCirnoLinuxSetAttributesFlagSize;
     Request.FileSize = AllocSize;
-    return ::ToNtStatus(g_Instance->SetAttributes(Request));
+    std::uint32_t ErrorCode = g_Instance->SetAttributes(Request);
+    if (0 == ErrorCode)
+    {
+        ::DiscardInitialContent(Context);
+        ::InvalidatePersistentCacheSegment(Context);
+        ::InvalidateCachedAttributes(Context->UniqueId.Path);
+    }
+    return ::ToNtStatus(ErrorCode);
 }
 
 NTSTATUS DOKAN_CALLBACK MileCirnoGetDiskFreeSpace(
@@ -1244,10 +6475,17 @@ NTSTATUS DOKAN_CALLBACK MileCirnoGetVolumeInformation(
     if (FileSystemFlags)
     {
         *FileSystemFlags =
-            FILE_CASE_SENSITIVE_SEARCH |
             FILE_CASE_PRESERVED_NAMES |
             FILE_SUPPORTS_REMOTE_STORAGE |
             FILE_UNICODE_ON_DISK;
+        if (!g_CaseInsensitive)
+        {
+            *FileSystemFlags |= FILE_CASE_SENSITIVE_SEARCH;
+        }
+        if (g_WriteProtected)
+        {
+            *FileSystemFlags |= FILE_READ_ONLY_VOLUME;
+        }
     }
 
     if (FileSystemNameBuffer)
@@ -1280,6 +6518,7 @@ int main()
     std::string Port;
     std::string AccessName;
     std::string MountPoint;
+    std::vector<std::string> MountOptions;
 
     if (Arguments.empty() || 1 == Arguments.size())
     {
@@ -1308,7 +6547,7 @@ int main()
     }
     else if (0 == ::_stricmp(Arguments[1].c_str(), "Mount"))
     {
-        if (7 == Arguments.size() &&
+        if (7 <= Arguments.size() &&
             0 == ::_stricmp(Arguments[2].c_str(), "TCP"))
         {
             ParseSuccess = true;
@@ -1316,8 +6555,9 @@ int main()
             Port = Arguments[4];
             AccessName = Arguments[5];
             MountPoint = Arguments[6];
+            MountOptions.assign(Arguments.begin() + 7, Arguments.end());
         }
-        else if (6 == Arguments.size() &&
+        else if (6 <= Arguments.size() &&
             0 == ::_stricmp(Arguments[2].c_str(), "HvSocket"))
         {
             ParseSuccess = true;
@@ -1325,6 +6565,60 @@ int main()
             Port = Arguments[3];
             AccessName = Arguments[4];
             MountPoint = Arguments[5];
+            MountOptions.assign(Arguments.begin() + 6, Arguments.end());
+        }
+    }
+
+    for (std::string const& MountOption : MountOptions)
+    {
+        if (0 == ::_stricmp(MountOption.c_str(), "CaseInsensitive"))
+        {
+            g_CaseInsensitive = true;
+        }
+        else if (0 == ::_stricmp(MountOption.c_str(), "Immutable"))
+        {
+            g_Immutable = true;
+        }
+        else if (0 == ::_stricmp(MountOption.c_str(), "Extensions"))
+        {
+            g_Extensions = true;
+        }
+        else if (0 == ::_stricmp(MountOption.c_str(), "Compression"))
+        {
+            g_Compression = true;
+        }
+        else if (0 == ::_strnicmp(
+            MountOption.c_str(),
+            "CacheDirectory=",
+            std::strlen("CacheDirectory=")))
+        {
+            g_CacheDirectory = Mile::ToWideString(
+                CP_UTF8,
+                MountOption.substr(std::strlen("CacheDirectory=")));
+        }
+        else if (0 == ::_strnicmp(
+            MountOption.c_str(),
+            "CacheSize=",
+            std::strlen("CacheSize=")))
+        {
+            g_PersistentCacheSize = std::strtoull(
+                MountOption.c_str() + std::strlen("CacheSize="),
+                nullptr,
+                10) << 20;
+        }
+        else if (0 == ::_strnicmp(
+            MountOption.c_str(),
+            "AttributeTimeout=",
+            std::strlen("AttributeTimeout=")))
+        {
+            g_AttributeTimeout = std::chrono::milliseconds(std::strtoul(
+                MountOption.c_str() + std::strlen("AttributeTimeout="),
+                nullptr,
+                10));
+        }
+        else
+        {
+            ParseSuccess = false;
         }
     }
 
@@ -1345,23 +6639,56 @@ int main()
             "\n"
             "  Help - Show this content.\n"
             "\n"
-            "  Mount TCP [Host] [Port] [AccessName] [MountPoint]\n"
+            "  Mount TCP [Host] [Port] [AccessName] [MountPoint] <MountOptions>\n"
             "    - Mount the specific 9p share over TCP.\n"
-            "  Mount HvSocket [Port] [AccessName] [MountPoint]\n"
+            "  Mount HvSocket [Port] [AccessName] [MountPoint] <MountOptions>\n"
             "    - Mount the specific 9p share over Hyper-V Socket.\n"
             "\n"
+            "Mount Options:\n"
+            "\n"
+            "  CaseInsensitive\n"
+            "    - Look up the file names case-insensitively over the\n"
+            "      case-sensitive 9p share.\n"
+            "  Immutable\n"
+            "    - Declare the 9p share will not change while mounted, which\n"
+            "      refuses all modifications and caches the file system\n"
+            "      content without expiry.\n"
+            "  CacheDirectory=[Path]\n"
+            "    - Store the file content read from the 9p share in the\n"
+            "      specific directory, and reuse it in later mounts if the\n"
+            "      files are not changed. The files read after mounting are\n"
+            "      also prefetched in the background on the next mount.\n"
+            "  CacheSize=[Megabytes]\n"
+            "    - Limit the size of the cache directory, and evict the least\n"
+            "      recently used files when exceeded. The default is 4096.\n"
+            "  AttributeTimeout=[Milliseconds]\n"
+            "    - Cache the file attributes for the specific time. The\n"
+            "      expired attributes are still returned immediately for the\n"
+            "      same time again while being refreshed in the background.\n"
+            "      The attributes are kept until changed if the server grants\n"
+            "      read leases with the 9P2000.L.Cirno extension.\n"
+            "  Extensions\n"
+            "    - Offer the 9P2000.L.Cirno extension to the server, which\n"
+            "      costs one more round trip when mounting if the server\n"
+            "      does not support it. The features which need the\n"
+            "      extension are not used without this option.\n"
+            "  Compression\n"
+            "    - Compress the large read and write payloads if the server\n"
+            "      supports the 9P2000.L.Cirno extension. The compression is\n"
+            "      skipped adaptively when it does not pay off on the link.\n"
+            "\n"
             "Notes:\n"
             "  - All command options are case-insensitive.\n"
             "  - Mile.Cirno will run as the NanaBox EnableHostDriverStore\n"
             "    integration mode if you don't specify another command, which\n"
             "    is equivalent to the following command:\n"
             "      Mile.Cirno Mount HvSocket 50001 HostDriverStore "
-            "%%SystemRoot%%\\System32\\HostDriverStore"
-            "\n"
+            "%%SystemRoot%%\\System32\\HostDriverStore\n"
             "Examples:\n"
             "\n"
             "  Mile.Cirno Mount TCP 192.168.1.234 12345 MyShare C:\\MyMount\n"
             "  Mile.Cirno Mount HvSocket 50001 HostDriverStore Z:\\\n"
+            "  Mile.Cirno Mount HvSocket 50001 MyShare Z:\\ CaseInsensitive\n"
             "\n");
         return 0;
     }
@@ -1371,11 +6698,41 @@ int main()
         "[INFO] Port = %s\n"
         "[INFO] AccessName = %s\n"
         "[INFO] MountPoint = %s\n"
+        "[INFO] CaseInsensitive = %s\n"
+        "[INFO] Immutable = %s\n"
+        "[INFO] CacheDirectory = %s\n"
+        "[INFO] CacheSize = %llu MiB\n"
+        "[INFO] AttributeTimeout = %lu ms\n"
+        "[INFO] Extensions = %s\n"
+        "[INFO] Compression = %s\n"
         "\n",
         Host.c_str(),
         Port.c_str(),
         AccessName.c_str(),
-        MountPoint.c_str());
+        MountPoint.c_str(),
+        g_CaseInsensitive ? "Yes" : "No",
+        g_Immutable ? "Yes" : "No",
+        g_CacheDirectory.empty()
+            ? "None"
+            : Mile::ToString(CP_UTF8, g_CacheDirectory.wstring()).c_str(),
+        static_cast<unsigned long long>(g_PersistentCacheSize >> 20),
+        static_cast<unsigned long>(g_AttributeTimeout.count()),
+        g_Extensions ? "Yes" : "No",
+        g_Compression ? "Yes" : "No");
+
+    if (!g_CacheDirectory.empty())
+    {
+        std::error_code ErrorCode;
+        std::filesystem::create_directories(g_CacheDirectory, ErrorCode);
+        if (ErrorCode)
+        {
+            std::printf(
+                "[ERROR] Failed to create the cache directory (%d).\n",
+                ErrorCode.value());
+            return -1;
+        }
+        ::LoadPersistentCacheFiles();
+    }
 
     auto CleanupHandler = Mile::ScopeExitTaskHandler([&]()
     {
@@ -1410,22 +6767,39 @@ int main()
 
     try
     {
-        if (0 == ::_stricmp(Host.c_str(), "HvSocket"))
-        {
-            g_Instance = Mile::Cirno::Client::ConnectWithHyperVSocket(
-                Mile::ToUInt32(Port));
-        }
-        else
-        {
-            g_Instance = Mile::Cirno::Client::ConnectWithTcpSocket(Host, Port);
-        }
+        g_Instance = ::ConnectToServer(Host, Port);
 
         {
-            Mile::Cirno::VersionRequest Request;
-            Request.MaximumMessageSize = g_MaximumMessageSize;
-            Request.ProtocolVersion = Mile::Cirno::DefaultProtocolVersion;
+            // Offer the extended version string first if requested, then
+            // the 9P2000.W one, and negotiate again with the next one if the
+            // server does not accept it, which is allowed because Tversion
+            // starts a new session.
+            std::vector<std::string> ProtocolVersions;
+            if (g_Extensions)
+            {
+                ProtocolVersions.push_back(
+                    Mile::Cirno::ExtendedProtocolVersion);
+            }
+            ProtocolVersions.push_back(Mile::Cirno::WindowsProtocolVersion);
+            ProtocolVersions.push_back(Mile::Cirno::DefaultProtocolVersion);
             Mile::Cirno::VersionResponse Response = {};
-            if (0 != g_Instance->Version(Request, Response))
+            std::uint32_t ErrorCode = 0;
+            for (std::string const& ProtocolVersion : ProtocolVersions)
+            {
+                Mile::Cirno::VersionRequest Request;
+                Request.MaximumMessageSize = g_MaximumMessageSize;
+                Request.ProtocolVersion = ProtocolVersion;
+                Response = {};
+                ErrorCode = g_Instance->Version(Request, Response);
+                if (0 == ErrorCode && (
+                    ProtocolVersion == Response.ProtocolVersion ||
+                    Mile::Cirno::DefaultProtocolVersion ==
+                    Response.ProtocolVersion))
+                {
+                    break;
+                }
+            }
+            if (0 != ErrorCode)
             {
                 std::printf("[ERROR] Version negotiation failed.\n");
                 return -1;
@@ -1435,7 +6809,15 @@ int main()
                 "[INFO] VersionResponse.MaximumMessageSize = %u\n",
                 Response.ProtocolVersion.c_str(),
                 Response.MaximumMessageSize);
-            if (Mile::Cirno::DefaultProtocolVersion != Response.ProtocolVersion)
+            g_CompoundSupported = Mile::Cirno::ExtendedProtocolVersion ==
+                Response.ProtocolVersion;
+            g_CopyRangeSupported = g_CompoundSupported;
+            g_AppendSupported = g_CompoundSupported;
+            g_WindowsProtocolSupported = Mile::Cirno::WindowsProtocolVersion ==
+                Response.ProtocolVersion;
+            if (!g_CompoundSupported &&
+                !g_WindowsProtocolSupported &&
+                Mile::Cirno::DefaultProtocolVersion != Response.ProtocolVersion)
             {
                 std::printf("[ERROR] The protocol version is not supported.\n");
                 return -1;
@@ -1445,6 +6827,7 @@ int main()
 
         if (0 != ::SimpleAttach(
             g_RootDirectoryFileId,
+            g_RootDirectoryUniqueId,
             MILE_CIRNO_NOFID,
             "",
             AccessName,
@@ -1456,6 +6839,40 @@ int main()
 
         g_AccessName = AccessName;
 
+        ::ProbeServerCapabilities();
+        g_WriteProtected = g_Immutable;
+        std::printf(
+            "[INFO] Capabilities.MaximumWalkElements = %zu\n"
+            "[INFO] Capabilities.MaximumMessageSize = %u\n"
+            "[INFO] Capabilities.ReadOnly = %s\n"
+            "[INFO] Capabilities.WindowsOpen = %s\n"
+            "[INFO] Capabilities.WindowsReadDirectory = %s\n"
+            "[INFO] Capabilities.Compound = %s\n"
+            "\n",
+            g_MaximumWalkElements,
+            g_MaximumMessageSize,
+            g_ReadOnlyShare ? "Yes" : "No",
+            g_WindowsOpenSupported ? "Yes" : "No",
+            g_WindowsReadDirectorySupported ? "Yes" : "No",
+            g_CompoundSupported ? "Yes" : "No");
+
+        if (g_CompoundSupported && ::IsAttributeCacheEnabled())
+        {
+            ::ConnectLeaseNotification(Host, Port);
+            std::printf(
+                "[INFO] Capabilities.Lease = %s\n"
+                "\n",
+                g_LeaseSupported ? "Yes" : "No");
+        }
+
+        if (g_Compression && g_CompoundSupported)
+        {
+            std::printf(
+                "[INFO] Capabilities.Compression = %s\n"
+                "\n",
+                g_Instance->EnableCompression() ? "Yes" : "No");
+        }
+
         g_VolumeSerialNumber = ::CalculateFnv1aHash(Mile::FormatString(
             "Mile.Cirno://%s:%s/%s",
             Host.c_str(),
@@ -1472,9 +6889,15 @@ int main()
     DOKAN_OPTIONS Options = {};
     Options.Version = DOKAN_VERSION;
     Options.SingleThread;
-    Options.Options =
-        DOKAN_OPTION_MOUNT_MANAGER |
-        DOKAN_OPTION_CASE_SENSITIVE;
+    Options.Options = DOKAN_OPTION_MOUNT_MANAGER;
+    if (!g_CaseInsensitive)
+    {
+        Options.Options |= DOKAN_OPTION_CASE_SENSITIVE;
+    }
+    if (g_WriteProtected)
+    {
+        Options.Options |= DOKAN_OPTION_WRITE_PROTECT;
+    }
     Options.GlobalContext;
     Options.MountPoint = ConvertedMountPoint.c_str();
     Options.UNCName;
@@ -1508,7 +6931,7 @@ int main()
         ::OutputDebugStringW(Mile::FormatWideString(
             L"[Mile.Cirno] "
             L"ZwCreateFile(\"%s\") = 0x%08X, "
-            L"FileId = %llu, "
+            L"Context = %llu, "
             L"ProcessId = %lu\n",
             FileName,
             Status,
@@ -1651,7 +7074,27 @@ int main()
 #endif // !NDEBUG
         return Status;
     };
-    Operations.FindFilesWithPattern = nullptr;
+    Operations.FindFilesWithPattern = [](
+        _In_ LPCWSTR PathName,
+        _In_ LPCWSTR SearchPattern,
+        _In_ PFillFindData FillFindData,
+        _Inout_ PDOKAN_FILE_INFO DokanFileInfo) -> NTSTATUS
+    {
+        NTSTATUS Status = ::MileCirnoFindFilesWithPattern(
+            PathName,
+            SearchPattern,
+            FillFindData,
+            DokanFileInfo);
+#ifndef NDEBUG
+        ::OutputDebugStringW(Mile::FormatWideString(
+            L"[Mile.Cirno] "
+            L"FindFilesWithPattern(%llu, \"%s\") = 0x%08X\n",
+            DokanFileInfo->Context,
+            SearchPattern,
+            Status).c_str());
+#endif // !NDEBUG
+        return Status;
+    };
     Operations.SetFileAttributesW = [](
         _In_ LPCWSTR FileName,
         _In_ DWORD FileAttributes,
@@ -1838,7 +7281,64 @@ int main()
     Operations.GetFileSecurityW;
     Operations.SetFileSecurityW;
     Operations.FindStreams;
+    std::thread PrefetchThread;
+    if (!g_CacheDirectory.empty())
+    {
+        g_PrefetchRecording = true;
+        PrefetchThread = std::thread(::RunPrefetch);
+    }
+    std::thread ImagePrefetchThread;
+    if (g_Immutable || !g_CacheDirectory.empty())
+    {
+        ImagePrefetchThread = std::thread(::RunImagePrefetchWorker);
+    }
+    std::thread AttributeRefreshThread;
+    if (::IsAttributeCacheEnabled())
+    {
+        AttributeRefreshThread = std::thread(::RunAttributeRefresh);
+    }
+    std::thread LeaseNotificationThread;
+    if (g_LeaseSupported)
+    {
+        LeaseNotificationThread = std::thread(::RunLeaseNotification);
+    }
+
     int DokanStatus = ::DokanMain(&Options, &Operations);
+
+    {
+        std::lock_guard<std::mutex> Guard(g_PrefetchMutex);
+        g_PrefetchStopping = true;
+    }
+    g_PrefetchCondition.notify_all();
+    if (PrefetchThread.joinable())
+    {
+        PrefetchThread.join();
+    }
+    if (ImagePrefetchThread.joinable())
+    {
+        ImagePrefetchThread.join();
+    }
+    {
+        std::lock_guard<std::mutex> Guard(g_CachedAttributesMutex);
+        g_AttributeRefreshStopping = true;
+    }
+    g_AttributeRefreshCondition.notify_all();
+    if (AttributeRefreshThread.joinable())
+    {
+        AttributeRefreshThread.join();
+    }
+    if (g_NotificationInstance)
+    {
+        // Unblock the pending Tnotify.
+        g_NotificationInstance->Disconnect();
+        if (LeaseNotificationThread.joinable())
+        {
+            LeaseNotificationThread.join();
+        }
+        delete g_NotificationInstance;
+        g_NotificationInstance = nullptr;
+    }
+    ::ClearCachedWalkFileIds();
     switch (DokanStatus)
     {
     case DOKAN_SUCCESS: